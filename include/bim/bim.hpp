@@ -4,12 +4,17 @@
 #include "material.hpp"
 #include "scenario.hpp"
 #include "camera.hpp"
+#include "nameindex.hpp"
 #include "../deps/json/json_fwd.hpp"
 #include <fstream>
+#include <functional>
+#include <mutex>
 #include <ei/3dtypes.hpp>
 
 namespace bim {
 
+	class JsonReader;
+
 	using Json = nlohmann::basic_json<std::map, std::vector, std::string, bool, std::int64_t,
 		std::uint64_t, float, std::allocator, nlohmann::adl_serializer>;
 
@@ -44,6 +49,11 @@ namespace bim {
 		/// Referenced binary data will be ignored.
 		/// \param [in] _envFile A JSON file.
 		void loadEnvironmentFile(const char* _envFile);
+		/// If enabled, the parsed environment is stored in a binary file next to
+		/// the JSON file (<_envFile>.cache). Later loads use it as long as the
+		/// JSON file is unchanged. Disabled by default, because it writes into
+		/// the directory of the scene.
+		void setEnvironmentCacheEnabled(bool _enable) { m_useEnvCache = _enable; }
 		
 		/// Stores global information like material and lights.
 		/// \param [in] _bimFile Name of the binary file which should be referenced by
@@ -57,12 +67,22 @@ namespace bim {
 		void storeChunk(const char* _bimFile, const ei::IVec3& _chunkPos);
 
 		const ei::IVec3& getNumChunks() const { return m_numChunks; }
+		/// Access a resident chunk for reading or editing. This invalidates the
+		/// top level hierarchy, call buildChunkHierarchy() after the changes.
 		Chunk* getChunk(const ei::IVec3& _chunkPos);
 		
 		/// Check if a chunk is loaded and if not do it.
 		void makeChunkResident(const ei::IVec3& _chunkPos);
-		/// Schedule a load task if necessary.
+		/// Request a load of the chunk. The request is queued and must be serviced
+		/// by the caller: takeChunkRequests() and makeChunkResident().
 		void makeChunkResidentAsync(const ei::IVec3& _chunkPos);
+		/// Return all requested chunks and clear the queue.
+		/// This must not be called while rays are traced.
+		std::vector<ei::IVec3> takeChunkRequests();
+		/// Optional notification for each newly queued request (e.g. to wake up a
+		/// loader thread). The callback is invoked by the requesting thread, which
+		/// can be any thread tracing rays with ChunkMissPolicy::REQUEST.
+		void setChunkRequestCallback(std::function<void(const ei::IVec3&)> _callback) { m_chunkRequestCallback = move(_callback); }
 		bool isChunkResident(const ei::IVec3& _chunkPos) const;
 		/// Mark a chunk as unused. It might get deleted if memory is required.
 		void realeaseChunk(const ei::IVec3& _chunkPos);
@@ -72,6 +92,32 @@ namespace bim {
 		/// When editing the model bounding box is not always up to date. Make sure it is.
 		void refreshBoundingBox();
 
+		/// What to do if a ray hits the bounding box of a chunk which is not resident.
+		enum class ChunkMissPolicy
+		{
+			SKIP,		///< Ignore the chunk. Results are incomplete.
+			REQUEST,	///< Queue a request like makeChunkResidentAsync() and ignore the chunk for now.
+		};
+		void setChunkMissPolicy(ChunkMissPolicy _policy) { m_chunkMissPolicy = _policy; }
+		ChunkMissPolicy getChunkMissPolicy() const { return m_chunkMissPolicy; }
+
+		/// Build the top level hierarchy over the bounding boxes of all chunks.
+		/// This is done by load() and makeChunkResident(). It must be called
+		/// after getChunk() (e.g. after changing the geometry of a chunk) and
+		/// before the next intersect() or occluded().
+		void buildChunkHierarchy();
+		/// Find the closest hit of a ray in the entire scene. The ray traverses a
+		/// hierarchy over all chunks and then the hierarchies of the hit chunks.
+		/// Non-resident chunks are handled according to the ChunkMissPolicy.
+		/// The model is not changed, so rays can be traced from multiple threads.
+		/// Fails if the top level hierarchy is outdated (see buildChunkHierarchy()).
+		/// \param [out] _chunkPos The chunk containing the hit triangle (_hit.leafTriangle
+		///		refers to the leaf array of that chunk).
+		/// \return true if anything was hit.
+		bool intersect(const ei::Ray& _ray, Hit& _hit, ei::IVec3& _chunkPos, float _maxDistance = 1e30f) const;
+		/// Check if there is any hit with a distance in (0, _maxDistance) in any chunk.
+		bool occluded(const ei::Ray& _ray, float _maxDistance = 1e30f) const;
+
 		/// Get a material by its index (the same as used int TRIANGLE_MAT).
 		/// The index is guaranteed to be non changing.
 		Material* getMaterial(uint _index) { auto it = m_materials.find(m_materialIndirection[_index]); if(it != m_materials.end()) return &it->second; else return nullptr; }
@@ -79,9 +125,20 @@ namespace bim {
 		Material* addMaterial(const Material& _material);
 		uint getNumUsedMaterials() const { return static_cast<uint>(m_materialIndirection.size()); }
 		/// Get the index of a named material. If the material is not found -1 is returned.
-		int getUniqueMaterialIndex(const std::string& _name);
+		int getUniqueMaterialIndex(std::string_view _name);
 		Material* getMaterial(const std::string& _name) { auto it = m_materials.find(_name); if(it != m_materials.end()) return &it->second; else return nullptr; }
 		const Material* getMaterial(const std::string& _name) const { auto it = m_materials.find(_name); if(it != m_materials.end()) return &it->second; else return nullptr; }
+		/// Build the compiled material table from all indexed materials.
+		/// This is done by load() and loadEnvironmentFile(). Call it again after
+		/// adding materials or material indices, otherwise the table is outdated.
+		void compileMaterials();
+		/// Fast read-only access to the materials with the same indices as TRIANGLE_MAT.
+		const MaterialTable& getMaterialTable() const { return m_materialTable; }
+		/// Serialize all indexed materials into one versioned buffer. The layout
+		/// is described at PACKED_MATERIAL_VERSION (material.hpp).
+		/// \return false if some material has an unknown type or property. Such
+		///		materials cannot be represented in the fixed layouts.
+		bool packMaterials(std::vector<uint32>& _blob) const;
 
 		const ei::Box& getBoundingBox() const { return m_boundingBox; }
 		/// Allows an external update of the bounding box for out of core building purposes.
@@ -98,24 +155,43 @@ namespace bim {
 		uint getNumScenarios() const { return static_cast<uint>(m_scenarios.size()); }
 		/// Scenarios can be accessed by index or by name (by index is faster)
 		Scenario* getScenario(uint _index);
-		Scenario* getScenario(const std::string& _name);
+		Scenario* getScenario(std::string_view _name);
 		/// Create a new scenario and obtain its reference
 		Scenario* addScenario(const std::string& _name);
+		/// Build the light sampling structures of all scenarios (see LightTree).
+		/// storeBinaryHeader() stores all built trees and load() restores them
+		/// if the lights did not change.
+		void buildLightTrees();
 
 		uint getNumLights() const { return static_cast<uint>(m_lights.size()); }
 		/// Lights can be accessed by index or by name (by index is faster)
 		std::shared_ptr<Light> getLight(uint _index);
 		std::shared_ptr<const Light> getLight(uint _index) const { return const_cast<BinaryModel*>(this)->getLight(_index); }
-		std::shared_ptr<Light> getLight(const std::string& _name);
-		std::shared_ptr<const Light> getLight(const std::string& _name) const { return const_cast<BinaryModel*>(this)->getLight(_name); }
+		std::shared_ptr<Light> getLight(std::string_view _name);
+		std::shared_ptr<const Light> getLight(std::string_view _name) const { return const_cast<BinaryModel*>(this)->getLight(_name); }
+		/// The name of the light must not change afterwards, otherwise it is
+		/// not found by getLight(name).
 		void addLight(std::shared_ptr<Light> _light);
 
 		void addCamera(std::shared_ptr<Camera> _camera);
 	private:
 		std::string loadEnv(const char* _envFile, bool _ignoreBinary);
-		void loadMaterial(const Json& _node, const std::string& _name);
-		void loadLight(const Json& _node, const std::string& _name);
-		void loadCamera(const Json& _node, const std::string& _name);
+		void loadMaterial(JsonReader& _reader, const std::string& _name);
+		void loadLight(JsonReader& _reader, const std::string& _name);
+		void loadCamera(JsonReader& _reader, const std::string& _name);
+		// Load the materials from the packed section of a .bim file.
+		// Returns false if there is no such section.
+		bool loadPackedMaterials(const std::string& _bimFile);
+		bool unpackMaterials(const uint32* _blob, size_t _numWords);
+		// Serialize the non-empty light trees of all scenarios (bim_lighttree.cpp).
+		bool packLightTrees(std::vector<uint32>& _blob) const;
+		void unpackLightTrees(const uint32* _blob, size_t _numWords);
+		// Append a name to m_materialIndirection and return its index.
+		uint addMaterialIndex(const std::string& _name);
+		// Binary copy of the parsed environment file (bim_envcache.cpp).
+		bool loadEnvCache(const char* _envFile, bool _ignoreBinary, std::string& _binarySceneFile);
+		void storeEnvCache(const char* _envFile, const std::string& _content, const std::string& _binarySceneFile,
+			Property::Val _accelerator, const std::vector<std::string>* _materials, size_t _firstScenario, size_t _firstLight, size_t _firstCamera);
 
 		enum class ChunkState {
 			LOADED,
@@ -131,14 +207,34 @@ namespace bim {
 		std::vector<Chunk> m_chunks;
 		std::unordered_map<std::string, Material> m_materials;
 		std::vector<std::string> m_materialIndirection;
+		NameIndex m_materialIndex;		///< Inverse of m_materialIndirection
+		MaterialTable m_materialTable;
 		std::vector<std::shared_ptr<Light>> m_lights;
 		std::vector<std::shared_ptr<Camera>> m_cameras;
 		std::vector<Scenario> m_scenarios;
+		NameIndex m_lightIndex;
+		NameIndex m_scenarioIndex;
 		Property::Val m_requestedProps;	///< All properties for which the getter should succeed.
 		Property::Val m_optionalProperties;
 		Property::Val m_accelerator;	///< Chosen kind of acceleration structure (specified by environment file)
 		bool m_loadAll;					///< If a chunk is loaded, load all available data or only the required part
 		ei::Box m_boundingBox;
+		std::vector<Node> m_chunkHierarchy;	///< Top level hierarchy. Leaves (first bit set) contain chunk indices instead of leaf indices.
+		std::vector<ei::Box> m_chunkHierarchyBoxes;
+		bool m_chunkHierarchyDirty;			///< A chunk may have changed since the last buildChunkHierarchy()
+		ChunkMissPolicy m_chunkMissPolicy;
+		mutable std::mutex m_chunkRequestMutex;
+		mutable std::vector<uint32> m_chunkRequests;	///< Chunk indices, guarded by m_chunkRequestMutex
+		std::function<void(const ei::IVec3&)> m_chunkRequestCallback;
+		bool m_useEnvCache;
+
+		// Visit all resident chunks hit by the ray in the order of the top level
+		// hierarchy. The callback gets the chunk index, its position and the current
+		// maximum distance and returns the new one (negative to stop).
+		template<typename F>
+		void traverseChunks(const ei::Ray& _ray, float _maxDistance, F _chunkCallback) const;
+		// Add a chunk to the request queue (thread safe).
+		void requestChunk(uint32 _chunkIdx) const;
 	};
 
 }
@@ -15,13 +15,14 @@ namespace bim {
 			NORMAL			= 0x00000002,
 			TANGENT			= 0x00000004,
 			BITANGENT		= 0x00000008,
-			QORMAL			= 0x00000010,	///< Compressed tangent space in Quaternion form.
+			QORMAL			= 0x00000010,	///< Compressed tangent space in Quaternion form. The rotation has the normal as x-axis, the tangent as y-axis and the bitangent as z-axis. Mirrored tangent spaces store the negated bitangent. The signs are unified such that the three qormals of each triangle lie in the same hemisphere (interpolation is valid).
 			//COMPRESSED_TS	= 0x00000400,	///< Compressed tangent space. This stores (phi, cos(theta)) for normal and tangent vector. The sign of the bitangent (cross(normal, tangent)) is encoded in phi_t [-2pi,2pi]. The reconstruction is made by n=(sin(theta_n)*sin(phi_n), sin(theta_n)*cos(phi_n), cos(theta_n)), t=(sin(theta_t)*sin(phi_t), sin(theta_t)*cos(phi_t), cos(theta_t)) and b = cross(n,t) * sign(phi_t).
 			TEXCOORD0		= 0x00000020,
 			TEXCOORD1		= 0x00000040,
 			TEXCOORD2		= 0x00000080,
 			TEXCOORD3		= 0x00000100,
 			COLOR			= 0x00000200,
+			QORMAL16		= 0x00000800,	///< QORMAL quantised to 4x16 bit signed normalized integers (see encodeQormal16()).
 			
 			// Triangle Properties:
 			TRIANGLE_IDX	= 0x00010000,	///< The three indices of vertices
@@ -33,6 +34,8 @@ namespace bim {
 			SPHERE_BVH		= 0x04000000,
 			HIERARCHY		= 0x08000000,	///< Node and Leaves array for the hierarchy
 			NDF_SGGX		= 0x10000000,	///< Normal distribution functions for the hierarchy in SGGX basis
+			COMPRESSED_BVH	= 0x20000000,	///< Standalone hierarchy with 8-bit quantised child boxes (see CompressedNode). Uses the leaves of HIERARCHY.
+			LEAF_TRIANGLES	= 0x40000000,	///< Precomputed intersection data for the leaves of HIERARCHY (see TriangleBlock).
 		};
 	};
 	
@@ -58,12 +61,103 @@ namespace bim {
 		ei::Vec<uint16, 3> r;		///< Values in [-1,1] discretized to 16 bit (the interval is shifted by *0.5-0.5 to fit the same format like σ)
 	};
 
+	/// An inner node of the compressed hierarchy with the boxes of its two children.
+	/// \details The child boxes are quantised to 8 bit on a local grid which
+	///		covers the union of both children:
+	///		box.min = origin + childMin * 2^exponent
+	///		box.max = origin + childMax * 2^exponent
+	///		The quantisation rounds outward, so the decoded boxes always contain
+	///		the exact ones. Use decodeChildBox() to get a box during traversal.
+	///
+	///		The root is always the compressed node 0. Nodes are stored in preorder
+	///		and a traversal needs a stack of compressed node indices.
+	struct CompressedNode
+	{
+		ei::Vec3 origin;				///< Lower corner of the quantisation grid
+		ei::Vec<int8, 3> exponent;		///< Grid spacing 2^exponent per dimension
+		uint8 padding;
+		ei::Vec<uint8, 3> childMin[2];	///< Quantised lower corners of the two children
+		ei::Vec<uint8, 3> childMax[2];	///< Quantised upper corners of the two children
+		uint32 child[2];				///< Index of the compressed child node. If the first bit is set this is a leaf index (like Node::firstChild). An unused slot (root is a leaf) is ~0.
+	};
+
+	/// Get 2^_exponent for the exponents of a CompressedNode in [-126,127].
+	inline float compressedNodeScale(int8 _exponent)
+	{
+		uint32 bits = uint32(_exponent + 127) << 23;
+		return *reinterpret_cast<const float*>(&bits);
+	}
+
+	/// Dequantise the box of a child (0 or 1) of a compressed node.
+	inline ei::Box decodeChildBox(const CompressedNode& _node, int _child)
+	{
+		ei::Vec3 scale(compressedNodeScale(_node.exponent.x),
+					   compressedNodeScale(_node.exponent.y),
+					   compressedNodeScale(_node.exponent.z));
+		return ei::Box(_node.origin + ei::Vec3(_node.childMin[_child]) * scale,
+					   _node.origin + ei::Vec3(_node.childMax[_child]) * scale);
+	}
+
+	/// Quantise a unit quaternion (i, j, k, r) to 16 bit signed normalized integers.
+	inline ei::Vec<int16, 4> encodeQormal16(const ei::Quaternion& _q)
+	{
+		ei::Vec4 q(_q.i, _q.j, _q.k, _q.r);
+		ei::Vec<int16, 4> res;
+		for(int c = 0; c < 4; ++c)
+			res[c] = int16(std::floor(ei::clamp(q[c], -1.0f, 1.0f) * 32767.0f + 0.5f));
+		return res;
+	}
+
+	/// Reconstruct the unit quaternion from QORMAL16.
+	inline ei::Quaternion decodeQormal16(const ei::Vec<int16, 4>& _q)
+	{
+		return ei::normalize(ei::Quaternion(_q.x / 32767.0f, _q.y / 32767.0f, _q.z / 32767.0f, _q.w / 32767.0f));
+	}
+
+	/// Four consecutive entries of the leaf array (getLeafNodes()) prepared for
+	/// intersection tests.
+	/// \details Block i contains the leaf entries 4i to 4i+3 in SoA layout:
+	///		the first vertex and the two edges v1-v0 and v2-v0. Lanes behind the
+	///		last entry are degenerated (all zero). Since leaves are not aligned
+	///		to blocks, a leaf can span two blocks.
+	struct TriangleBlock
+	{
+		float v0[3][4];
+		float e1[3][4];
+		float e2[3][4];
+	};
+
+	/// Quality measures of a hierarchy (see Chunk::analyzeHierarchy()).
+	/// \details The costs use 1.2 per inner node and 1 per triangle in a leaf.
+	struct HierarchyStatistics
+	{
+		float sahCost;				///< Expected costs of a random ray hitting the root (surface area heuristic).
+		float epo;					///< Effective parent overlap: costs of triangle surface inside nodes which do not reference the triangle, relative to the total triangle surface.
+		float siblingOverlap;		///< Sum of the intersection volumes of sibling boxes relative to the volume of the root.
+		uint numInnerNodes;
+		uint numLeafNodes;
+		uint numTriangleReferences;	///< Number of leaf entries.
+		float bytesPerTriangle;		///< Memory of all hierarchy arrays which exist in the chunk per triangle.
+		std::vector<uint> leafSizeHistogram;	///< Number of leaves with i triangles.
+		std::vector<uint> leafDepthHistogram;	///< Number of leaves in depth i (the root has depth 0).
+	};
+
+	/// Result of a closest hit query.
+	struct Hit
+	{
+		float distance;			///< Ray parameter of the hit point (in units of the ray direction length). Set to the maximum distance of the query if nothing was hit.
+		uint32 leafTriangle;	///< Index of the hit triangle in the leaf array (getLeafNodes()) or ~0 if nothing was hit.
+		ei::Vec2 barycentric;	///< Barycentric coordinates of the hit point with respect to the second and third vertex of the triangle.
+	};
+
 
 	class Chunk
 	{
 	public:
 		Chunk(class BinaryModel* _parent = nullptr);
 
+		Property::Val getProperties() const			{ return m_properties; }
+
 		uint getNumVertices() const					{ return (uint)m_positions.size(); }
 		ei::Vec3* getPositions()					{ return m_positions.empty() ? nullptr : m_positions.data(); }
 		const ei::Vec3* getPositions() const		{ return m_positions.empty() ? nullptr : m_positions.data(); }
@@ -75,6 +169,8 @@ namespace bim {
 		const ei::Vec3* getBitangents() const		{ return m_bitangents.empty() ? nullptr : m_bitangents.data(); }
 		ei::Quaternion* getQormals()				{ return m_qormals.empty() ? nullptr : m_qormals.data(); }
 		const ei::Quaternion* getQormals() const	{ return m_qormals.empty() ? nullptr : m_qormals.data(); }
+		ei::Vec<int16,4>* getQormals16()			{ return m_qormals16.empty() ? nullptr : m_qormals16.data(); }
+		const ei::Vec<int16,4>* getQormals16() const { return m_qormals16.empty() ? nullptr : m_qormals16.data(); }
 		ei::Vec2* getTexCoords0()					{ return m_texCoords0.empty() ? nullptr : m_texCoords0.data(); }
 		const ei::Vec2* getTexCoords0() const		{ return m_texCoords0.empty() ? nullptr : m_texCoords0.data(); }
 		ei::Vec2* getTexCoords1()					{ return m_texCoords1.empty() ? nullptr : m_texCoords1.data(); }
@@ -102,8 +198,12 @@ namespace bim {
 		const uint32* getHierarchyParents() const	{ return m_hierarchyParents.empty() ? nullptr : m_hierarchyParents.data(); }
 		const ei::Box* getHierarchyAABoxes() const	{ return m_aaBoxes.data(); }
 		const ei::OBox* getHierarchyOBoxes() const	{ return m_oBoxes.data(); }
+		const ei::Sphere* getHierarchySpheres() const { return m_spheres.data(); }
 		const ei::UVec4* getLeafNodes() const		{ return m_hierarchyLeaves.data(); }
 		const SGGX* getNodeNDFs() const				{ return m_nodeNDFs.empty() ? nullptr : m_nodeNDFs.data();}
+		uint getNumCompressedNodes() const			{ return (uint)m_compressedNodes.size(); }
+		const CompressedNode* getCompressedHierarchy() const { return m_compressedNodes.empty() ? nullptr : m_compressedNodes.data(); }
+		const TriangleBlock* getLeafTriangles() const { return m_leafTriangles.empty() ? nullptr : m_leafTriangles.data(); }
 
 		struct FullVertex
 		{
@@ -149,15 +249,20 @@ namespace bim {
 		/// Recomputes normals, ... dependent on which of the properties are used
 		///	in the current model.
 		/// \param [in] _components Flags for the tangent space representations
-		///		which should be computed. NORMAL, TANGENT, BITANGENT and QORMAL are
-		///		valid.
+		///		which should be computed. NORMAL, TANGENT, BITANGENT, QORMAL and
+		///		QORMAL16 are valid. Computing qormals can add vertices, if a vertex
+		///		is shared by triangles which require different signs.
 		/// \param [in] _preserveOriginals Preserves vectors which have a length of
 		///		one. These are assumed to be loaded from the file. Non existing or
 		///		invalid vectors are recomputed.
 		void computeTangentSpace(Property::Val _components, bool _preserveOriginals);
 		/// Change the sign of the normal if winding order is different than expected.
-		/// This does not change the winding order itself. NORMAL and QORMAL are modified.
+		/// This does not change the winding order itself. NORMAL, QORMAL and QORMAL16
+		/// are modified.
 		void flipNormals();
+		/// Delete vertex properties which are not needed anymore, e.g. NORMAL,
+		/// TANGENT and BITANGENT after computing QORMAL. POSITION cannot be removed.
+		void removeVertexProperties(Property::Val _properties);
 
 		enum class BuildMethod
 		{
@@ -170,10 +275,97 @@ namespace bim {
 		/// Compute bounding volumes for all nodes in the hierarchy.
 		void computeBVHAABoxes();
 		void computeBVHOBoxes();
+		/// Compute bounding spheres (SPHERE_BVH) for all nodes. Each sphere is the
+		/// smaller one of the sphere around the node's box and the sphere around
+		/// the children's spheres. Axis aligned boxes are computed first if they
+		/// are missing.
 		void computeBVHSpheres();
+		/// Compute the compressed hierarchy (COMPRESSED_BVH) from the current
+		/// hierarchy. Axis aligned boxes are computed first if they are missing.
+		void computeBVHCompressed();
 
 		void computeBVHSGGXApproximations();
 
+		/// Precompute the intersection data of all leaf triangles
+		/// (LEAF_TRIANGLES). The ray queries use them instead of the vertex
+		/// positions if available. Rebuilding the hierarchy removes them and a
+		/// refit updates them.
+		void computeLeafTriangles();
+
+		/// Recompute the axis aligned boxes of all nodes after vertices were moved.
+		/// The topology of the hierarchy is not changed. Other bounding volumes
+		/// (OBOX_BVH, SPHERE_BVH, COMPRESSED_BVH, NDF_SGGX) are not updated, but
+		/// LEAF_TRIANGLES are.
+		/// \return Estimated quality degradation: SAH cost of the refitted hierarchy
+		///		relative to the cost before the first refit. 1 means no change. If
+		///		it grows beyond ~1.5, a new buildHierarchy() is usually worthwhile.
+		float refitHierarchy();
+		/// Refit only the nodes which contain vertices or triangles from the given ranges.
+		/// \details The cost is proportional to the number of changed nodes. The
+		///		first call after a (re)build creates a vertex to leaf map in O(n).
+		/// \param [in] _dirtyRanges Half open ranges [x, y) of vertex or triangle indices.
+		/// \param [in] _triangleRanges The ranges contain indices of triangles
+		///		(getTriangles()) instead of vertices.
+		float refitHierarchy(const std::vector<ei::UVec2>& _dirtyRanges, bool _triangleRanges);
+
+		/// Lower the SAH cost of the current hierarchy by treelet restructuring
+		/// ("Fast Parallel Construction of High-Quality Bounding Volume
+		/// Hierarchies", Karras and Aila). The leaves are not changed.
+		/// \details Requires a binary hierarchy. The nodes are renumbered, therefore
+		///		the axis aligned boxes are recomputed and all other per node data
+		///		(OBOX_BVH, SPHERE_BVH, NDF_SGGX, COMPRESSED_BVH) is removed. Call this before
+		///		computing them.
+		/// \param [in] _iterations Maximum number of bottom-up sweeps. Stops early
+		///		if a sweep does not change anything.
+		void optimizeHierarchy(uint _iterations);
+
+		enum class NodeLayout
+		{
+			DEPTH_FIRST,	///< Preorder with the first child directly behind its parent.
+			VAN_EMDE_BOAS,	///< Cache oblivious: the upper half of the levels first, then each of the subtrees below recursively.
+			CLUSTERED,		///< Subtrees of up to 32 nodes in breadth first order with adjacent siblings. The clusters are in depth first order.
+		};
+		/// Renumber the nodes of the hierarchy for a better memory locality
+		/// during traversal. The topology and the escape order do not change.
+		/// All per node data (AABOX_BVH, OBOX_BVH, SPHERE_BVH, NDF_SGGX) is
+		/// permuted accordingly. COMPRESSED_BVH has its own numbering and is not
+		/// affected.
+		void reorderHierarchy(NodeLayout _layout);
+
+		/// Compute quality measures of the current hierarchy. Requires HIERARCHY
+		/// and AABOX_BVH.
+		HierarchyStatistics analyzeHierarchy() const;
+
+		/// Find the closest intersection of a ray with the triangles of this chunk.
+		/// \details This uses the stackless escape pointer traversal of the
+		///		AABOX_BVH. If only the COMPRESSED_BVH is available it is used instead.
+		///		Triangles are hit from both sides.
+		/// \param [in] _maxDistance Only hits with a distance in (0, _maxDistance) are found.
+		/// \return true if anything was hit.
+		bool intersect(const ei::Ray& _ray, Hit& _hit, float _maxDistance = 1e30f) const;
+		/// Check if there is any hit with a distance in (0, _maxDistance). This stops
+		/// at the first hit found and is therefore faster than intersect().
+		bool occluded(const ei::Ray& _ray, float _maxDistance = 1e30f) const;
+		/// Closest hit queries for many rays at once. The rays are distributed
+		/// over all threads.
+		void intersect(const ei::Ray* _rays, Hit* _hits, uint _numRays, float _maxDistance = 1e30f) const;
+
+		/// Maximum number of rays which traverse together in the packet queries.
+		static const uint RAY_PACKET_SIZE = 16;
+		/// Closest hit queries for coherent rays (e.g. primary rays of neighbouring
+		/// pixels). Groups of RAY_PACKET_SIZE rays traverse the AABOX_BVH together.
+		/// If all rays of a packet have the same direction signs, a single interval
+		/// test culls nodes for the whole packet before the per-ray tests.
+		void intersectPacket(const ei::Ray* _rays, Hit* _hits, uint _numRays, float _maxDistance = 1e30f) const;
+		/// Occlusion queries for coherent rays (e.g. shadow rays towards one light).
+		/// \param [in] _maxDistances One maximum distance per ray.
+		void occludedPacket(const ei::Ray* _rays, const float* _maxDistances, bool* _occluded, uint _numRays) const;
+		/// Closest hit queries for a large number of rays. The rays traverse the
+		/// AABOX_BVH as a stream: at each node the rays which hit its box are
+		/// moved to the front of the active list and only those continue to the
+		/// children. Independent streams are distributed over all threads.
+		void intersectStream(const ei::Ray* _rays, Hit* _hits, uint _numRays, float _maxDistance = 1e30f) const;
+
 	private: friend class BinaryModel;
 		class BinaryModel* m_parent;
 		uint64 m_address;
@@ -184,6 +376,7 @@ namespace bim {
 		std::vector<ei::Vec3> m_tangents;
 		std::vector<ei::Vec3> m_bitangents;
 		std::vector<ei::Quaternion> m_qormals;
+		std::vector<ei::Vec<int16,4>> m_qormals16;
 		std::vector<ei::Vec2> m_texCoords0;
 		std::vector<ei::Vec2> m_texCoords1;
 		std::vector<ei::Vec2> m_texCoords2;
@@ -196,8 +389,15 @@ namespace bim {
 		std::vector<ei::UVec4> m_hierarchyLeaves;	///< 3 Vertex indices + 1 material index. The first bit of the material index is set if the next triangle in the list is part of the same leaf.
 		std::vector<ei::Box> m_aaBoxes;
 		std::vector<ei::OBox> m_oBoxes;
+		std::vector<ei::Sphere> m_spheres;
 		std::vector<SGGX> m_nodeNDFs;
+		std::vector<CompressedNode> m_compressedNodes;
+		std::vector<TriangleBlock> m_leafTriangles;
 		uint m_numTreeLevels;
+		float m_referenceSAHCost;					///< SAH cost before the first refit or 0 if not known yet.
+		double m_refitSAHSum;						///< Unnormalized SAH cost of the current boxes, maintained by partial refits. Negative if not known.
+		std::vector<uint32> m_vertexLeafOffsets;	///< Leaf nodes which reference vertex i are m_vertexLeafNodes[m_vertexLeafOffsets[i]] to m_vertexLeafNodes[m_vertexLeafOffsets[i+1]-1]. Built on the first partial refit, empty if outdated.
+		std::vector<uint32> m_vertexLeafNodes;
 
 		// Allocate space for a certain property and initialize to defaults.
 		// If the property already exists nothing is done.
@@ -206,8 +406,11 @@ namespace bim {
 		// Delete all hierarchy information, because it is outdated.
 		void invalidateHierarchy();
 		
-		// Flip qormals to align them within each triangle.
+		// Flip qormals to align them within each triangle. Vertices which are
+		// required with both signs are duplicated.
 		void unifyQormals();
+		// Append a copy of a vertex with all its properties. Returns the new index.
+		uint32 duplicateVertex(uint32 _index);
 
 		void buildBVH_kdtree(uint _maxNumTrianglesPerLeaf);
 		void buildBVH_SAHsplit(uint _maxNumTrianglesPerLeaf);
@@ -217,6 +420,21 @@ namespace bim {
 		// by the correct ones.
 		// Returns the maximum tree depth.
 		uint remapNodePointers(uint32 _this, uint32 _parent, uint32 _escape);
+
+		// Get all nodes sorted by depth (breadth first order). The nodes of level i
+		// are _nodes[_levelOffsets[i]] to _nodes[_levelOffsets[i+1]-1].
+		void computeNodeLevels(std::vector<uint32>& _nodes, std::vector<uint32>& _levelOffsets) const;
+		// SAH cost of the current AABOX_BVH (the same as in analyzeHierarchy()).
+		float computeSAHCost() const;
+		// Sum of the node costs weighted by their surface (not normalized by the root).
+		double computeSAHSum() const;
+		// Cost factor of a single node in the SAH.
+		float nodeSAHCost(uint32 _node) const;
+		// Build m_vertexLeafOffsets/m_vertexLeafNodes for the current hierarchy.
+		void buildVertexLeafMap();
+		// Recompute the boxes of the given leaf nodes and all their ancestors
+		// whose box changes. _leafNodes must be free of duplicates.
+		float refitAABoxes(const std::vector<uint32>& _leafNodes);
 	};
 	inline const ei::Vec3& positionOf(const Chunk::FullVertex& _vertex) { return _vertex.position; }
 
@@ -120,11 +120,11 @@ namespace bim {
 	{
 	public:
 		explicit SkyLight(std::string _name = "") :
-			Light(Type::SPOT, move(_name))
+			Light(Type::SKY, move(_name))
 		{}
 
 		SkyLight(const ei::Vec3& _sunDirection, float _turbidity, bool _aerialPerspective, std::string _name = "") :
-			Light(Type::SPOT, move(_name)),
+			Light(Type::SKY, move(_name)),
 			sunDirection(_sunDirection),
 			turbidity(_turbidity),
 			aerialPerspective(_aerialPerspective)
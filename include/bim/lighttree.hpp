@@ -0,0 +1,98 @@
+#pragma once
+
+#include "light.hpp"
+#include <ei/vector.hpp>
+#include <vector>
+#include <memory>
+
+namespace bim {
+
+	/// Sampling structures for many lights of one scenario.
+	/// \details Only point, spot and Lambert lights are contained. Other types
+	///		(directional, sky, goniometric and environment) must be sampled
+	///		separately. Two alternatives are built over the same lights:
+	///
+	///		* A power weighted alias table. Sampling costs O(1), but the table
+	///		  does not know the shading point.
+	///		* A binary light BVH with a bounding box and a bounding cone of the
+	///		  emission directions per node (Conty Estevez and Kulla 2018). The
+	///		  tree is balanced, so sampling visits at most ceil(log2(n)) + 1 nodes.
+	///
+	///		The lights are referenced by their index in the scenario (by their
+	///		name in the file). The structure does not notice changes of the
+	///		lights and must be rebuilt.
+	class LightTree
+	{
+	public:
+		static constexpr uint32 INVALID = 0xffffffff;
+
+		struct AliasEntry
+		{
+			float threshold;	///< Take the own light if the fraction of u*n is below, otherwise the alias
+			uint32 alias;		///< Index into the alias table
+			float probability;	///< Probability to sample the own light
+		};
+
+		/// Node of the light BVH (64 bytes). Leaves contain exactly one light.
+		/// The angles of the bounding cone are in radians.
+		struct Node
+		{
+			ei::Vec3 boxMin;
+			uint32 rightChild;		///< The left child directly follows the node (preorder). If the first bit is set this is a leaf and the remaining bits are an index into getLights().
+			ei::Vec3 boxMax;
+			float power;			///< Sum of the (scalar) power of all lights in the subtree [lm]
+			ei::Vec3 axis;			///< Center of the bounding cone of the normals
+			float normalAngle;		///< Half angle of the bounding cone of the normals
+			float emissionAngle;	///< Maximum angle between a normal and an emitted direction
+			uint32 padding[3];
+		};
+
+		/// Build both structures in parallel.
+		/// \param [in] _lights All lights of the scenario.
+		void build(const std::vector<std::shared_ptr<Light>>& _lights);
+		void clear();
+		bool isEmpty() const { return m_lights.empty(); }
+		/// Check if the structure was built for exactly these lights (by
+		/// comparing the leaves with the light parameters). Small differences
+		/// like those from storing the lights in the JSON file are tolerated.
+		bool isValidFor(const std::vector<std::shared_ptr<Light>>& _lights) const;
+
+		/// Indices of the contained lights in the scenario. The alias table and
+		/// the leaves use the same order.
+		const std::vector<uint32>& getLights() const { return m_lights; }
+		const std::vector<AliasEntry>& getAliasTable() const { return m_aliasTable; }
+		const std::vector<Node>& getNodes() const { return m_nodes; }
+		float getTotalPower() const { return m_totalPower; }
+
+		/// Choose a light proportional to its power.
+		/// \param [in] _u Uniform random number in [0,1).
+		/// \return Index of a light in the scenario or INVALID if empty.
+		uint32 sampleAlias(float _u, float& _pdf) const;
+		/// Choose a light by a traversal of the light BVH.
+		/// \param [in] _normal Surface normal at the shading point. Use 0 for
+		///		points in volumes.
+		/// \param [in] _u Uniform random number in [0,1).
+		/// \return Index of a light in the scenario or INVALID if the traversal
+		///		ends in a subtree which cannot contribute to the point. Every light
+		///		which can contribute has a non-zero probability.
+		uint32 sample(const ei::Vec3& _position, const ei::Vec3& _normal, float _u, float& _pdf) const;
+		/// Upper bound estimate of the contribution of a node to a point.
+		static float importance(const Node& _node, const ei::Vec3& _position, const ei::Vec3& _normal);
+
+		/// Serialize into 4 byte words (appended to _blob).
+		/// \param [in] _lights The lights the structure was built for.
+		void pack(std::vector<uint32>& _blob, const std::vector<std::shared_ptr<Light>>& _lights) const;
+		/// Read a structure written by pack().
+		/// \param [inout] _data Start of the data. Is moved behind the structure.
+		/// \param [in] _lights The lights of the scenario. The stored names are
+		///		resolved to indices in this array. Use isValidFor() afterwards.
+		/// \return false if the data is invalid.
+		bool unpack(const uint32*& _data, const uint32* _end, const std::vector<std::shared_ptr<Light>>& _lights);
+	private:
+		float m_totalPower = 0.0f;
+		std::vector<uint32> m_lights;
+		std::vector<AliasEntry> m_aliasTable;
+		std::vector<Node> m_nodes;
+	};
+
+} // namespace bim
@@ -2,6 +2,8 @@
 
 #include <ei/vector.hpp>
 #include <unordered_map>
+#include <vector>
+#include <string>
 
 namespace bim {
 
@@ -50,6 +52,111 @@ namespace bim {
 		std::string m_name;
 		std::string m_type;
 		friend class BinaryModel;
+		friend class MaterialTable;
 	};
 
+	// Compiled, read-only form of all materials of a model for fast access in
+	// the hot path (e.g. in shading after each ray hit).
+	// Property names are interned to integer IDs once. Afterwards, each access is
+	// a plain array lookup with the material index from TRIANGLE_MAT.
+	// The data is stored as structure of arrays: one column per property with
+	// one entry per material. Each column starts at a cache line boundary.
+	class MaterialTable
+	{
+	public:
+		static const uint32 INVALID_ID = 0xffffffff;
+
+		MaterialTable();
+		// Build the table. _materials[i] is the material with index i, nullptr
+		// entries are allowed and behave like materials without properties.
+		void build(const std::vector<const Material*>& _materials);
+		void clear();
+
+		uint32 getNumMaterials() const { return m_numMaterials; }
+		uint32 getNumProperties() const { return static_cast<uint32>(m_propertyNames.size()); }
+		// Get the ID of a property name. This should be done once and not per access.
+		// Returns INVALID_ID if no material has the property.
+		uint32 getPropertyID(const std::string& _name) const;
+		const std::string& getPropertyName(uint32 _property) const { return m_propertyNames[_property]; }
+
+		// Type names are interned as well. INVALID_ID for a missing material.
+		uint32 getType(uint32 _material) const { return m_types[_material]; }
+		uint32 getTypeID(const std::string& _typeName) const;
+		const std::string& getTypeName(uint32 _type) const { return m_typeNames[_type]; }
+
+		// Check if a specific attribute exists (in textures or values).
+		bool has(uint32 _material, uint32 _property) const { return _property != INVALID_ID && (m_numComponents[idx(_material, _property)] != 0 || m_textures[idx(_material, _property)] != INVALID_ID); }
+		// Same semantic as Material::get(). Missing components are filled with the
+		// default. An _property with INVALID_ID always returns the default.
+		float get(uint32 _material, uint32 _property, const float _default = 0.0f) const;
+		ei::Vec2 get(uint32 _material, uint32 _property, const ei::Vec2& _default = ei::Vec2(0.0f)) const;
+		ei::Vec3 get(uint32 _material, uint32 _property, const ei::Vec3& _default = ei::Vec3(0.0f)) const;
+		ei::Vec4 get(uint32 _material, uint32 _property, const ei::Vec4& _default = ei::Vec4(0.0f)) const;
+		// Index into the texture name list or INVALID_ID if the property is not a texture.
+		uint32 getTextureIndex(uint32 _material, uint32 _property) const { return _property == INVALID_ID ? INVALID_ID : m_textures[idx(_material, _property)]; }
+		// Same semantic as Material::getTexture(): nullptr if the value should be used.
+		const std::string* getTexture(uint32 _material, uint32 _property) const { uint32 tex = getTextureIndex(_material, _property); return tex == INVALID_ID ? nullptr : &m_textureNames[tex]; }
+		uint32 getNumTextures() const { return static_cast<uint32>(m_textureNames.size()); }
+		const std::string& getTextureName(uint32 _texture) const { return m_textureNames[_texture]; }
+	private:
+		uint32 m_numMaterials;
+		uint32 m_stride;				// Number of entries per column (padded to full cache lines)
+		// Columns of all properties. m_valueStorage is larger than necessary,
+		// m_valueOffset is the first cache line aligned element.
+		std::vector<ei::Vec4> m_valueStorage;
+		size_t m_valueOffset;
+		std::vector<uint8> m_numComponents;	// 0 if the material does not have the value
+		std::vector<uint32> m_textures;
+		std::vector<uint32> m_types;
+		std::vector<std::string> m_propertyNames;
+		std::vector<std::string> m_typeNames;
+		std::vector<std::string> m_textureNames;
+		std::unordered_map<std::string, uint32> m_propertyIDs;
+
+		size_t idx(uint32 _material, uint32 _property) const { return _property * size_t(m_stride) + _material; }
+		const ei::Vec4& value(uint32 _material, uint32 _property) const { return m_valueStorage[m_valueOffset + idx(_material, _property)]; }
+	};
+
+	// Packed material buffer: all materials of a model in one contiguous array
+	// of 32 bit words (floats and uint32), e.g. for a direct upload to a renderer.
+	// Created by BinaryModel::packMaterials() and stored in the .bim file.
+	//
+	//   [0] PACKED_MATERIAL_VERSION
+	//   [1] numMaterials
+	//   [2] numTextures
+	//   [3 ... 3+numMaterials] word offsets of the material records. The last
+	//       entry is the offset of the string section.
+	//   Records in the order of the material indices (TRIANGLE_MAT):
+	//       type           Index into PACKED_MATERIAL_LAYOUTS or ~0 for missing materials
+	//       valueMask      Bit i: property i of the layout is given as value
+	//       textureMask    Bit i: property i of the layout has a texture
+	//       componentBits  2 bits per property: number of given components - 1
+	//       Per property of the layout: numComponents floats and a texture index
+	//       or ~0. A single given component is replicated to all components (a
+	//       scalar for an (S, RGB) property is gray). Otherwise missing values
+	//       and components are filled with the layout defaults.
+	//   String section:
+	//       numMaterials + numTextures + 1 byte offsets relative to the first
+	//       character. The material names come first, then the texture names.
+	//       Characters without terminating zeros, padded to full words.
+	const uint32 PACKED_MATERIAL_VERSION = 1;
+
+	struct PackedMaterialProperty
+	{
+		const char* name;
+		uint32 numComponents;
+		float defaultValue[4];
+	};
+
+	// Fixed record layout of one of the material types (see readme).
+	struct PackedMaterialLayout
+	{
+		const char* type;
+		uint32 numProperties;
+		const PackedMaterialProperty* properties;
+	};
+
+	extern const PackedMaterialLayout PACKED_MATERIAL_LAYOUTS[];
+	extern const uint32 NUM_PACKED_MATERIAL_LAYOUTS;
+
 } // namespace bim
\ No newline at end of file
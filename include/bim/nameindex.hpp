@@ -0,0 +1,44 @@
+#pragma once
+
+#include <ei/vector.hpp>
+#include <string_view>
+#include <unordered_map>
+
+namespace bim {
+
+	/// Hash index from names to positions in some array.
+	/// \details Only the hashes are stored. The names remain in the indexed
+	///		objects and may move in memory (e.g. if a std::vector grows). A
+	///		lookup compares the candidates with the true names, so hash
+	///		collisions are resolved correctly. Lookups take a std::string_view
+	///		and do not need to create a std::string.
+	class NameIndex
+	{
+	public:
+		static constexpr uint32 INVALID = 0xffffffff;
+
+		void add(std::string_view _name, uint32 _index)
+		{
+			m_entries.emplace(std::hash<std::string_view>()(_name), _index);
+		}
+
+		/// Find the smallest index with the given name.
+		/// \param [in] _getName Callable which returns the name for an index.
+		/// \return The index or INVALID.
+		template<typename GetName>
+		uint32 find(std::string_view _name, GetName _getName) const
+		{
+			uint32 result = INVALID;
+			auto range = m_entries.equal_range(std::hash<std::string_view>()(_name));
+			for(auto it = range.first; it != range.second; ++it)
+				if(it->second < result && std::string_view(_getName(it->second)) == _name)
+					result = it->second;
+			return result;
+		}
+
+		void clear() { m_entries.clear(); }
+	private:
+		std::unordered_multimap<size_t, uint32> m_entries;
+	};
+
+} // namespace bim
@@ -6,6 +6,7 @@
 
 #include "light.hpp"
 #include "camera.hpp"
+#include "lighttree.hpp"
 
 namespace bim {
 
@@ -19,6 +20,7 @@ namespace bim {
 
 		std::shared_ptr<Light> getLight(uint _index) const { return m_lights[_index]; }
 		uint getNumLights() const { return (uint)m_lights.size(); }
+		const std::vector<std::shared_ptr<Light>>& getLights() const { return m_lights; }
 		bool hasLight(const std::shared_ptr<Light>& _light)
 		{
 			for(auto & l : m_lights)
@@ -27,8 +29,22 @@ namespace bim {
 		}
 
 		/// Add the reference to a light. The light must be referenced in the
-		/// scene too.
-		void addLight(std::shared_ptr<Light> _light) { m_lights.push_back(move(_light)); }
+		/// scene too. This removes the light tree.
+		void addLight(std::shared_ptr<Light> _light) { m_lights.push_back(move(_light)); m_lightTree.clear(); }
+
+		/// Build the optional sampling structures over the lights (see LightTree).
+		/// Rebuild it after changing any light.
+		void buildLightTree() { m_lightTree.build(m_lights); }
+		/// The tree is empty if it was never built.
+		const LightTree& getLightTree() const { return m_lightTree; }
+		/// Replace the light tree (e.g. by a loaded one).
+		/// \return false (and nothing is changed) if the tree was built for other lights.
+		bool setLightTree(LightTree _tree)
+		{
+			if(!_tree.isValidFor(m_lights)) return false;
+			m_lightTree = std::move(_tree);
+			return true;
+		}
 
 		void setCamera(std::shared_ptr<Camera> _camera) { m_camera = move(_camera); }
 		std::shared_ptr<Camera> getCamera() { return m_camera; }
@@ -38,5 +54,6 @@ namespace bim {
 		// std::shared_ptr<Camera>
 		std::vector<std::shared_ptr<Light>> m_lights;
 		std::shared_ptr<Camera> m_camera;
+		LightTree m_lightTree;
 	};
 }
@@ -10,7 +10,10 @@ namespace bim {
 		m_chunks(prod(max(_numChunks, ei::IVec3(1)))),
 		m_requestedProps(Property::Val(_properties | Property::POSITION | Property::TRIANGLE_IDX)),
 		m_accelerator(Property::DONT_CARE),
-		m_loadAll(false)
+		m_loadAll(false),
+		m_chunkHierarchyDirty(false),
+		m_chunkMissPolicy(ChunkMissPolicy::SKIP),
+		m_useEnvCache(false)
 	{
 		for(int i = 0; i < prod(m_numChunks); ++i)
 		{
@@ -35,23 +38,35 @@ namespace bim {
 		return &m_materials.emplace(_material.m_name, _material).first->second;
 	}
 
-	int BinaryModel::getUniqueMaterialIndex(const std::string& _name)
+	int BinaryModel::getUniqueMaterialIndex(std::string_view _name)
 	{
-		for(size_t i = 0; i < m_materialIndirection.size(); ++i)
-		{
-			if(m_materialIndirection[i] == _name)
-				return static_cast<int>(i);
-		}
+		uint32 idx = m_materialIndex.find(_name, [this](uint32 _i) -> const std::string& { return m_materialIndirection[_i]; });
+		if(idx != NameIndex::INVALID)
+			return static_cast<int>(idx);
 		// The material is not indexed yet, but exists.
-		auto it = m_materials.find(_name);
+		std::string name(_name);
+		auto it = m_materials.find(name);
 		if(it != m_materials.end())
-		{
-			m_materialIndirection.push_back(_name);
-			return static_cast<int>(m_materialIndirection.size() - 1);
-		}
+			return static_cast<int>(addMaterialIndex(name));
 		return -1;
 	}
 
+	uint BinaryModel::addMaterialIndex(const std::string& _name)
+	{
+		uint index = static_cast<uint>(m_materialIndirection.size());
+		m_materialIndirection.push_back(_name);
+		m_materialIndex.add(_name, index);
+		return index;
+	}
+
+	void BinaryModel::compileMaterials()
+	{
+		std::vector<const Material*> materials(m_materialIndirection.size());
+		for(size_t i = 0; i < m_materialIndirection.size(); ++i)
+			materials[i] = getMaterial(static_cast<uint>(i));
+		m_materialTable.build(materials);
+	}
+
 
 	Scenario * BinaryModel::getScenario(uint _index)
 	{
@@ -60,11 +75,11 @@ namespace bim {
 		else return nullptr;
 	}
 
-	Scenario * BinaryModel::getScenario(const std::string & _name)
+	Scenario * BinaryModel::getScenario(std::string_view _name)
 	{
-		// Linear search for the scenario
-		for(auto & e : m_scenarios)
-			if(e.getName() == _name) return &e;
+		uint32 idx = m_scenarioIndex.find(_name, [this](uint32 _i) -> const std::string& { return m_scenarios[_i].getName(); });
+		if(idx != NameIndex::INVALID)
+			return &m_scenarios[idx];
 		return nullptr;
 	}
 
@@ -76,6 +91,7 @@ namespace bim {
 			return nullptr;
 		}
 #endif
+		m_scenarioIndex.add(_name, static_cast<uint32>(m_scenarios.size()));
 		m_scenarios.push_back(Scenario(_name));
 		return &m_scenarios.back();
 	}
@@ -87,11 +103,11 @@ namespace bim {
 		else return nullptr;
 	}
 
-	std::shared_ptr<Light> BinaryModel::getLight(const std::string & _name)
+	std::shared_ptr<Light> BinaryModel::getLight(std::string_view _name)
 	{
-		// Linear search for the light
-		for(auto l : m_lights)
-			if(l->name == _name) return l;
+		uint32 idx = m_lightIndex.find(_name, [this](uint32 _i) -> const std::string& { return m_lights[_i]->name; });
+		if(idx != NameIndex::INVALID)
+			return m_lights[idx];
 		return nullptr;
 	}
 
@@ -103,6 +119,7 @@ namespace bim {
 			return;
 		}
 #endif
+		m_lightIndex.add(_light->name, static_cast<uint32>(m_lights.size()));
 		m_lights.push_back(_light);
 	}
 
@@ -0,0 +1,196 @@
+#include "bim/chunk.hpp"
+#include "bim/log.hpp"
+#include <algorithm>
+
+using namespace ei;
+
+namespace bim {
+
+	static const float INNER_NODE_COST = 1.2f;
+	static const float TRIANGLE_COST = 1.0f;
+
+	// Area of the part of a triangle which is inside a box (Sutherland-Hodgman
+	// clipping at the 6 planes).
+	static float clippedArea(const Vec3& _v0, const Vec3& _v1, const Vec3& _v2, const Box& _box)
+	{
+		// Each plane adds at most one vertex to the convex polygon.
+		Vec3 poly[9], tmp[9];
+		poly[0] = _v0; poly[1] = _v1; poly[2] = _v2;
+		int n = 3;
+		for(int d = 0; d < 3; ++d)
+		{
+			for(int side = 0; side < 2; ++side)
+			{
+				// Signed distance to the plane, positive is outside.
+				float plane = side ? _box.max[d] : _box.min[d];
+				float sign = side ? 1.0f : -1.0f;
+				int m = 0;
+				for(int i = 0; i < n; ++i)
+				{
+					const Vec3& a = poly[i];
+					const Vec3& b = poly[(i + 1) % n];
+					float da = (a[d] - plane) * sign;
+					float db = (b[d] - plane) * sign;
+					if(da <= 0.0f) tmp[m++] = a;
+					if((da < 0.0f && db > 0.0f) || (da > 0.0f && db < 0.0f))
+						tmp[m++] = a + (b - a) * (da / (da - db));
+				}
+				n = m;
+				if(n < 3) return 0.0f;
+				for(int i = 0; i < n; ++i) poly[i] = tmp[i];
+			}
+		}
+		Vec3 areaVec(0.0f);
+		for(int i = 1; i + 1 < n; ++i)
+			areaVec += cross(poly[i] - poly[0], poly[i + 1] - poly[0]);
+		return 0.5f * len(areaVec);
+	}
+
+	static uint leafSize(const UVec4* _leaves, uint32 _leafIdx)
+	{
+		uint num = 1;
+		while(_leaves[_leafIdx++].w & 0x80000000) ++num;
+		return num;
+	}
+
+	float Chunk::nodeSAHCost(uint32 _node) const
+	{
+		uint32 child = m_hierarchy[_node].firstChild;
+		return (child & 0x80000000) ? TRIANGLE_COST * leafSize(m_hierarchyLeaves.data(), child & 0x7fffffff) : INNER_NODE_COST;
+	}
+
+	double Chunk::computeSAHSum() const
+	{
+		double cost = 0.0;
+#pragma omp parallel for reduction(+:cost)
+		for(int i = 0; i < int(m_hierarchy.size()); ++i)
+			cost += nodeSAHCost(i) * surface(m_aaBoxes[i]);
+		return cost;
+	}
+
+	float Chunk::computeSAHCost() const
+	{
+		return float(computeSAHSum() / surface(m_aaBoxes[0]));
+	}
+
+	HierarchyStatistics Chunk::analyzeHierarchy() const
+	{
+		HierarchyStatistics stats;
+		stats.sahCost = 0.0f;
+		stats.epo = 0.0f;
+		stats.siblingOverlap = 0.0f;
+		stats.numInnerNodes = 0;
+		stats.numLeafNodes = 0;
+		stats.numTriangleReferences = (uint)m_hierarchyLeaves.size();
+		stats.bytesPerTriangle = 0.0f;
+		if(!(m_properties & Property::HIERARCHY) || !(m_properties & Property::AABOX_BVH) || m_hierarchy.empty()) {
+			sendMessage(MessageType::ERROR, "Hierarchy analysis requires HIERARCHY and AABOX_BVH!");
+			return stats;
+		}
+
+		// Node costs, depths and the leaf node of each leaf entry.
+		std::vector<float> nodeCost(m_hierarchy.size());
+		std::vector<uint32> entryToLeafNode(m_hierarchyLeaves.size());
+		double siblingOverlap = 0.0;
+		struct Entry { uint32 node; uint depth; };
+		std::vector<Entry> stack;
+		stack.push_back({0, 0});
+		while(!stack.empty())
+		{
+			Entry e = stack.back();
+			stack.pop_back();
+			uint32 child = m_hierarchy[e.node].firstChild;
+			if(child & 0x80000000)
+			{
+				uint32 leafIdx = child & 0x7fffffff;
+				uint size = leafSize(m_hierarchyLeaves.data(), leafIdx);
+				for(uint i = 0; i < size; ++i)
+					entryToLeafNode[leafIdx + i] = e.node;
+				nodeCost[e.node] = TRIANGLE_COST * size;
+				++stats.numLeafNodes;
+				if(stats.leafSizeHistogram.size() <= size) stats.leafSizeHistogram.resize(size + 1, 0);
+				++stats.leafSizeHistogram[size];
+				if(stats.leafDepthHistogram.size() <= e.depth) stats.leafDepthHistogram.resize(e.depth + 1, 0);
+				++stats.leafDepthHistogram[e.depth];
+			} else {
+				nodeCost[e.node] = INNER_NODE_COST;
+				++stats.numInnerNodes;
+				// Pairwise overlap of all children
+				do {
+					stack.push_back({child, e.depth + 1});
+					for(uint32 other = m_hierarchy[child].escape; other != 0 && m_hierarchyParents[other] == e.node; other = m_hierarchy[other].escape)
+					{
+						Vec3 overlap = min(m_aaBoxes[child].max, m_aaBoxes[other].max) - max(m_aaBoxes[child].min, m_aaBoxes[other].min);
+						if(overlap.x > 0.0f && overlap.y > 0.0f && overlap.z > 0.0f)
+							siblingOverlap += overlap.x * overlap.y * overlap.z;
+					}
+					child = m_hierarchy[child].escape;
+				} while(m_hierarchyParents[child] == e.node && child != 0);
+			}
+		}
+		stats.sahCost = computeSAHCost();
+		stats.siblingOverlap = float(siblingOverlap / max(1e-30f, volume(m_aaBoxes[0])));
+
+		// Effective parent overlap: for each triangle find all nodes which overlap
+		// it, but are not on the path from the root to its leaf.
+		double epoSum = 0.0;
+		double totalArea = 0.0;
+#pragma omp parallel for reduction(+:epoSum, totalArea) schedule(dynamic, 256)
+		for(int i = 0; i < int(m_hierarchyLeaves.size()); ++i)
+		{
+			const UVec4& tri = m_hierarchyLeaves[i];
+			const Vec3& v0 = m_positions[tri.x];
+			const Vec3& v1 = m_positions[tri.y];
+			const Vec3& v2 = m_positions[tri.z];
+			Box triBox(v0, v1, v2);
+			totalArea += 0.5f * len(cross(v1 - v0, v2 - v0));
+			// Path from the root to the leaf
+			std::vector<uint32> path;
+			for(uint32 n = entryToLeafNode[i]; n != 0; n = m_hierarchyParents[n])
+				path.push_back(n);
+			path.push_back(0);
+			std::reverse(path.begin(), path.end());
+
+			std::vector<Entry> nodes;
+			nodes.push_back({0, 0});
+			while(!nodes.empty())
+			{
+				Entry e = nodes.back();
+				nodes.pop_back();
+				const Box& box = m_aaBoxes[e.node];
+				if(triBox.min.x > box.max.x || triBox.min.y > box.max.y || triBox.min.z > box.max.z
+					|| triBox.max.x < box.min.x || triBox.max.y < box.min.y || triBox.max.z < box.min.z)
+					continue;
+				if(e.depth >= path.size() || path[e.depth] != e.node)
+				{
+					float area = clippedArea(v0, v1, v2, box);
+					// Children cannot contain more of the triangle.
+					if(area <= 0.0f) continue;
+					epoSum += nodeCost[e.node] * area;
+				}
+				uint32 child = m_hierarchy[e.node].firstChild;
+				if(!(child & 0x80000000))
+				{
+					do {
+						nodes.push_back({child, e.depth + 1});
+						child = m_hierarchy[child].escape;
+					} while(m_hierarchyParents[child] == e.node && child != 0);
+				}
+			}
+		}
+		stats.epo = totalArea > 0.0 ? float(epoSum / totalArea) : 0.0f;
+
+		size_t bytes = m_hierarchy.size() * sizeof(Node)
+			+ m_hierarchyParents.size() * sizeof(uint32)
+			+ m_hierarchyLeaves.size() * sizeof(UVec4)
+			+ m_aaBoxes.size() * sizeof(Box)
+			+ m_oBoxes.size() * sizeof(OBox)
+			+ m_spheres.size() * sizeof(Sphere)
+			+ m_nodeNDFs.size() * sizeof(SGGX)
+			+ m_compressedNodes.size() * sizeof(CompressedNode)
+			+ m_leafTriangles.size() * sizeof(TriangleBlock);
+		stats.bytesPerTriangle = bytes / float(max(1u, getNumTriangles()));
+		return stats;
+	}
+
+} // namespace bim
@@ -9,7 +9,9 @@ namespace bim {
 		m_address(0),
 		m_properties(Property::DONT_CARE),
 		m_boundingBox(ei::Vec3(0.0f), ei::Vec3(0.0f)),
-		m_numTreeLevels(0)
+		m_numTreeLevels(0),
+		m_referenceSAHCost(0.0f),
+		m_refitSAHSum(-1.0)
 	{
 	}
 
@@ -30,6 +32,8 @@ namespace bim {
 			m_bitangents.push_back(_properties.bitangent);
 		if(m_properties & Property::QORMAL)
 			m_qormals.push_back(_properties.qormal);
+		if(m_properties & Property::QORMAL16)
+			m_qormals16.push_back(encodeQormal16(_properties.qormal));
 		if(m_properties & Property::TEXCOORD0)
 			m_texCoords0.push_back(_properties.texCoord0);
 		if(m_properties & Property::TEXCOORD1)
@@ -72,6 +76,11 @@ namespace bim {
 			if(_index >= m_qormals.size()) m_qormals.resize(_index + 1);
 			m_qormals.push_back(_properties.qormal);
 		}
+		if(m_properties & Property::QORMAL16)
+		{
+			if(_index >= m_qormals16.size()) m_qormals16.resize(_index + 1);
+			m_qormals16[_index] = encodeQormal16(_properties.qormal);
+		}
 		if(m_properties & Property::TEXCOORD0)
 		{
 			if(_index >= m_texCoords0.size()) m_texCoords0.resize(_index + 1);
@@ -99,6 +108,22 @@ namespace bim {
 		}
 	}
 
+	uint32 Chunk::duplicateVertex(uint32 _index)
+	{
+		m_positions.push_back(m_positions[_index]);
+		if(!m_normals.empty()) m_normals.push_back(m_normals[_index]);
+		if(!m_tangents.empty()) m_tangents.push_back(m_tangents[_index]);
+		if(!m_bitangents.empty()) m_bitangents.push_back(m_bitangents[_index]);
+		if(!m_qormals.empty()) m_qormals.push_back(m_qormals[_index]);
+		if(!m_qormals16.empty()) m_qormals16.push_back(m_qormals16[_index]);
+		if(!m_texCoords0.empty()) m_texCoords0.push_back(m_texCoords0[_index]);
+		if(!m_texCoords1.empty()) m_texCoords1.push_back(m_texCoords1[_index]);
+		if(!m_texCoords2.empty()) m_texCoords2.push_back(m_texCoords2[_index]);
+		if(!m_texCoords3.empty()) m_texCoords3.push_back(m_texCoords3[_index]);
+		if(!m_colors.empty()) m_colors.push_back(m_colors[_index]);
+		return uint32(m_positions.size() - 1);
+	}
+
 	void Chunk::addTriangle(const ei::UVec3& _indices, uint32 _material)
 	{
 		m_triangles.push_back(_indices);
@@ -148,6 +173,7 @@ namespace bim {
 			if(!m_tangents.empty()) key.tangent = m_tangents[i];
 			if(!m_bitangents.empty()) key.bitangent = m_bitangents[i];
 			if(!m_qormals.empty()) key.qormal = m_qormals[i];
+			else if(!m_qormals16.empty()) key.qormal = decodeQormal16(m_qormals16[i]);
 			if(!m_texCoords0.empty()) key.texCoord0 = m_texCoords0[i];
 			if(!m_texCoords1.empty()) key.texCoord1 = m_texCoords1[i];
 			if(!m_texCoords2.empty()) key.texCoord2 = m_texCoords2[i];
@@ -177,6 +203,7 @@ namespace bim {
 				if(!m_tangents.empty()) m_tangents[index] = m_tangents[i];
 				if(!m_bitangents.empty()) m_bitangents[index] = m_bitangents[i];
 				if(!m_qormals.empty()) m_qormals[index] = m_qormals[i];
+				if(!m_qormals16.empty()) m_qormals16[index] = m_qormals16[i];
 				if(!m_texCoords0.empty()) m_texCoords0[index] = m_texCoords0[i];
 				if(!m_texCoords1.empty()) m_texCoords1[index] = m_texCoords1[i];
 				if(!m_texCoords2.empty()) m_texCoords2[index] = m_texCoords2[i];
@@ -194,6 +221,7 @@ namespace bim {
 		if(!m_tangents.empty()) m_tangents.resize(index);
 		if(!m_bitangents.empty()) m_bitangents.resize(index);
 		if(!m_qormals.empty()) m_qormals.resize(index);
+		if(!m_qormals16.empty()) m_qormals16.resize(index);
 		if(!m_texCoords0.empty()) m_texCoords0.resize(index);
 		if(!m_texCoords1.empty()) m_texCoords1.resize(index);
 		if(!m_texCoords2.empty()) m_texCoords2.resize(index);
@@ -225,6 +253,10 @@ namespace bim {
 
 	void Chunk::buildHierarchy(BuildMethod _method, uint _maxNumTrianglesPerLeaf)
 	{
+		// The builders fill the node and leaf pools from index 0. Everything
+		// derived from an old hierarchy is invalid afterwards.
+		invalidateHierarchy();
+
 		switch(_method)
 		{
 		case BuildMethod::KD_TREE:
@@ -252,6 +284,7 @@ namespace bim {
 			case Property::TANGENT: swap(m_tangents, std::vector<ei::Vec3>(m_positions.size(), FullVertex().tangent)); break;
 			case Property::BITANGENT: swap(m_bitangents, std::vector<ei::Vec3>(m_positions.size(), FullVertex().bitangent)); break;
 			case Property::QORMAL: swap(m_qormals, std::vector<ei::Quaternion>(m_positions.size(), FullVertex().qormal)); break;
+			case Property::QORMAL16: std::vector<ei::Vec<int16,4>>(m_positions.size(), encodeQormal16(FullVertex().qormal)).swap(m_qormals16); break;
 			case Property::TEXCOORD0: swap(m_texCoords0, std::vector<ei::Vec2>(m_positions.size(), FullVertex().texCoord0)); break;
 			case Property::TEXCOORD1: swap(m_texCoords0, std::vector<ei::Vec2>(m_positions.size(), FullVertex().texCoord1)); break;
 			case Property::TEXCOORD2: swap(m_texCoords0, std::vector<ei::Vec2>(m_positions.size(), FullVertex().texCoord2)); break;
@@ -259,9 +292,10 @@ namespace bim {
 			case Property::COLOR: swap(m_colors, std::vector<uint32>(m_positions.size(), FullVertex().color)); break;
 			case Property::TRIANGLE_MAT: swap(m_triangleMaterials, std::vector<uint32>(m_triangles.size(), 0)); break;
 			case Property::AABOX_BVH: swap(m_aaBoxes, std::vector<ei::Box>(m_hierarchy.size())); break;
-			case Property::OBOX_BVH: //swap(m_aaBoxes, std::vector<ei::Box>(m_hierarchy.size())); break;
-			case Property::SPHERE_BVH: //swap(m_aaBoxes, std::vector<ei::Box>(m_hierarchy.size())); break;
+			case Property::OBOX_BVH: swap(m_oBoxes, std::vector<ei::OBox>(m_hierarchy.size())); break;
+			case Property::SPHERE_BVH: swap(m_spheres, std::vector<ei::Sphere>(m_hierarchy.size())); break;
 			case Property::NDF_SGGX: swap(m_nodeNDFs, std::vector<SGGX>(m_hierarchy.size())); break;
+			case Property::COMPRESSED_BVH: swap(m_compressedNodes, std::vector<CompressedNode>()); break;
 			default: return;
 			}
 			m_properties = Property::Val(m_properties | _property);
@@ -272,13 +306,23 @@ namespace bim {
 	{
 		// Remove all data, it needs to be recomputed anyway
 		m_hierarchy.clear();
+		m_hierarchyParents.clear();
 		m_hierarchyLeaves.clear();
 		m_aaBoxes.clear();
+		m_oBoxes.clear();
+		m_spheres.clear();
 		m_nodeNDFs.clear();
+		m_compressedNodes.clear();
+		m_leafTriangles.clear();
 		m_properties = Property::Val(m_properties
 			& ~(Property::HIERARCHY | Property::AABOX_BVH 
-			  | Property::OBOX_BVH | Property::SPHERE_BVH | Property::NDF_SGGX));
+			  | Property::OBOX_BVH | Property::SPHERE_BVH | Property::NDF_SGGX
+			  | Property::COMPRESSED_BVH | Property::LEAF_TRIANGLES));
 		m_numTreeLevels = 0;
+		m_referenceSAHCost = 0.0f;
+		m_refitSAHSum = -1.0;
+		m_vertexLeafOffsets.clear();
+		m_vertexLeafNodes.clear();
 	}
 
 	// ********************************************************************* //
@@ -287,7 +331,7 @@ namespace bim {
 		normal(0.0f, 0.0f, 0.0),
 		tangent(0.0f, 0.0f, 0.0f),
 		bitangent(0.0f, 0.0f, 0.0f),
-		qormal(ei::qidentity()),
+		qormal(0.0f, 0.0f, 0.0f, 0.0f),	// Marks a missing qormal (see computeTangentSpace())
 		texCoord0(0.0f),
 		texCoord1(0.0f),
 		texCoord2(0.0f),
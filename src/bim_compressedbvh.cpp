@@ -0,0 +1,112 @@
+#include "bim/chunk.hpp"
+#include "bim/log.hpp"
+#include <cmath>
+
+using namespace ei;
+
+namespace bim {
+
+	// Choose the grid for the union of two boxes and quantise both boxes
+	// conservatively.
+	static void quantiseChildren(const Box& _left, const Box& _right, CompressedNode& _node)
+	{
+		Box frame(_left, _right);
+		_node.origin = frame.min;
+		_node.padding = 0;
+		Vec3 scale;
+		for(int d = 0; d < 3; ++d)
+		{
+			// Smallest power of two with 255 * 2^e >= extent
+			int e;
+			std::frexp((frame.max[d] - frame.min[d]) / 255.0f, &e);
+			e = clamp(e, -126, 127);
+			while(e < 127 && _node.origin[d] + 255.0f * compressedNodeScale(int8(e)) < frame.max[d])
+				++e;
+			_node.exponent[d] = int8(e);
+			scale[d] = compressedNodeScale(int8(e));
+		}
+
+		const Box* boxes[2] = {&_left, &_right};
+		for(int c = 0; c < 2; ++c)
+		{
+			for(int d = 0; d < 3; ++d)
+			{
+				// Round outward and fix the cases where the float arithmetic of the
+				// decoder would end up inside the exact box.
+				int lo = clamp(ei::floor((boxes[c]->min[d] - _node.origin[d]) / scale[d]), 0, 255);
+				while(lo > 0 && _node.origin[d] + float(lo) * scale[d] > boxes[c]->min[d])
+					--lo;
+				int hi = clamp(ei::ceil((boxes[c]->max[d] - _node.origin[d]) / scale[d]), 0, 255);
+				while(hi < 255 && _node.origin[d] + float(hi) * scale[d] < boxes[c]->max[d])
+					++hi;
+				_node.childMin[c][d] = uint8(lo);
+				_node.childMax[c][d] = uint8(hi);
+			}
+		}
+	}
+
+	void Chunk::computeBVHCompressed()
+	{
+		if(m_hierarchy.empty()) {
+			sendMessage(MessageType::ERROR, "Cannot compress a hierarchy which does not exist!");
+			return;
+		}
+		if(!(m_properties & Property::AABOX_BVH))
+			computeBVHAABoxes();
+
+		m_compressedNodes.clear();
+		m_compressedNodes.reserve(m_hierarchy.size() / 2 + 1);
+		if(m_hierarchy[0].firstChild & 0x80000000)
+		{
+			// The root itself is a leaf. Store it as the only child of a dummy node.
+			CompressedNode root;
+			quantiseChildren(m_aaBoxes[0], m_aaBoxes[0], root);
+			root.child[0] = m_hierarchy[0].firstChild;
+			root.child[1] = 0xffffffff;
+			m_compressedNodes.push_back(root);
+		} else {
+			// Emit all inner nodes in preorder. The stack contains the nodes which
+			// still need to be emitted together with the slot in the parent which
+			// must point to them.
+			struct Pending { uint32 node; uint32 parentSlot; };
+			std::vector<Pending> stack;
+			stack.push_back({0, 0xffffffff});
+			while(!stack.empty())
+			{
+				Pending p = stack.back();
+				stack.pop_back();
+				uint32 idx = (uint32)m_compressedNodes.size();
+				if(p.parentSlot != 0xffffffff)
+					m_compressedNodes[p.parentSlot / 2].child[p.parentSlot % 2] = idx;
+
+				uint32 left = m_hierarchy[p.node].firstChild;
+				uint32 right = m_hierarchy[left].escape;
+				eiAssert(m_hierarchyParents[right] == p.node && right != 0, "Expected a binary tree!");
+				CompressedNode node;
+				quantiseChildren(m_aaBoxes[left], m_aaBoxes[right], node);
+				m_compressedNodes.push_back(node);
+
+				// Push right first to get the left child emitted first.
+				uint32 children[2] = {left, right};
+				for(int c = 1; c >= 0; --c)
+				{
+					if(m_hierarchy[children[c]].firstChild & 0x80000000)
+						m_compressedNodes[idx].child[c] = m_hierarchy[children[c]].firstChild;
+					else
+						stack.push_back({children[c], idx * 2 + c});
+				}
+			}
+		}
+
+		m_properties = Property::Val(m_properties | Property::COMPRESSED_BVH);
+
+		// Report the memory of the traversal relevant data (leaves are the same in both cases).
+		float numTriangles = float(max(1u, getNumTriangles()));
+		float leafBytes = m_hierarchyLeaves.size() * sizeof(UVec4) / numTriangles;
+		float uncompressedBytes = m_hierarchy.size() * (sizeof(Node) + sizeof(Box) + sizeof(uint32)) / numTriangles;
+		float compressedBytes = m_compressedNodes.size() * sizeof(CompressedNode) / numTriangles;
+		sendMessage(MessageType::INFO, "Compressed hierarchy: ", compressedBytes + leafBytes, " bytes/triangle instead of ",
+			uncompressedBytes + leafBytes, " bytes/triangle (nodes only: ", compressedBytes, " / ", uncompressedBytes, ")");
+	}
+
+} // namespace bim
@@ -0,0 +1,477 @@
+#include "bim/bim.hpp"
+#include "bim/log.hpp"
+#include <fstream>
+#include <cstring>
+#include <algorithm>
+
+namespace bim {
+
+	std::string pathOf(const char* _file);
+
+	// Changes of the format must increase the version, older caches are
+	// ignored then.
+	static const uint32 ENV_CACHE_MAGIC = 0x454d4942;	// "BIME"
+	static const uint32 ENV_CACHE_VERSION = 2;
+
+	struct EnvCacheHeader
+	{
+		uint32 magic;
+		uint32 version;
+		uint64 jsonSize;	// Key of the environment file the cache was created from
+		uint64 jsonHash;
+	};
+
+	static std::string cacheFileName(const char* _envFile)
+	{
+		return std::string(_envFile) + ".cache";
+	}
+
+	// 64 bit FNV-1a
+	static uint64 hashContent(const char* _data, size_t _size)
+	{
+		uint64 hash = 0xcbf29ce484222325ull;
+		for(size_t i = 0; i < _size; ++i)
+		{
+			hash ^= uint8(_data[i]);
+			hash *= 0x100000001b3ull;
+		}
+		return hash;
+	}
+
+	static bool readFile(const std::string& _file, std::string& _content)
+	{
+		std::ifstream file(_file, std::ios_base::binary);
+		if(!file) return false;
+		file.seekg(0, std::ios_base::end);
+		_content.resize(size_t(file.tellg()));
+		file.seekg(0, std::ios_base::beg);
+		return !!file.read(&_content[0], _content.size());
+	}
+
+	// Sequential serialization of the cache content
+	class CacheWriter
+	{
+	public:
+		template<typename T>
+		void put(const T& _value)
+		{
+			size_t offset = m_data.size();
+			m_data.resize(offset + sizeof(T));
+			memcpy(&m_data[offset], &_value, sizeof(T));
+		}
+		void putString(const std::string& _str)
+		{
+			put(uint32(_str.size()));
+			m_data.append(_str);
+		}
+		const std::string& data() const { return m_data; }
+	private:
+		std::string m_data;
+	};
+
+	class CacheReader
+	{
+	public:
+		CacheReader(const char* _begin, const char* _end) : m_pos(_begin), m_end(_end), m_ok(true) {}
+
+		template<typename T>
+		T get()
+		{
+			T value;
+			if(m_end - m_pos < ptrdiff_t(sizeof(T))) {
+				m_ok = false;
+				memset(&value, 0, sizeof(T));
+				return value;
+			}
+			memcpy(&value, m_pos, sizeof(T));
+			m_pos += sizeof(T);
+			return value;
+		}
+		std::string getString()
+		{
+			uint32 size = get<uint32>();
+			if(uint32(m_end - m_pos) < size) {
+				m_ok = false;
+				return std::string();
+			}
+			m_pos += size;
+			return std::string(m_pos - size, m_pos);
+		}
+		// Number of following elements. Each element needs at least 4 bytes,
+		// larger numbers can only come from a broken file.
+		uint32 getCount()
+		{
+			uint32 num = get<uint32>();
+			if(num > uint32((m_end - m_pos) / 4)) {
+				m_ok = false;
+				return 0;
+			}
+			return num;
+		}
+		bool ok() const { return m_ok; }
+	private:
+		const char* m_pos;
+		const char* m_end;
+		bool m_ok;
+	};
+
+	bool BinaryModel::loadEnvCache(const char* _envFile, bool _ignoreBinary, std::string& _binarySceneFile)
+	{
+		std::string content, cache;
+		if(!readFile(cacheFileName(_envFile), cache) || !readFile(_envFile, content))
+			return false;
+		CacheReader reader(cache.data(), cache.data() + cache.size());
+		EnvCacheHeader header = reader.get<EnvCacheHeader>();
+		if(!reader.ok() || header.magic != ENV_CACHE_MAGIC || header.version != ENV_CACHE_VERSION || header.jsonSize != content.size())
+			return false;
+		// Always compare the content. Time stamps are too coarse to detect a
+		// rewrite with the same size and hashing is cheap compared to parsing.
+		if(hashContent(content.data(), content.size()) != header.jsonHash)
+			return false;
+
+		// Read everything into temporaries first. The model is not changed
+		// if the cache is broken.
+		std::string binarySceneFile = reader.getString();
+		Property::Val accelerator = Property::Val(reader.get<uint32>());
+		bool hasMaterials = reader.get<uint32>() != 0;
+		std::vector<Material> materials(reader.getCount());
+		for(size_t i = 0; i < materials.size() && reader.ok(); ++i)
+		{
+			Material& mat = materials[i];
+			mat.m_name = reader.getString();
+			mat.m_type = reader.getString();
+			uint32 numTextures = reader.getCount();
+			for(uint32 t = 0; t < numTextures && reader.ok(); ++t)
+			{
+				std::string name = reader.getString();
+				mat.m_textureNames.emplace(move(name), reader.getString());
+			}
+			uint32 numValues = reader.getCount();
+			for(uint32 v = 0; v < numValues && reader.ok(); ++v)
+			{
+				std::string name = reader.getString();
+				Material::MultiValue value;
+				value.values = reader.get<ei::Vec4>();
+				value.numComponents = reader.get<int>();
+				mat.m_values.emplace(move(name), value);
+			}
+		}
+
+		std::vector<std::string> scenarioNames(reader.getCount());
+		for(size_t i = 0; i < scenarioNames.size() && reader.ok(); ++i)
+			scenarioNames[i] = reader.getString();
+
+		std::vector<std::shared_ptr<Light>> lights(reader.getCount());
+		std::vector<std::vector<std::string>> lightScenarios(lights.size());
+		for(size_t i = 0; i < lights.size() && reader.ok(); ++i)
+		{
+			Light::Type type = Light::Type(reader.get<uint32>());
+			std::string name = reader.getString();
+			switch(type)
+			{
+			case Light::Type::POINT: {
+				auto l = std::make_shared<PointLight>(name);
+				l->position = reader.get<ei::Vec3>();
+				l->intensity = reader.get<ei::Vec3>();
+				lights[i] = l;
+			} break;
+			case Light::Type::LAMBERT: {
+				auto l = std::make_shared<LambertLight>(name);
+				l->position = reader.get<ei::Vec3>();
+				l->normal = reader.get<ei::Vec3>();
+				l->intensity = reader.get<ei::Vec3>();
+				lights[i] = l;
+			} break;
+			case Light::Type::DIRECTIONAL: {
+				auto l = std::make_shared<DirectionalLight>(name);
+				l->direction = reader.get<ei::Vec3>();
+				l->irradiance = reader.get<ei::Vec3>();
+				lights[i] = l;
+			} break;
+			case Light::Type::SPOT: {
+				auto l = std::make_shared<SpotLight>(name);
+				l->position = reader.get<ei::Vec3>();
+				l->direction = reader.get<ei::Vec3>();
+				l->peakIntensity = reader.get<ei::Vec3>();
+				l->falloff = reader.get<float>();
+				l->halfAngle = reader.get<float>();
+				lights[i] = l;
+			} break;
+			case Light::Type::SKY: {
+				auto l = std::make_shared<SkyLight>(name);
+				l->sunDirection = reader.get<ei::Vec3>();
+				l->turbidity = reader.get<float>();
+				l->aerialPerspective = reader.get<uint32>() != 0;
+				lights[i] = l;
+			} break;
+			case Light::Type::GONIOMETRIC: {
+				auto l = std::make_shared<GoniometricLight>(name);
+				l->position = reader.get<ei::Vec3>();
+				l->intensityScale = reader.get<ei::Vec3>();
+				l->intensityMap = reader.getString();
+				lights[i] = l;
+			} break;
+			case Light::Type::ENVIRONMENT: {
+				std::string radianceMap = reader.getString();
+				lights[i] = std::make_shared<EnvironmentLight>(radianceMap, name);
+			} break;
+			default:
+				return false;
+			}
+			lightScenarios[i].resize(reader.getCount());
+			for(size_t s = 0; s < lightScenarios[i].size() && reader.ok(); ++s)
+				lightScenarios[i][s] = reader.getString();
+		}
+
+		std::vector<std::shared_ptr<Camera>> cameras(reader.getCount());
+		std::vector<std::vector<std::string>> cameraScenarios(cameras.size());
+		for(size_t i = 0; i < cameras.size() && reader.ok(); ++i)
+		{
+			Camera::Type type = Camera::Type(reader.get<uint32>());
+			std::string name = reader.getString();
+			float velocity = reader.get<float>();
+			switch(type)
+			{
+			case Camera::Type::PERSPECTIVE: {
+				auto c = std::make_shared<PerspectiveCamera>(name);
+				c->position = reader.get<ei::Vec3>();
+				c->lookAt = reader.get<ei::Vec3>();
+				c->up = reader.get<ei::Vec3>();
+				c->verticalFOV = reader.get<float>();
+				cameras[i] = c;
+			} break;
+			case Camera::Type::ORTHOGRAPHIC: {
+				auto c = std::make_shared<OrthographicCamera>(name);
+				c->position = reader.get<ei::Vec3>();
+				c->lookAt = reader.get<ei::Vec3>();
+				c->up = reader.get<ei::Vec3>();
+				c->left = reader.get<float>();
+				c->right = reader.get<float>();
+				c->bottom = reader.get<float>();
+				c->top = reader.get<float>();
+				c->near = reader.get<float>();
+				c->far = reader.get<float>();
+				cameras[i] = c;
+			} break;
+			case Camera::Type::FOCUS: {
+				auto c = std::make_shared<FocusCamera>(name);
+				c->position = reader.get<ei::Vec3>();
+				c->lookAt = reader.get<ei::Vec3>();
+				c->up = reader.get<ei::Vec3>();
+				c->focalLength = reader.get<float>();
+				c->focusDistance = reader.get<float>();
+				c->sensorSize = reader.get<float>();
+				c->aperture = reader.get<float>();
+				cameras[i] = c;
+			} break;
+			default:
+				return false;
+			}
+			cameras[i]->velocity = velocity;
+			cameraScenarios[i].resize(reader.getCount());
+			for(size_t s = 0; s < cameraScenarios[i].size() && reader.ok(); ++s)
+				cameraScenarios[i][s] = reader.getString();
+		}
+		if(!reader.ok()) {
+			sendMessage(MessageType::WARNING, "Environment cache is corrupted. Loading the JSON file instead.");
+			return false;
+		}
+
+		// The materials are not in the cache if they are stored in the binary file.
+		if(!hasMaterials && (_ignoreBinary || binarySceneFile.empty() || !loadPackedMaterials(pathOf(_envFile) + binarySceneFile)))
+			return false;
+
+		// Apply everything in the same order as loadEnv().
+		addScenario("default");
+		for(auto& name : scenarioNames)
+			addScenario(name);
+		if(accelerator != Property::DONT_CARE)
+			m_accelerator = accelerator;
+		for(auto& mat : materials)
+			m_materials.emplace(mat.getName(), std::move(mat));
+		for(size_t i = 0; i < lights.size(); ++i)
+		{
+			addLight(lights[i]);
+			for(const auto& sname : lightScenarios[i])
+			{
+				Scenario* scenario = getScenario(sname);
+				if(!scenario)
+					scenario = addScenario(sname);
+				scenario->addLight(lights[i]);
+			}
+		}
+		for(size_t i = 0; i < cameras.size(); ++i)
+		{
+			m_cameras.push_back(cameras[i]);
+			for(const auto& sname : cameraScenarios[i])
+			{
+				Scenario* scenario = getScenario(sname);
+				if(!scenario)
+					scenario = addScenario(sname);
+				scenario->setCamera(cameras[i]);
+			}
+		}
+		_binarySceneFile = move(binarySceneFile);
+		return true;
+	}
+
+	void BinaryModel::storeEnvCache(const char* _envFile, const std::string& _content, const std::string& _binarySceneFile,
+		Property::Val _accelerator, const std::vector<std::string>* _materials, size_t _firstScenario, size_t _firstLight, size_t _firstCamera)
+	{
+		EnvCacheHeader header;
+		header.magic = ENV_CACHE_MAGIC;
+		header.version = ENV_CACHE_VERSION;
+		header.jsonSize = _content.size();
+		header.jsonHash = hashContent(_content.data(), _content.size());
+
+		CacheWriter writer;
+		writer.put(header);
+		writer.putString(_binarySceneFile);
+		writer.put(uint32(_accelerator));
+		writer.put(uint32(_materials ? 1 : 0));
+		writer.put(uint32(_materials ? _materials->size() : 0));
+		if(_materials)
+		{
+			for(auto& name : *_materials)
+			{
+				const Material& mat = m_materials[name];
+				writer.putString(name);
+				writer.putString(mat.m_type);
+				writer.put(uint32(mat.m_textureNames.size()));
+				for(auto& tex : mat.m_textureNames)
+				{
+					writer.putString(tex.first);
+					writer.putString(tex.second);
+				}
+				writer.put(uint32(mat.m_values.size()));
+				for(auto& val : mat.m_values)
+				{
+					writer.putString(val.first);
+					writer.put(val.second.values);
+					writer.put(val.second.numComponents);
+				}
+			}
+		}
+
+		// All scenarios which were created by loadEnv() (after "default").
+		size_t firstScenario = std::min<size_t>(_firstScenario + 1, m_scenarios.size());
+		writer.put(uint32(m_scenarios.size() - firstScenario));
+		for(size_t i = firstScenario; i < m_scenarios.size(); ++i)
+			writer.putString(m_scenarios[i].getName());
+
+		// The scenario memberships are reconstructed from the scenarios.
+		std::unordered_map<const Light*, std::vector<const std::string*>> lightScenarios;
+		for(auto& scenario : m_scenarios)
+			for(uint i = 0; i < scenario.getNumLights(); ++i)
+				lightScenarios[scenario.getLight(i).get()].push_back(&scenario.getName());
+		writer.put(uint32(m_lights.size() - _firstLight));
+		for(size_t i = _firstLight; i < m_lights.size(); ++i)
+		{
+			const Light* light = m_lights[i].get();
+			writer.put(uint32(light->type));
+			writer.putString(light->name);
+			switch(light->type)
+			{
+			case Light::Type::POINT: {
+				const PointLight* l = dynamic_cast<const PointLight*>(light);
+				writer.put(l->position);
+				writer.put(l->intensity);
+			} break;
+			case Light::Type::LAMBERT: {
+				const LambertLight* l = dynamic_cast<const LambertLight*>(light);
+				writer.put(l->position);
+				writer.put(l->normal);
+				writer.put(l->intensity);
+			} break;
+			case Light::Type::DIRECTIONAL: {
+				const DirectionalLight* l = dynamic_cast<const DirectionalLight*>(light);
+				writer.put(l->direction);
+				writer.put(l->irradiance);
+			} break;
+			case Light::Type::SPOT: {
+				const SpotLight* l = dynamic_cast<const SpotLight*>(light);
+				writer.put(l->position);
+				writer.put(l->direction);
+				writer.put(l->peakIntensity);
+				writer.put(l->falloff);
+				writer.put(l->halfAngle);
+			} break;
+			case Light::Type::SKY: {
+				const SkyLight* l = dynamic_cast<const SkyLight*>(light);
+				writer.put(l->sunDirection);
+				writer.put(l->turbidity);
+				writer.put(uint32(l->aerialPerspective ? 1 : 0));
+			} break;
+			case Light::Type::GONIOMETRIC: {
+				const GoniometricLight* l = dynamic_cast<const GoniometricLight*>(light);
+				writer.put(l->position);
+				writer.put(l->intensityScale);
+				writer.putString(l->intensityMap);
+			} break;
+			case Light::Type::ENVIRONMENT: {
+				const EnvironmentLight* l = dynamic_cast<const EnvironmentLight*>(light);
+				writer.putString(l->radianceMap);
+			} break;
+			default: return;
+			}
+			const auto& scenarios = lightScenarios[light];
+			writer.put(uint32(scenarios.size()));
+			for(auto name : scenarios)
+				writer.putString(*name);
+		}
+
+		writer.put(uint32(m_cameras.size() - _firstCamera));
+		for(size_t i = _firstCamera; i < m_cameras.size(); ++i)
+		{
+			const Camera* camera = m_cameras[i].get();
+			writer.put(uint32(camera->type));
+			writer.putString(camera->name);
+			writer.put(camera->velocity);
+			switch(camera->type)
+			{
+			case Camera::Type::PERSPECTIVE: {
+				const PerspectiveCamera* c = dynamic_cast<const PerspectiveCamera*>(camera);
+				writer.put(c->position);
+				writer.put(c->lookAt);
+				writer.put(c->up);
+				writer.put(c->verticalFOV);
+			} break;
+			case Camera::Type::ORTHOGRAPHIC: {
+				const OrthographicCamera* c = dynamic_cast<const OrthographicCamera*>(camera);
+				writer.put(c->position);
+				writer.put(c->lookAt);
+				writer.put(c->up);
+				writer.put(c->left);
+				writer.put(c->right);
+				writer.put(c->bottom);
+				writer.put(c->top);
+				writer.put(c->near);
+				writer.put(c->far);
+			} break;
+			case Camera::Type::FOCUS: {
+				const FocusCamera* c = dynamic_cast<const FocusCamera*>(camera);
+				writer.put(c->position);
+				writer.put(c->lookAt);
+				writer.put(c->up);
+				writer.put(c->focalLength);
+				writer.put(c->focusDistance);
+				writer.put(c->sensorSize);
+				writer.put(c->aperture);
+			} break;
+			default: return;
+			}
+			std::vector<const std::string*> scenarios;
+			for(auto& scenario : m_scenarios)
+				if(scenario.getCamera() == m_cameras[i])
+					scenarios.push_back(&scenario.getName());
+			writer.put(uint32(scenarios.size()));
+			for(auto name : scenarios)
+				writer.putString(*name);
+		}
+
+		std::ofstream file(cacheFileName(_envFile), std::ios_base::binary);
+		if(!file.write(writer.data().data(), writer.data().size()))
+			sendMessage(MessageType::INFO, "Cannot write the environment cache ", cacheFileName(_envFile));
+	}
+
+} // namespace bim
@@ -1,95 +1,213 @@
 ﻿#include "bim/chunk.hpp"
-#include <cn/chinoise.hpp>
+#include "bim/log.hpp"
+#include <algorithm>
 
 using namespace ei;
 
 namespace bim {
 
-	static void recomputeBVHAABoxesRec(const Vec3* _positions, const UVec4* _leaves, const Node* _hierarchy, const uint32* _parents, Box* _aaBoxes, uint32 _node)
+	static Box computeLeafBox(const Vec3* _positions, const UVec4* _leaves, uint32 _leafIdx)
 	{
-		uint32 child = _hierarchy[_node].firstChild;
-		if(child & 0x80000000)
+		Box box(_positions[_leaves[_leafIdx].x], _positions[_leaves[_leafIdx].y], _positions[_leaves[_leafIdx].z]);
+		while(_leaves[_leafIdx].w & 0x80000000)
 		{
-			// Build a box for all triangles in the leaf
-			size_t leafIdx = child & 0x7fffffff;
-			Triangle tri;
-			tri.v0 = _positions[_leaves[leafIdx].x];
-			tri.v1 = _positions[_leaves[leafIdx].y];
-			tri.v2 = _positions[_leaves[leafIdx].z];
-			_aaBoxes[_node] = Box(tri);
-			while(_leaves[leafIdx].w & 0x80000000)
-			{
-				leafIdx++;
-				tri.v0 = _positions[_leaves[leafIdx].x];
-				tri.v1 = _positions[_leaves[leafIdx].y];
-				tri.v2 = _positions[_leaves[leafIdx].z];
-				_aaBoxes[_node] = Box(Box(tri), _aaBoxes[_node]);
-			}
-		} else {
-			// Iterate through all siblings
-			recomputeBVHAABoxesRec(_positions, _leaves, _hierarchy, _parents, _aaBoxes, child);
-			_aaBoxes[_node] = _aaBoxes[child];
-			child = _hierarchy[child].escape;
-			while(_parents[child] == _node && child != 0)
-			{
-				recomputeBVHAABoxesRec(_positions, _leaves, _hierarchy, _parents, _aaBoxes, child);
-				_aaBoxes[_node] = Box(_aaBoxes[child], _aaBoxes[_node]);
-				child = _hierarchy[child].escape;
-			}
+			++_leafIdx;
+			box = Box(box, Box(_positions[_leaves[_leafIdx].x], _positions[_leaves[_leafIdx].y], _positions[_leaves[_leafIdx].z]));
 		}
+		return box;
 	}
 
 	void Chunk::computeBVHAABoxes()
 	{
 		m_aaBoxes.resize(m_hierarchy.size());
-		recomputeBVHAABoxesRec(m_positions.data(), m_hierarchyLeaves.data(), m_hierarchy.data(), m_hierarchyParents.data(), m_aaBoxes.data(), 0);
+		std::vector<uint32> nodes, levelOffsets;
+		computeNodeLevels(nodes, levelOffsets);
+		// Bottom-up: all nodes of one level are independent.
+		for(int level = int(levelOffsets.size()) - 2; level >= 0; --level)
+		{
+#pragma omp parallel for schedule(dynamic, 256)
+			for(int i = int(levelOffsets[level]); i < int(levelOffsets[level + 1]); ++i)
+			{
+				uint32 node = nodes[i];
+				uint32 child = m_hierarchy[node].firstChild;
+				if(child & 0x80000000)
+				{
+					// Build a box for all triangles in the leaf
+					m_aaBoxes[node] = computeLeafBox(m_positions.data(), m_hierarchyLeaves.data(), child & 0x7fffffff);
+				} else {
+					// Iterate through all siblings
+					m_aaBoxes[node] = m_aaBoxes[child];
+					child = m_hierarchy[child].escape;
+					while(m_hierarchyParents[child] == node && child != 0)
+					{
+						m_aaBoxes[node] = Box(m_aaBoxes[child], m_aaBoxes[node]);
+						child = m_hierarchy[child].escape;
+					}
+				}
+			}
+		}
 		m_properties = Property::Val(m_properties | Property::AABOX_BVH);
+		m_refitSAHSum = -1.0;
 	}
 
 
 
-	static void computeBVHOBoxesRec(const Vec3* _positions, const UVec4* _leaves, const Node* _hierarchy, const uint32* _parents, std::vector<ei::Vec3>& _auxPos, OBox* _oBoxes, uint32 _node)
+	// Maximum number of points kept per node for the parent's OBox fit.
+	const uint MAX_HULL_POINTS = 32;
+
+	// The 13 directions of a 26-DOP. The extreme points in these directions
+	// replace hulls which are too large.
+	static const Vec3 HULL_DIRECTIONS[13] = {
+		Vec3(1.0f, 0.0f, 0.0f), Vec3(0.0f, 1.0f, 0.0f), Vec3(0.0f, 0.0f, 1.0f),
+		Vec3(1.0f, 1.0f, 1.0f), Vec3(1.0f, 1.0f, -1.0f), Vec3(1.0f, -1.0f, 1.0f), Vec3(1.0f, -1.0f, -1.0f),
+		Vec3(1.0f, 1.0f, 0.0f), Vec3(1.0f, -1.0f, 0.0f), Vec3(1.0f, 0.0f, 1.0f),
+		Vec3(1.0f, 0.0f, -1.0f), Vec3(0.0f, 1.0f, 1.0f), Vec3(0.0f, 1.0f, -1.0f)
+	};
+
+	static void simplifyHull(std::vector<Vec3>& _points)
 	{
-		uint32 child = _hierarchy[_node].firstChild;
-		size_t firstPoint = _auxPos.size();
-		if(child & 0x80000000)
+		uint32 extreme[26];
+		for(int d = 0; d < 13; ++d)
 		{
-			// Collect a list of points from all vertices in the leaves
-			size_t leafIdx = child & 0x7fffffff;
-			do {
-				_auxPos.push_back(_positions[_leaves[leafIdx].x]);
-				_auxPos.push_back(_positions[_leaves[leafIdx].y]);
-				_auxPos.push_back(_positions[_leaves[leafIdx].z]);
-			} while(_leaves[leafIdx++].w & 0x80000000);
-		} else {
-			// Iterate through all siblings
-			computeBVHOBoxesRec(_positions, _leaves, _hierarchy, _parents, _auxPos, _oBoxes, child);
-			child = _hierarchy[child].escape;
-			while(_parents[child] == _node && child != 0)
+			float minDist = 1e30f, maxDist = -1e30f;
+			for(uint32 i = 0; i < _points.size(); ++i)
 			{
-				computeBVHOBoxesRec(_positions, _leaves, _hierarchy, _parents, _auxPos, _oBoxes, child);
-				child = _hierarchy[child].escape;
+				float dist = dot(HULL_DIRECTIONS[d], _points[i]);
+				if(dist < minDist) { minDist = dist; extreme[d * 2] = i; }
+				if(dist > maxDist) { maxDist = dist; extreme[d * 2 + 1] = i; }
 			}
 		}
-		uint n = ei::convexSet(_auxPos.data() + firstPoint, uint32(_auxPos.size() - firstPoint));
-		_auxPos.resize(firstPoint + n);
-		_oBoxes[_node] = OBox(_auxPos.data() + firstPoint, n);
+		std::sort(extreme, extreme + 26);
+		uint32 n = uint32(std::unique(extreme, extreme + 26) - extreme);
+		for(uint32 i = 0; i < n; ++i)
+			_points[i] = _points[extreme[i]];
+		_points.resize(n);
 	}
 
 	void Chunk::computeBVHOBoxes()
 	{
-		// Auxiliary buffer for positions, because the OBox build algorithm
-		// requires a thick packed list of vertices.
-		std::vector<ei::Vec3> points;
-		points.reserve(m_positions.size() * 6);
+		// Each node keeps the convex set of its vertices (at most
+		// MAX_HULL_POINTS) until the parent is processed. If the set had to be
+		// simplified it does not bound the subtree anymore and the parent
+		// additionally uses the corners of the child's box.
+		std::vector<std::vector<Vec3>> points(m_hierarchy.size());
+		std::vector<uint8> simplified(m_hierarchy.size(), 0);
 		m_oBoxes.resize(m_hierarchy.size());
-		computeBVHOBoxesRec(m_positions.data(), m_hierarchyLeaves.data(), m_hierarchy.data(), m_hierarchyParents.data(), points, m_oBoxes.data(), 0);
+		std::vector<uint32> nodes, levelOffsets;
+		computeNodeLevels(nodes, levelOffsets);
+		for(int level = int(levelOffsets.size()) - 2; level >= 0; --level)
+		{
+#pragma omp parallel for schedule(dynamic, 64)
+			for(int i = int(levelOffsets[level]); i < int(levelOffsets[level + 1]); ++i)
+			{
+				uint32 node = nodes[i];
+				std::vector<Vec3>& nodePoints = points[node];
+				uint32 child = m_hierarchy[node].firstChild;
+				if(child & 0x80000000)
+				{
+					// Collect a list of points from all vertices in the leaves
+					size_t leafIdx = child & 0x7fffffff;
+					do {
+						nodePoints.push_back(m_positions[m_hierarchyLeaves[leafIdx].x]);
+						nodePoints.push_back(m_positions[m_hierarchyLeaves[leafIdx].y]);
+						nodePoints.push_back(m_positions[m_hierarchyLeaves[leafIdx].z]);
+					} while(m_hierarchyLeaves[leafIdx++].w & 0x80000000);
+				} else {
+					// Merge the convex sets of all children
+					do {
+						nodePoints.insert(nodePoints.end(), points[child].begin(), points[child].end());
+						std::vector<Vec3>().swap(points[child]);
+						if(simplified[child])
+						{
+							const OBox& box = m_oBoxes[child];
+							for(int c = 0; c < 8; ++c)
+							{
+								Vec3 corner((c & 1) ? box.halfSides.x : -box.halfSides.x,
+											(c & 2) ? box.halfSides.y : -box.halfSides.y,
+											(c & 4) ? box.halfSides.z : -box.halfSides.z);
+								nodePoints.push_back(box.center + transform(corner, conjugate(box.orientation)));
+							}
+						}
+						child = m_hierarchy[child].escape;
+					} while(m_hierarchyParents[child] == node && child != 0);
+				}
+				uint n = ei::convexSet(nodePoints.data(), uint32(nodePoints.size()));
+				nodePoints.resize(n);
+				if(n > MAX_HULL_POINTS)
+				{
+					// Fit the orientation to the reduced set, but the extents to
+					// all points.
+					std::vector<Vec3> reduced = nodePoints;
+					simplifyHull(reduced);
+					m_oBoxes[node] = OBox(OBox(reduced.data(), uint32(reduced.size())).orientation, nodePoints.data(), n);
+					nodePoints.swap(reduced);
+					simplified[node] = 1;
+				} else
+					m_oBoxes[node] = OBox(nodePoints.data(), n);
+			}
+		}
 		m_properties = Property::Val(m_properties | Property::OBOX_BVH);
 	}
 
 
 
-	const int NORMAL_SAMPLES = 1000;
+	// Smallest sphere which contains both spheres.
+	static Sphere mergeSpheres(const Sphere& _a, const Sphere& _b)
+	{
+		Vec3 dir = _b.center - _a.center;
+		float dist = len(dir);
+		if(dist + _b.radius <= _a.radius) return _a;
+		if(dist + _a.radius <= _b.radius) return _b;
+		float radius = (dist + _a.radius + _b.radius) * 0.5f;
+		return Sphere(_a.center + dir * ((radius - _a.radius) / dist), radius);
+	}
+
+	void Chunk::computeBVHSpheres()
+	{
+		if(!(m_properties & Property::AABOX_BVH))
+			computeBVHAABoxes();
+		m_spheres.resize(m_hierarchy.size());
+		std::vector<uint32> nodes, levelOffsets;
+		computeNodeLevels(nodes, levelOffsets);
+		// Bottom-up: all nodes of one level are independent.
+		for(int level = int(levelOffsets.size()) - 2; level >= 0; --level)
+		{
+#pragma omp parallel for schedule(dynamic, 256)
+			for(int i = int(levelOffsets[level]); i < int(levelOffsets[level + 1]); ++i)
+			{
+				uint32 node = nodes[i];
+				Vec3 center = (m_aaBoxes[node].min + m_aaBoxes[node].max) * 0.5f;
+				uint32 child = m_hierarchy[node].firstChild;
+				if(child & 0x80000000)
+				{
+					// Sphere around the box center which contains all vertices
+					uint32 leafIdx = child & 0x7fffffff;
+					float radiusSq = 0.0f;
+					do {
+						const UVec4& tri = m_hierarchyLeaves[leafIdx];
+						radiusSq = max(radiusSq, lensq(m_positions[tri.x] - center));
+						radiusSq = max(radiusSq, lensq(m_positions[tri.y] - center));
+						radiusSq = max(radiusSq, lensq(m_positions[tri.z] - center));
+					} while(m_hierarchyLeaves[leafIdx++].w & 0x80000000);
+					m_spheres[node] = Sphere(center, sqrt(radiusSq));
+				} else {
+					Sphere merged = m_spheres[child];
+					child = m_hierarchy[child].escape;
+					while(m_hierarchyParents[child] == node && child != 0)
+					{
+						merged = mergeSpheres(merged, m_spheres[child]);
+						child = m_hierarchy[child].escape;
+					}
+					// The box sphere is better for children of similar size.
+					float boxRadius = len(m_aaBoxes[node].max - m_aaBoxes[node].min) * 0.5f;
+					m_spheres[node] = merged.radius < boxRadius ? merged : Sphere(center, boxRadius);
+				}
+			}
+		}
+		m_properties = Property::Val(m_properties | Property::SPHERE_BVH);
+	}
+
+
 
 	// Linear interpolable values of the symmetric 3x3 matrix.
 	// This uncompressed form (contrary to Chunk::SGGX) serves as
@@ -99,45 +217,59 @@ namespace bim {
 		float xx, xy, xz, yy, yz, zz;
 	};
 
+	// Mean of |f| over a triangle for the linear function f with the vertex
+	// values _a, _b, _c.
+	static float meanAbsLinear(float _a, float _b, float _c)
+	{
+		float mean = (_a + _b + _c) / 3.0f;
+		if((_a >= 0.0f && _b >= 0.0f && _c >= 0.0f) || (_a <= 0.0f && _b <= 0.0f && _c <= 0.0f))
+			return ei::abs(mean);
+		// Make _a the single vertex on the positive side, then the positive
+		// part is a corner triangle with mean _a³ / (3 (_a-_b) (_a-_c)).
+		if((_b > 0.0f) == (_c > 0.0f)) { if(_b > 0.0f) { _a = -_a; _b = -_b; _c = -_c; mean = -mean; } }
+		else if((_a > 0.0f) == (_b > 0.0f)) { std::swap(_a, _c); if(_a < 0.0f) { _a = -_a; _b = -_b; _c = -_c; mean = -mean; } }
+		else { std::swap(_a, _b); if(_a < 0.0f) { _a = -_a; _b = -_b; _c = -_c; mean = -mean; } }
+		float positive = _a * _a * _a / (3.0f * (_a - _b) * (_a - _c));
+		return 2.0f * positive - mean;
+	}
+
+	// Closed form moments of the linear interpolated normals of all triangles
+	// in a leaf. For barycentric coordinates E[b_i b_j] = (1 + δ_ij) / 12, so
+	// E[n nᵀ] = (Σ n_i n_iᵀ + (Σ n_i)(Σ n_i)ᵀ) / 12 per triangle (ignoring the
+	// renormalization of the interpolated normal).
 	// _leaf Offseted pointer to the current leaf (not the entire array)
 	static TmpSGGX computeLeafSGGXBase(const Vec3* _positions, const Vec3* _normals, const UVec4* _leaf)
 	{
-		// Load triangle geometry
-		Triangle pos[16]; // TODO: DANGEROUS if _numLeaves > 16, but using local stack is much faster
-		Vec3 nrm[16 * 3];
-		int n = 0; // Count real number of triangles
+		Mat3x3 E(0.0f); // Expectations, later covariance matrix
+		float totalArea = 0.0f;
+		int n = 0;
 		do {
-			if(_leaf[n].x == _leaf[n].y) break;
-			pos[n] = Triangle(_positions[_leaf[n].x], _positions[_leaf[n].y], _positions[_leaf[n].z]);
-			nrm[n*3    ] = _normals[_leaf[n].x];
-			nrm[n*3 + 1] = _normals[_leaf[n].y];
-			nrm[n*3 + 2] = _normals[_leaf[n].z];
+			if(_leaf[n].x == _leaf[n].y) continue;
+			Triangle pos(_positions[_leaf[n].x], _positions[_leaf[n].y], _positions[_leaf[n].z]);
+			float area = surface(pos);
+			Vec3 n0, n1, n2;
+			if(_normals) { n0 = _normals[_leaf[n].x]; n1 = _normals[_leaf[n].y]; n2 = _normals[_leaf[n].z]; }
+			else n0 = n1 = n2 = normalize(cross(pos.v1 - pos.v0, pos.v2 - pos.v0));
+			Vec3 sum = n0 + n1 + n2;
+			float w = area / 12.0f;
+			E.m00 += w * (n0.x * n0.x + n1.x * n1.x + n2.x * n2.x + sum.x * sum.x);
+			E.m01 += w * (n0.x * n0.y + n1.x * n1.y + n2.x * n2.y + sum.x * sum.y);
+			E.m02 += w * (n0.x * n0.z + n1.x * n1.z + n2.x * n2.z + sum.x * sum.z);
+			E.m11 += w * (n0.y * n0.y + n1.y * n1.y + n2.y * n2.y + sum.y * sum.y);
+			E.m12 += w * (n0.y * n0.z + n1.y * n1.z + n2.y * n2.z + sum.y * sum.z);
+			E.m22 += w * (n0.z * n0.z + n1.z * n1.z + n2.z * n2.z + sum.z * sum.z);
+			totalArea += area;
 		} while(_leaf[n++].w & 0x80000000);
 
-		// Sample random normals from all triangles and compute spherical distribution variances.
-		Mat3x3 E(0.0f); // Expectations, later covariance matrix
-		float area = surface(pos[0]);
-		for(int i = 1; i < n; ++i) area += surface(pos[i]);
-		for(int i = 0; i < n; ++i)
-		{
-			cn::HaltonRng haltonSeq(2);
-			// Get percentage of the total number of samples
-			int nsamples = int(NORMAL_SAMPLES * surface(pos[i]) / area);
-			for(int j = 0; j < nsamples; ++j)
-			{
-				Vec3 bary = cn::barycentric(haltonSeq);
-				Vec3 normal = normalize(nrm[i*3] * bary.x + nrm[i*3+1] * bary.y + nrm[i*3+1] * bary.z);
-				// Update covariance matrix
-				E.m00 += normal.x * normal.x;
-				E.m01 += normal.x * normal.y;
-				E.m02 += normal.x * normal.z;
-				E.m11 += normal.y * normal.y;
-				E.m12 += normal.y * normal.z;
-				E.m22 += normal.z * normal.z;
-			}
+		TmpSGGX s;
+		if(totalArea <= 0.0f) {
+			// Degenerated leaf, use an isotropic distribution.
+			s.xx = s.yy = s.zz = 1.0f;
+			s.xy = s.xz = s.yz = 0.0f;
+			return s;
 		}
-		// Copy symmetric part of the matrix. Do not need to normalize by sample
-		// count because the scale (eigenvalues) are not of interest.
+		// Copy symmetric part of the matrix. Do not need to normalize
+		// because the scale (eigenvalues) are not of interest.
 		E.m10 = E.m01; E.m20 = E.m02; E.m21 = E.m12;
 		// Get eigenvectors they are the same as for the SGGX base
 		Mat3x3 Q; Vec3 λ;
@@ -146,25 +278,19 @@ namespace bim {
 		// Compute projected areas in the directions of eigenvectors using the same
 		// distribution as before.
 		λ = Vec3(0.0f);
-		int nTotalSamples = 0;
-		for(int i = 0; i < n; ++i)
-		{
-			cn::HaltonRng haltonSeq(2);
-			// Get percentage of the total number of samples
-			int nsamples = int(NORMAL_SAMPLES * surface(pos[i]) / area);
-			nTotalSamples += nsamples;
-			for(int j = 0; j < nsamples; ++j)
-			{
-				Vec3 bary = cn::barycentric(haltonSeq);
-				Vec3 normal = normalize(nrm[i*3] * bary.x + nrm[i*3+1] * bary.y + nrm[i*3+1] * bary.z);
-				λ[0] += ei::abs(Q(0) * normal);
-				λ[1] += ei::abs(Q(1) * normal);
-				λ[2] += ei::abs(Q(2) * normal);
-			}
-		}
-		λ /= nTotalSamples;// TODO: /4π ?
+		n = 0;
+		do {
+			if(_leaf[n].x == _leaf[n].y) continue;
+			Triangle pos(_positions[_leaf[n].x], _positions[_leaf[n].y], _positions[_leaf[n].z]);
+			float area = surface(pos);
+			Vec3 n0, n1, n2;
+			if(_normals) { n0 = _normals[_leaf[n].x]; n1 = _normals[_leaf[n].y]; n2 = _normals[_leaf[n].z]; }
+			else n0 = n1 = n2 = normalize(cross(pos.v1 - pos.v0, pos.v2 - pos.v0));
+			for(int k = 0; k < 3; ++k)
+				λ[k] += area * meanAbsLinear(Q(k) * n0, Q(k) * n1, Q(k) * n2);
+		} while(_leaf[n++].w & 0x80000000);
+		λ /= totalArea;// TODO: /4π ?
 		E = transpose(Q) * diag(λ) * Q;
-		TmpSGGX s;
 		s.xx = E.m00; s.xy = E.m01; s.xz = E.m02;
 		s.yy = E.m11; s.yz = E.m12;
 		s.zz = E.m22;
@@ -177,50 +303,82 @@ namespace bim {
 		return s;
 	}
 
-	static TmpSGGX computeBVHSGGXApproximationsRec(const Vec3* _positions, const Vec3* _normals, const Node* _hierarchy, uint32 _node, const UVec4* _leaves, const Box* _aaBoxes, std::vector<SGGX>& _output)
+	void Chunk::computeBVHSGGXApproximations()
 	{
-		TmpSGGX s;
-		// End of recursion (inner node which points to one leaf)
-		uint32 child = _hierarchy[_node].firstChild;
-		if(child & 0x80000000)
-		{
-			s = computeLeafSGGXBase(_positions, _normals, _leaves + (child & 0x7fffffff));
-		} else {
-			s = computeBVHSGGXApproximationsRec(_positions, _normals, _hierarchy, child, _leaves, _aaBoxes, _output);
-			child = _hierarchy[child].escape;
-			float lw = surface(_aaBoxes[child]);
-			//eiAssert(_parents[child] == _node && child!=0 && _parents[_hierarchy[child].escape] != _node,
-			//	"Expected binary tree!");
-			TmpSGGX s2 = computeBVHSGGXApproximationsRec(_positions, _normals, _hierarchy, child, _leaves, _aaBoxes, _output);
-			// Weight depending on subtree bounding volume sizes
-			float rw = surface(_aaBoxes[child]);
-			float wsum = lw + rw;
-			lw /= wsum; rw /= wsum;
-			s.xx = s.xx * lw + s2.xx * rw;
-			s.xy = s.xy * lw + s2.xy * rw;
-			s.xz = s.xz * lw + s2.xz * rw;
-			s.yy = s.yy * lw + s2.yy * rw;
-			s.yz = s.yz * lw + s2.yz * rw;
-			s.zz = s.zz * lw + s2.zz * rw;
-		}
-		// Store compressed form
-		_output[_node].σ = Vec<uint16, 3>(sqrt(Vec3(s.xx, s.yy, s.zz)) * 65535.0f);
-		_output[_node].r = Vec<uint16, 3>(Vec3(s.xy, s.xz, s.yz) / sqrt(Vec3(s.xx*s.yy, s.xx*s.zz, s.yy*s.zz)) * 32767.0f + 32767.0f);
-		return s;
+		if(!(m_properties & Property::AABOX_BVH))
+			computeBVHAABoxes();
+		std::vector<SGGX>(getNumNodes()).swap(m_nodeNDFs);
+		std::vector<TmpSGGX> tmp(getNumNodes());
+		const Vec3* normals = (m_properties & Property::NORMAL) ? m_normals.data() : nullptr;
+		std::vector<uint32> nodes, levelOffsets;
+		computeNodeLevels(nodes, levelOffsets);
+		// Bottom-up: all nodes of one level are independent.
+		for(int level = int(levelOffsets.size()) - 2; level >= 0; --level)
+		{
+#pragma omp parallel for schedule(dynamic, 64)
+			for(int i = int(levelOffsets[level]); i < int(levelOffsets[level + 1]); ++i)
+			{
+				uint32 node = nodes[i];
+				TmpSGGX& s = tmp[node];
+				uint32 child = m_hierarchy[node].firstChild;
+				if(child & 0x80000000)
+				{
+					s = computeLeafSGGXBase(m_positions.data(), normals, m_hierarchyLeaves.data() + (child & 0x7fffffff));
+				} else {
+					// Weight depending on subtree bounding volume sizes
+					s.xx = s.xy = s.xz = s.yy = s.yz = s.zz = 0.0f;
+					float wsum = 0.0f;
+					do {
+						float w = surface(m_aaBoxes[child]);
+						const TmpSGGX& c = tmp[child];
+						s.xx += c.xx * w; s.xy += c.xy * w; s.xz += c.xz * w;
+						s.yy += c.yy * w; s.yz += c.yz * w; s.zz += c.zz * w;
+						wsum += w;
+						child = m_hierarchy[child].escape;
+					} while(m_hierarchyParents[child] == node && child != 0);
+					if(wsum > 0.0f) {
+						s.xx /= wsum; s.xy /= wsum; s.xz /= wsum;
+						s.yy /= wsum; s.yz /= wsum; s.zz /= wsum;
+					}
+				}
+				// Store compressed form
+				m_nodeNDFs[node].σ = Vec<uint16, 3>(sqrt(Vec3(s.xx, s.yy, s.zz)) * 65535.0f);
+				m_nodeNDFs[node].r = Vec<uint16, 3>(Vec3(s.xy, s.xz, s.yz) / sqrt(Vec3(s.xx*s.yy, s.xx*s.zz, s.yy*s.zz)) * 32767.0f + 32767.0f);
+			}
+		}
+
+		m_properties = Property::Val(m_properties | Property::NDF_SGGX);
 	}
 
-	void Chunk::computeBVHSGGXApproximations()
+
+
+	static void setLeafTriangle(TriangleBlock* _blocks, uint32 _entry, const Vec3& _v0, const Vec3& _v1, const Vec3& _v2)
 	{
-		swap(m_nodeNDFs, std::vector<SGGX>(getNumNodes()));
-		computeBVHSGGXApproximationsRec(m_positions.data(),
-			m_normals.data(),
-			m_hierarchy.data(),
-			0,
-			m_hierarchyLeaves.data(),
-			m_aaBoxes.data(),
-			m_nodeNDFs);
+		TriangleBlock& block = _blocks[_entry / 4];
+		uint32 lane = _entry % 4;
+		for(int c = 0; c < 3; ++c)
+		{
+			block.v0[c][lane] = _v0[c];
+			block.e1[c][lane] = _v1[c] - _v0[c];
+			block.e2[c][lane] = _v2[c] - _v0[c];
+		}
+	}
 
-		m_properties = Property::Val(m_properties | Property::NDF_SGGX);
+	void Chunk::computeLeafTriangles()
+	{
+		if(!(m_properties & Property::HIERARCHY)) {
+			sendMessage(MessageType::ERROR, "Leaf triangles require a hierarchy!");
+			return;
+		}
+		// Zero initialization makes the padding lanes degenerated.
+		m_leafTriangles.assign((m_hierarchyLeaves.size() + 3) / 4, TriangleBlock());
+#pragma omp parallel for schedule(static)
+		for(int i = 0; i < int(m_hierarchyLeaves.size()); ++i)
+		{
+			const UVec4& tri = m_hierarchyLeaves[i];
+			setLeafTriangle(m_leafTriangles.data(), i, m_positions[tri.x], m_positions[tri.y], m_positions[tri.z]);
+		}
+		m_properties = Property::Val(m_properties | Property::LEAF_TRIANGLES);
 	}
 
 
@@ -241,4 +399,213 @@ namespace bim {
 		return 1;
 	}
 
+
+	void Chunk::computeNodeLevels(std::vector<uint32>& _nodes, std::vector<uint32>& _levelOffsets) const
+	{
+		_nodes.clear();
+		_nodes.reserve(m_hierarchy.size());
+		_levelOffsets.clear();
+		if(m_hierarchy.empty()) { _levelOffsets.push_back(0); return; }
+		_nodes.push_back(0);
+		_levelOffsets.push_back(0);
+		uint32 levelBegin = 0;
+		while(levelBegin < _nodes.size())
+		{
+			uint32 levelEnd = (uint32)_nodes.size();
+			_levelOffsets.push_back(levelEnd);
+			// Append the children of the current level
+			for(uint32 i = levelBegin; i < levelEnd; ++i)
+			{
+				uint32 node = _nodes[i];
+				uint32 child = m_hierarchy[node].firstChild;
+				if(child & 0x80000000) continue;
+				do {
+					_nodes.push_back(child);
+					child = m_hierarchy[child].escape;
+				} while(m_hierarchyParents[child] == node && child != 0);
+			}
+			levelBegin = levelEnd;
+		}
+	}
+
+	// Recompute the leaf triangles of one leaf. Leaves write disjoint lanes of
+	// the triangle blocks.
+	static void refitLeafTriangles(TriangleBlock* _blocks, const Vec3* _positions, const UVec4* _leaves, uint32 _leafIdx)
+	{
+		do {
+			const UVec4& tri = _leaves[_leafIdx];
+			setLeafTriangle(_blocks, _leafIdx, _positions[tri.x], _positions[tri.y], _positions[tri.z]);
+		} while(_leaves[_leafIdx++].w & 0x80000000);
+	}
+
+	float Chunk::refitHierarchy()
+	{
+		if(!(m_properties & Property::HIERARCHY)) {
+			sendMessage(MessageType::ERROR, "Cannot refit a hierarchy which does not exist!");
+			return 0.0f;
+		}
+		if(!(m_properties & Property::AABOX_BVH)) {
+			computeBVHAABoxes();
+			return 1.0f;
+		}
+		// The boxes are still those from before the vertex changes.
+		if(m_referenceSAHCost <= 0.0f)
+			m_referenceSAHCost = computeSAHCost();
+
+		std::vector<uint32> nodes, levelOffsets;
+		computeNodeLevels(nodes, levelOffsets);
+		// Bottom-up: all nodes of one level are independent.
+		for(int level = int(levelOffsets.size()) - 2; level >= 0; --level)
+		{
+#pragma omp parallel for schedule(dynamic, 256)
+			for(int i = int(levelOffsets[level]); i < int(levelOffsets[level + 1]); ++i)
+			{
+				uint32 node = nodes[i];
+				uint32 child = m_hierarchy[node].firstChild;
+				if(child & 0x80000000)
+				{
+					m_aaBoxes[node] = computeLeafBox(m_positions.data(), m_hierarchyLeaves.data(), child & 0x7fffffff);
+					if(m_properties & Property::LEAF_TRIANGLES)
+						refitLeafTriangles(m_leafTriangles.data(), m_positions.data(), m_hierarchyLeaves.data(), child & 0x7fffffff);
+				} else {
+					m_aaBoxes[node] = m_aaBoxes[child];
+					child = m_hierarchy[child].escape;
+					while(m_hierarchyParents[child] == node && child != 0)
+					{
+						m_aaBoxes[node] = Box(m_aaBoxes[child], m_aaBoxes[node]);
+						child = m_hierarchy[child].escape;
+					}
+				}
+			}
+		}
+		m_boundingBox = Box(m_boundingBox, m_aaBoxes[0]);
+
+		m_refitSAHSum = computeSAHSum();
+		return float(m_refitSAHSum / surface(m_aaBoxes[0])) / m_referenceSAHCost;
+	}
+
+	void Chunk::buildVertexLeafMap()
+	{
+		// Counting sort of (vertex, leaf node) pairs by the vertex.
+		m_vertexLeafOffsets.assign(m_positions.size() + 1, 0);
+		for(uint32 node = 0; node < m_hierarchy.size(); ++node)
+		{
+			uint32 leafIdx = m_hierarchy[node].firstChild;
+			if(!(leafIdx & 0x80000000)) continue;
+			leafIdx &= 0x7fffffff;
+			do {
+				const UVec4& tri = m_hierarchyLeaves[leafIdx];
+				m_vertexLeafOffsets[tri.x + 1]++;
+				m_vertexLeafOffsets[tri.y + 1]++;
+				m_vertexLeafOffsets[tri.z + 1]++;
+			} while(m_hierarchyLeaves[leafIdx++].w & 0x80000000);
+		}
+		for(size_t i = 1; i < m_vertexLeafOffsets.size(); ++i)
+			m_vertexLeafOffsets[i] += m_vertexLeafOffsets[i - 1];
+		m_vertexLeafNodes.resize(m_vertexLeafOffsets.back());
+		std::vector<uint32> fill(m_vertexLeafOffsets.begin(), m_vertexLeafOffsets.end() - 1);
+		for(uint32 node = 0; node < m_hierarchy.size(); ++node)
+		{
+			uint32 leafIdx = m_hierarchy[node].firstChild;
+			if(!(leafIdx & 0x80000000)) continue;
+			leafIdx &= 0x7fffffff;
+			do {
+				const UVec4& tri = m_hierarchyLeaves[leafIdx];
+				m_vertexLeafNodes[fill[tri.x]++] = node;
+				m_vertexLeafNodes[fill[tri.y]++] = node;
+				m_vertexLeafNodes[fill[tri.z]++] = node;
+			} while(m_hierarchyLeaves[leafIdx++].w & 0x80000000);
+		}
+	}
+
+	float Chunk::refitAABoxes(const std::vector<uint32>& _leafNodes)
+	{
+		// Leaves are independent. The SAH sum is updated by the change of the
+		// surfaces.
+		double deltaCost = 0.0;
+#pragma omp parallel for reduction(+:deltaCost) schedule(dynamic, 64)
+		for(int i = 0; i < int(_leafNodes.size()); ++i)
+		{
+			uint32 node = _leafNodes[i];
+			uint32 leafIdx = m_hierarchy[node].firstChild & 0x7fffffff;
+			float oldSurface = surface(m_aaBoxes[node]);
+			m_aaBoxes[node] = computeLeafBox(m_positions.data(), m_hierarchyLeaves.data(), leafIdx);
+			deltaCost += nodeSAHCost(node) * (surface(m_aaBoxes[node]) - oldSurface);
+			if(m_properties & Property::LEAF_TRIANGLES)
+				refitLeafTriangles(m_leafTriangles.data(), m_positions.data(), m_hierarchyLeaves.data(), leafIdx);
+		}
+
+		// Propagate upwards. A path ends where a box does not change anymore,
+		// because the remaining ancestors are then unaffected (or will be updated
+		// by the path of another dirty leaf).
+		for(uint32 leaf : _leafNodes)
+		{
+			uint32 node = leaf;
+			while(node != 0)
+			{
+				uint32 parent = m_hierarchyParents[node];
+				uint32 child = m_hierarchy[parent].firstChild;
+				Box box = m_aaBoxes[child];
+				child = m_hierarchy[child].escape;
+				while(m_hierarchyParents[child] == parent && child != 0)
+				{
+					box = Box(m_aaBoxes[child], box);
+					child = m_hierarchy[child].escape;
+				}
+				if(box.min == m_aaBoxes[parent].min && box.max == m_aaBoxes[parent].max)
+					break;
+				deltaCost += nodeSAHCost(parent) * (surface(box) - surface(m_aaBoxes[parent]));
+				m_aaBoxes[parent] = box;
+				node = parent;
+			}
+		}
+		m_boundingBox = Box(m_boundingBox, m_aaBoxes[0]);
+
+		m_refitSAHSum += deltaCost;
+		return float(m_refitSAHSum / surface(m_aaBoxes[0])) / m_referenceSAHCost;
+	}
+
+	float Chunk::refitHierarchy(const std::vector<UVec2>& _dirtyRanges, bool _triangleRanges)
+	{
+		if(!(m_properties & Property::HIERARCHY)) {
+			sendMessage(MessageType::ERROR, "Cannot refit a hierarchy which does not exist!");
+			return 0.0f;
+		}
+		if(!(m_properties & Property::AABOX_BVH)) {
+			computeBVHAABoxes();
+			return 1.0f;
+		}
+		// The boxes are still those from before the vertex changes.
+		if(m_referenceSAHCost <= 0.0f)
+			m_referenceSAHCost = computeSAHCost();
+		if(m_refitSAHSum < 0.0)
+			m_refitSAHSum = computeSAHSum();
+		if(m_vertexLeafOffsets.size() != m_positions.size() + 1)
+			buildVertexLeafMap();
+
+		std::vector<uint32> leafNodes;
+		auto addVertex = [&](uint32 _v) {
+			for(uint32 i = m_vertexLeafOffsets[_v]; i < m_vertexLeafOffsets[_v + 1]; ++i)
+				leafNodes.push_back(m_vertexLeafNodes[i]);
+		};
+		for(auto& range : _dirtyRanges)
+		{
+			if(_triangleRanges)
+			{
+				for(uint32 t = range.x; t < min(range.y, getNumTriangles()); ++t)
+				{
+					addVertex(m_triangles[t].x);
+					addVertex(m_triangles[t].y);
+					addVertex(m_triangles[t].z);
+				}
+			} else {
+				for(uint32 v = range.x; v < min(range.y, getNumVertices()); ++v)
+					addVertex(v);
+			}
+		}
+		std::sort(leafNodes.begin(), leafNodes.end());
+		leafNodes.erase(std::unique(leafNodes.begin(), leafNodes.end()), leafNodes.end());
+		return refitAABoxes(leafNodes);
+	}
+
 } // namespace bim
\ No newline at end of file
@@ -3,8 +3,11 @@
 #include "../deps/miniz.c"
 #include "../deps/EnumConverter.h"
 #include "bim/log.hpp"
+#include "bim_jsonreader.hpp"
 #include <fstream>
 #include <memory>
+#include <cstring>
+#include <algorithm>
 
 static const char* propertyString(bim::Property::Val _prop)
 {
@@ -15,6 +18,7 @@ static const char* propertyString(bim::Property::Val _prop)
 		case bim::Property::TANGENT: return "TANGENT";
 		case bim::Property::BITANGENT: return "BITANGENT";
 		case bim::Property::QORMAL: return "QORMAL";
+		case bim::Property::QORMAL16: return "QORMAL16";
 		case bim::Property::TEXCOORD0: return "TEXCOORD1";
 		case bim::Property::TEXCOORD1: return "POSITION";
 		case bim::Property::TEXCOORD2: return "TEXCOORD2";
@@ -27,6 +31,8 @@ static const char* propertyString(bim::Property::Val _prop)
 		case bim::Property::SPHERE_BVH: return "SPHERE_BVH";
 		case bim::Property::HIERARCHY: return "HIERARCHY";
 		case bim::Property::NDF_SGGX: return "NDF_SGGX";
+		case bim::Property::COMPRESSED_BVH: return "COMPRESSED_BVH";
+		case bim::Property::LEAF_TRIANGLES: return "LEAF_TRIANGLES";
 		default: return "UNKNOWN";
 	}
 }
@@ -47,6 +53,9 @@ namespace bim {
 	const int HIERARCHY_PARENTS = 0x08000001;
 	const int HIERARCHY_LEAVES = 0x08000002;
 	const int CHUNK_META_SECTION = 0x6;
+	const int PACKED_MATERIALS = 0x7;
+	const int MATERIAL_NAMES = 0x9;		// Replaces MATERIAL_REFERENCE (names with fixed length)
+	const int LIGHT_TREES = 0xa;
 
 	struct MetaSection
 	{
@@ -110,7 +119,8 @@ namespace bim {
 			m_requestedProps = Property::Val(m_requestedProps | m_accelerator);
 		else if((_requiredProperties & Property::HIERARCHY)
 			&& !(_requiredProperties & Property::AABOX_BVH)
-			&& !(_requiredProperties & Property::OBOX_BVH))
+			&& !(_requiredProperties & Property::OBOX_BVH)
+			&& !(_requiredProperties & Property::SPHERE_BVH))
 			m_requestedProps = Property::Val(m_requestedProps | Property::AABOX_BVH);
 		m_optionalProperties = _optionalProperties;
 		m_numChunks = meta.numChunks;
@@ -126,19 +136,57 @@ namespace bim {
 			if(header.type == CHUNK_SECTION)
 			{
 				emptyChunk.m_address = m_file.tellg();
+				// The chunk meta section is always first. Read it to know the bounding
+				// boxes of non-resident chunks.
+				SectionHeader metaHeader;
+				if(m_file.read(reinterpret_cast<char*>(&metaHeader), sizeof(SectionHeader)) && metaHeader.type == CHUNK_META_SECTION)
+				{
+					ChunkMetaSection chunkMeta;
+					m_file.read(reinterpret_cast<char*>(&chunkMeta), sizeof(ChunkMetaSection));
+					emptyChunk.m_boundingBox = chunkMeta.boundingBox;
+					emptyChunk.m_numTreeLevels = chunkMeta.numTreeLevels;
+				}
 				m_chunks.push_back(emptyChunk);
 				m_chunkStates.push_back(ChunkState::EMPTY);
-				m_file.seekg(header.size, std::ios_base::cur);
+				m_file.seekg(emptyChunk.m_address + header.size, std::ios_base::beg);
+			} else if(header.type == MATERIAL_NAMES)
+			{
+				// uint32 num, uint32 offsets[num+1], characters
+				std::vector<char> table(header.size);
+				m_file.read(table.data(), header.size);
+				uint32 num = 0;
+				if(header.size >= sizeof(uint32)) memcpy(&num, table.data(), sizeof(uint32));
+				if(header.size < 2 * sizeof(uint32) || header.size / sizeof(uint32) - 2 < num) {
+					sendMessage(MessageType::ERROR, "Invalid material name table!");
+					return false;
+				}
+				const uint32* offsets = reinterpret_cast<const uint32*>(table.data() + sizeof(uint32));
+				const char* chars = table.data() + (num + 2) * sizeof(uint32);
+				if(offsets[num] > header.size - (num + 2) * sizeof(uint32)) {
+					sendMessage(MessageType::ERROR, "Invalid material name table!");
+					return false;
+				}
+				for(uint i = 0; i < num; ++i)
+				{
+					uint32 begin = ei::min(offsets[i], offsets[num]);
+					uint32 end = ei::max(begin, ei::min(offsets[i+1], offsets[num]));
+					addMaterialIndex(std::string(chars + begin, chars + end));
+				}
 			} else if(header.type == MATERIAL_REFERENCE)
 			{
+				// Old format: 64 byte zero padded names
 				uint32 num;
 				m_file.read(reinterpret_cast<char*>(&num), sizeof(uint32));
-				char buf[64];
+				std::vector<char> names(num * 64);
+				m_file.read(names.data(), names.size());
 				for(uint i = 0; i < num; ++i)
-				{
-					m_file.read(buf, 64);
-					m_materialIndirection.push_back(buf);
-				}
+					addMaterialIndex(std::string(&names[i * 64], strnlen(&names[i * 64], 64)));
+			} else if(header.type == LIGHT_TREES)
+			{
+				// The scenarios are already known from the environment file.
+				std::vector<uint32> blob(header.size / sizeof(uint32));
+				if(m_file.read(reinterpret_cast<char*>(blob.data()), blob.size() * sizeof(uint32)))
+					unpackLightTrees(blob.data(), blob.size());
 			} else
 				m_file.seekg(header.size, std::ios_base::cur);
 		}
@@ -155,9 +203,12 @@ namespace bim {
 		// to all existing materials.
 		if(m_materialIndirection.empty())
 		{
-			for(auto it : m_materials)
-				m_materialIndirection.push_back(it.second.getName());
+			for(auto& it : m_materials)
+				addMaterialIndex(it.second.getName());
 		}
+		compileMaterials();
+
+		buildChunkHierarchy();
 
 		return true;
 	}
@@ -165,6 +216,7 @@ namespace bim {
 	void BinaryModel::loadEnvironmentFile(const char * _envFile)
 	{
 		loadEnv(_envFile, true);
+		compileMaterials();
 	}
 
 	void BinaryModel::storeBinaryHeader(const char * _bimFile)
@@ -184,20 +236,64 @@ namespace bim {
 		meta.boundingBox = m_boundingBox;
 		file.write(reinterpret_cast<char*>(&meta), sizeof(MetaSection));
 
-		header.type = MATERIAL_REFERENCE;
-		header.size = m_materialIndirection.size() * 64 + sizeof(int);
+		// Material names as string table: number, offsets and all characters
+		// (without terminating zeros).
+		std::vector<uint32> nameOffsets(m_materialIndirection.size() + 2);
+		nameOffsets[0] = (uint32)m_materialIndirection.size();
+		std::string names;
+		for(size_t i = 0; i < m_materialIndirection.size(); ++i)
+		{
+			nameOffsets[i + 1] = (uint32)names.size();
+			names += m_materialIndirection[i];
+		}
+		nameOffsets.back() = (uint32)names.size();
+		header.type = MATERIAL_NAMES;
+		header.size = nameOffsets.size() * sizeof(uint32) + names.size();
 		file.write(reinterpret_cast<char*>(&header), sizeof(SectionHeader));
-		uint32 ibuf = (uint32)m_materialIndirection.size();
-		file.write(reinterpret_cast<char*>(&ibuf), sizeof(uint32));
-		//file.write(reinterpret_cast<char*>(&header), sizeof(SectionHeader));
-		char zeroBuf[64] = {0};
-		for(auto& str : m_materialIndirection)
+		file.write(reinterpret_cast<char*>(nameOffsets.data()), nameOffsets.size() * sizeof(uint32));
+		file.write(names.data(), names.size());
+
+		// Optional: the materials in their fixed layouts. If available, load()
+		// does not need to parse them from the environment file.
+		std::vector<uint32> packedMaterials;
+		if(packMaterials(packedMaterials))
+		{
+			header.type = PACKED_MATERIALS;
+			header.size = packedMaterials.size() * sizeof(uint32);
+			file.write(reinterpret_cast<char*>(&header), sizeof(SectionHeader));
+			file.write(reinterpret_cast<char*>(packedMaterials.data()), header.size);
+		} else sendMessage(MessageType::INFO, "Materials are not stored in the binary file. They are loaded from the environment file instead.");
+
+		// Optional: light trees of all scenarios where they were built.
+		std::vector<uint32> lightTrees;
+		if(packLightTrees(lightTrees))
 		{
-			file.write(str.c_str(), str.length()+1);
-			file.write(zeroBuf, 63 - str.length());
+			header.type = LIGHT_TREES;
+			header.size = lightTrees.size() * sizeof(uint32);
+			file.write(reinterpret_cast<char*>(&header), sizeof(SectionHeader));
+			file.write(reinterpret_cast<char*>(lightTrees.data()), header.size);
 		}
 	}
 
+	bool BinaryModel::loadPackedMaterials(const std::string& _bimFile)
+	{
+		std::ifstream file(_bimFile, std::ios_base::binary);
+		SectionHeader header;
+		// The section is part of the header, so stop at the first chunk.
+		while(file.read(reinterpret_cast<char*>(&header), sizeof(SectionHeader)) && header.type != CHUNK_SECTION)
+		{
+			if(header.type == PACKED_MATERIALS)
+			{
+				std::vector<uint32> blob(header.size / sizeof(uint32));
+				if(!file.read(reinterpret_cast<char*>(blob.data()), blob.size() * sizeof(uint32)))
+					return false;
+				return unpackMaterials(blob.data(), blob.size());
+			}
+			file.seekg(header.size, std::ios_base::cur);
+		}
+		return false;
+	}
+
 	template<typename T>
 	static void loadFileChunk(std::ifstream& _file, const SectionHeader& _header, std::vector<T>& _data, Property::Val& _chunkProp, Property::Val _newProp)
 	{
@@ -235,7 +331,11 @@ namespace bim {
 	{
 		int chunkIndex = dot(_chunkPos, m_dimScale);
 		if(m_chunkStates[chunkIndex] == ChunkState::LOADED)
+		{
+			// The caller may edit the chunk
+			m_chunkHierarchyDirty = true;
 			return &m_chunks[chunkIndex];
+		}
 		sendMessage(MessageType::ERROR, "Chunk is not resident. getChunk() is invalid in this state.");
 		return nullptr;
 	}
@@ -258,8 +358,10 @@ namespace bim {
 			SectionHeader header;
 			while(m_file.read(reinterpret_cast<char*>(&header), sizeof(SectionHeader)) && header.type != CHUNK_SECTION)
 			{
-				// Should this property be loaded?
-				if(m_loadAll || ((m_requestedProps & header.type) != 0) || ((m_optionalProperties & header.type) != 0))
+				// Should this property be loaded? The leaves are also required
+				// by the compressed hierarchy.
+				if(m_loadAll || ((m_requestedProps & header.type) != 0) || ((m_optionalProperties & header.type) != 0)
+					|| (header.type == HIERARCHY_LEAVES && ((m_requestedProps | m_optionalProperties) & Property::COMPRESSED_BVH)))
 				{
 					switch(header.type)
 					{
@@ -274,6 +376,7 @@ namespace bim {
 						case Property::TANGENT: loadFileChunk(m_file, header, m_chunks[idx].m_tangents, m_chunks[idx].m_properties, Property::TANGENT); break;
 						case Property::BITANGENT: loadFileChunk(m_file, header, m_chunks[idx].m_bitangents, m_chunks[idx].m_properties, Property::BITANGENT); break;
 						case Property::QORMAL: loadFileChunk(m_file, header, m_chunks[idx].m_qormals, m_chunks[idx].m_properties, Property::QORMAL); break;
+						case Property::QORMAL16: loadFileChunk(m_file, header, m_chunks[idx].m_qormals16, m_chunks[idx].m_properties, Property::QORMAL16); break;
 						case Property::TEXCOORD0: loadFileChunk(m_file, header, m_chunks[idx].m_texCoords0, m_chunks[idx].m_properties, Property::TEXCOORD0); break;
 						case Property::TEXCOORD1: loadFileChunk(m_file, header, m_chunks[idx].m_texCoords1, m_chunks[idx].m_properties, Property::TEXCOORD1); break;
 						case Property::TEXCOORD2: loadFileChunk(m_file, header, m_chunks[idx].m_texCoords2, m_chunks[idx].m_properties, Property::TEXCOORD2); break;
@@ -286,7 +389,10 @@ namespace bim {
 						case HIERARCHY_LEAVES: loadFileChunk(m_file, header, m_chunks[idx].m_hierarchyLeaves, m_chunks[idx].m_properties, Property::DONT_CARE); break;
 						case Property::AABOX_BVH: loadFileChunk(m_file, header, m_chunks[idx].m_aaBoxes, m_chunks[idx].m_properties, Property::AABOX_BVH); break;
 						case Property::OBOX_BVH: loadFileChunk(m_file, header, m_chunks[idx].m_oBoxes, m_chunks[idx].m_properties, Property::OBOX_BVH); break;
+						case Property::SPHERE_BVH: loadFileChunk(m_file, header, m_chunks[idx].m_spheres, m_chunks[idx].m_properties, Property::SPHERE_BVH); break;
 						case Property::NDF_SGGX: loadFileChunk(m_file, header, m_chunks[idx].m_nodeNDFs, m_chunks[idx].m_properties, Property::NDF_SGGX); break;
+						case Property::COMPRESSED_BVH: loadFileChunk(m_file, header, m_chunks[idx].m_compressedNodes, m_chunks[idx].m_properties, Property::COMPRESSED_BVH); break;
+						case Property::LEAF_TRIANGLES: loadFileChunk(m_file, header, m_chunks[idx].m_leafTriangles, m_chunks[idx].m_properties, Property::LEAF_TRIANGLES); break;
 						default: m_file.seekg(header.size, std::ios_base::cur);
 					}
 				} else m_file.seekg(header.size, std::ios_base::cur);
@@ -307,11 +413,41 @@ namespace bim {
 			}
 	
 			m_chunkStates[idx] = ChunkState::LOADED;
+			buildChunkHierarchy();
 		}
 	}
 
 	void BinaryModel::makeChunkResidentAsync(const ei::IVec3& _chunk)
 	{
+		int idx = dot(m_dimScale, _chunk);
+		if(m_chunkStates[idx] == ChunkState::LOADED)
+			return;
+		if(m_chunkStates[idx] == ChunkState::EMPTY)
+			m_chunkStates[idx] = ChunkState::LOAD_REQUEST;
+		requestChunk(idx);
+	}
+
+	void BinaryModel::requestChunk(uint32 _chunkIdx) const
+	{
+		{
+			std::lock_guard<std::mutex> lock(m_chunkRequestMutex);
+			if(std::find(m_chunkRequests.begin(), m_chunkRequests.end(), _chunkIdx) != m_chunkRequests.end())
+				return;
+			m_chunkRequests.push_back(_chunkIdx);
+		}
+		if(m_chunkRequestCallback)
+			m_chunkRequestCallback(ei::IVec3(_chunkIdx % m_numChunks.x, (_chunkIdx / m_numChunks.x) % m_numChunks.y, _chunkIdx / (m_numChunks.x * m_numChunks.y)));
+	}
+
+	std::vector<ei::IVec3> BinaryModel::takeChunkRequests()
+	{
+		std::lock_guard<std::mutex> lock(m_chunkRequestMutex);
+		std::vector<ei::IVec3> requests;
+		requests.reserve(m_chunkRequests.size());
+		for(uint32 idx : m_chunkRequests)
+			requests.push_back(ei::IVec3(idx % m_numChunks.x, (idx / m_numChunks.x) % m_numChunks.y, idx / (m_numChunks.x * m_numChunks.y)));
+		m_chunkRequests.clear();
+		return requests;
 	}
 
 	bool BinaryModel::isChunkResident(const ei::IVec3& _chunk) const
@@ -401,6 +537,8 @@ namespace bim {
 			storeFileChunk(file, Property::BITANGENT, m_chunks[idx].m_bitangents);
 		if(m_chunks[idx].m_properties & Property::QORMAL)
 			storeFileChunk(file, Property::QORMAL, m_chunks[idx].m_qormals);
+		if(m_chunks[idx].m_properties & Property::QORMAL16)
+			storeFileChunk(file, Property::QORMAL16, m_chunks[idx].m_qormals16);
 		if(m_chunks[idx].m_properties & Property::TEXCOORD0)
 			storeFileChunk(file, Property::TEXCOORD0, m_chunks[idx].m_texCoords0);
 		if(m_chunks[idx].m_properties & Property::TEXCOORD1)
@@ -428,8 +566,14 @@ namespace bim {
 			storeFileChunk(file, Property::AABOX_BVH, m_chunks[idx].m_aaBoxes);
 		if(m_chunks[idx].m_properties & Property::OBOX_BVH)
 			storeFileChunk(file, Property::OBOX_BVH, m_chunks[idx].m_oBoxes);
+		if(m_chunks[idx].m_properties & Property::SPHERE_BVH)
+			storeFileChunk(file, Property::SPHERE_BVH, m_chunks[idx].m_spheres);
 		if(m_chunks[idx].m_properties & Property::NDF_SGGX)
 			storeFileChunk(file, Property::NDF_SGGX, m_chunks[idx].m_nodeNDFs);
+		if(m_chunks[idx].m_properties & Property::COMPRESSED_BVH)
+			storeFileChunk(file, Property::COMPRESSED_BVH, m_chunks[idx].m_compressedNodes);
+		if(m_chunks[idx].m_properties & Property::LEAF_TRIANGLES)
+			storeFileChunk(file, Property::LEAF_TRIANGLES, m_chunks[idx].m_leafTriangles);
 
 		// Query the correct size and rewrite the header.
 		header.type = CHUNK_SECTION;
@@ -439,98 +583,222 @@ namespace bim {
 		file.write(reinterpret_cast<const char*>(&header), sizeof(SectionHeader));
 	}
 
+	// Get the members of the object at _object sorted by their keys. This is
+	// the order of the std::map of the former DOM parser, which defines the
+	// indices of lights and cameras. For duplicate keys the last one wins.
+	static std::vector<std::pair<std::string, const char*>> sortedMembers(JsonReader& _reader, const char* _object)
+	{
+		std::vector<std::pair<std::string, const char*>> members;
+		std::string key;
+		_reader.seek(_object);
+		if(_reader.beginObject())
+			while(_reader.nextKey(key))
+			{
+				members.emplace_back(key, _reader.position());
+				_reader.skipValue();
+			}
+		std::stable_sort(members.begin(), members.end(),
+			[](const std::pair<std::string, const char*>& _a, const std::pair<std::string, const char*>& _b) { return _a.first < _b.first; });
+		auto last = std::unique(members.rbegin(), members.rend(),
+			[](const std::pair<std::string, const char*>& _a, const std::pair<std::string, const char*>& _b) { return _a.first == _b.first; });
+		members.erase(members.begin(), last.base());
+		return members;
+	}
+
 	std::string BinaryModel::loadEnv(const char* _envFile, bool _ignoreBinary)
 	{
 		std::string binarySceneFile;
-		std::ifstream envFile(_envFile);
+		if(m_useEnvCache && loadEnvCache(_envFile, _ignoreBinary, binarySceneFile))
+			return move(binarySceneFile);
+
+		std::ifstream envFile(_envFile, std::ios_base::binary);
 		if(!envFile) {
 			sendMessage(MessageType::ERROR, "Opening environment JSON failed!");
 			return move(binarySceneFile);
 		}
-		Json jsonRoot;
-		try {
-			envFile >> jsonRoot;
-
-			// Make sure that there is always a default scenario at the
-			// first place.
-			addScenario("default");
+		// Read the whole file at once, the parser works in memory.
+		envFile.seekg(0, std::ios_base::end);
+		std::string content(size_t(envFile.tellg()), '\0');
+		envFile.seekg(0, std::ios_base::beg);
+		envFile.read(&content[0], content.size());
+		JsonReader reader(content.data(), content.data() + content.size());
+
+		// Materials, lights and cameras are processed in a fixed order
+		// independent of their order in the file. Remember where they start.
+		// Within each section the entries are loaded in alphabetical order.
+		const char* materials = nullptr;
+		const char* lights = nullptr;
+		const char* cameras = nullptr;
+		Property::Val accelerator = Property::DONT_CARE;
+		std::string key, str;
+		if(!reader.beginObject())
+			sendMessage(MessageType::ERROR, "The environment file must contain a JSON object!");
+		else while(reader.nextKey(key))
+		{
+			if(key == "scene") {
+				if(!reader.readString(binarySceneFile)) reader.skipValue();
+			} else if(key == "accelerator") {
+				if(reader.readString(str))
+				{
+					if(str == "aabox") accelerator = Property::AABOX_BVH;
+					else if(str == "obox") accelerator = Property::OBOX_BVH;
+					else if(str == "sphere") accelerator = Property::SPHERE_BVH;
+					else sendMessage(MessageType::WARNING, "Unknown accelerator in environment file. Only 'aabox', 'obox' and 'sphere' are valid.");
+				} else reader.skipValue();
+			} else {
+				if(key == "materials") materials = reader.position();
+				else if(key == "lights") lights = reader.position();
+				else if(key == "cameras") cameras = reader.position();
+				reader.skipValue();
+			}
+		}
+		// The entire syntax is validated by the first pass.
+		if(reader.hasError()) {
+			sendMessage(MessageType::ERROR, reader.getError());
+			return std::string();
+		}
 
-			auto it = jsonRoot.find("materials");
-			if(it != jsonRoot.end())
+		if(accelerator != Property::DONT_CARE)
+			m_accelerator = accelerator;
+		size_t firstScenario = m_scenarios.size();
+		size_t firstLight = m_lights.size();
+		size_t firstCamera = m_cameras.size();
+
+		// Make sure that there is always a default scenario at the
+		// first place.
+		addScenario("default");
+
+		if(binarySceneFile.empty())
+			sendMessage(MessageType::ERROR, "Cannot find 'scene' binary file name!");
+
+		// Prefer the packed materials from the binary file if available.
+		bool materialsFromJson = _ignoreBinary || binarySceneFile.empty() || !loadPackedMaterials(pathOf(_envFile) + binarySceneFile);
+		std::vector<std::string> materialNames;
+		if(!materialsFromJson && materials)
+			sendMessage(MessageType::WARNING, "The materials of the environment file are ignored, because ", binarySceneFile,
+				" contains packed materials. Store the binary header again after editing materials in the JSON file.");
+		if(materialsFromJson)
+		{
+			if(materials)
 			{
-				for(Json::iterator itm = it->begin(); itm != it->end(); ++itm)
-					loadMaterial(itm.value(), itm.key());
+				for(auto& member : sortedMembers(reader, materials))
+				{
+					reader.seek(member.second);
+					loadMaterial(reader, member.first);
+					materialNames.push_back(member.first);
+				}
 			} else sendMessage(MessageType::ERROR, "Cannot find 'materials' section in the scene file!");
+		}
 
-			if((it = jsonRoot.find("scene")) != jsonRoot.end())
-				binarySceneFile = it.value();
-			else sendMessage(MessageType::ERROR, "Cannot find 'scene' binary file name!");
-
-			if((it = jsonRoot.find("accelerator")) != jsonRoot.end())
+		if(lights)
+		{
+			for(auto& member : sortedMembers(reader, lights))
 			{
-				const std::string& str = *it;
-				if(strcmp(str.c_str(), "aabox") == 0) m_accelerator = Property::AABOX_BVH;
-				else if(strcmp(str.c_str(), "obox") == 0) m_accelerator = Property::OBOX_BVH;
-				else sendMessage(MessageType::WARNING, "Unknown accelerator in environment file. Only 'aabox' and 'obox' are valid.");
+				reader.seek(member.second);
+				loadLight(reader, member.first);
 			}
+		} // No lights is OK - scene may contain emissive surfaces.
 
-			if((it = jsonRoot.find("lights")) != jsonRoot.end())
+		if(cameras)
+		{
+			for(auto& member : sortedMembers(reader, cameras))
 			{
-				for(Json::iterator itl = it->begin(); itl != it->end(); ++itl)
-					loadLight(itl.value(), itl.key());
-			} // No lights is OK - scene may contain emissive surfaces.
+				reader.seek(member.second);
+				loadCamera(reader, member.first);
+			}
+		} else sendMessage(MessageType::ERROR, "Cannot find 'cameras' section in the scene file!");
 
-			if((it = jsonRoot.find("cameras")) != jsonRoot.end())
-				for(Json::iterator itc = it->begin(); itc != it->end(); ++itc)
-					loadCamera(itc.value(), itc.key());
-			else sendMessage(MessageType::ERROR, "Cannot find 'cameras' section in the scene file!");
-		} catch(const std::exception& _e) {
-			sendMessage(MessageType::ERROR, _e.what());
-		}
+		if(m_useEnvCache)
+			storeEnvCache(_envFile, content, binarySceneFile, accelerator, materialsFromJson ? &materialNames : nullptr,
+				firstScenario, firstLight, firstCamera);
 
 		return move(binarySceneFile);
 	}
 
-	void BinaryModel::loadMaterial(const Json& _node, const std::string& _name)
+	void BinaryModel::loadMaterial(JsonReader& _reader, const std::string& _name)
 	{
 		Material mat;
 		mat.m_name = _name;
+		if(!_reader.beginObject()) {
+			sendMessage(MessageType::WARNING, "Material ", _name, " is not an object and is ignored!");
+			_reader.skipValue();
+			return;
+		}
 		// A material contains a list of strings or float (arrays).
-		//for(Json::iterator it : _node)
-		for(Json::const_iterator it = _node.begin(); it != _node.end(); ++it)
+		std::string key, str;
+		while(_reader.nextKey(key))
 		{
-			if(it->is_string()) {
-				if(strcmp(it.key().c_str(), "type") == 0)
-					mat.setType(*it);
-				else
-					mat.m_textureNames.emplace(it.key(), it.value());
-			} else if(it->is_array())
+			switch(_reader.peek())
 			{
+			case JsonReader::Type::STRING:
+				_reader.readString(str);
+				if(key == "type")
+					mat.setType(move(str));
+				else
+					mat.m_textureNames.emplace(key, move(str));
+				break;
+			case JsonReader::Type::ARRAY: {
 				// Assume a float vector
 				Material::MultiValue value{ei::Vec4(0.0f), 0};
-				for(int i = 0; i < ei::min(4, int(it->size())); ++i)
+				_reader.beginArray();
+				while(_reader.nextElement())
 				{
-					value.values[i] = it.value()[i];
-					value.numComponents++;
+					if(value.numComponents < 4 && _reader.readNumber(value.values[value.numComponents]))
+						value.numComponents++;
+					else _reader.skipValue();
 				}
-				mat.m_values.emplace(it.key(), value);
-			} else
-				mat.m_values.emplace(it.key(), Material::MultiValue{ei::Vec4(*it, 0.0f, 0.0f, 0.0f), 1});
+				mat.m_values.emplace(key, value);
+				break; }
+			case JsonReader::Type::NUMBER: {
+				float value;
+				_reader.readNumber(value);
+				mat.m_values.emplace(key, Material::MultiValue{ei::Vec4(value, 0.0f, 0.0f, 0.0f), 1});
+				break; }
+			default:
+				sendMessage(MessageType::WARNING, "Property ", key, " of material ", _name, " has an invalid type and is ignored!");
+				_reader.skipValue();
+			}
 		}
-		m_materials.emplace(mat.getName(), mat);
+		m_materials.emplace(mat.getName(), std::move(mat));
 	}
 
-	static ei::Vec3 readVec3(const Json& _node)
+	static ei::Vec3 readVec3(JsonReader& _reader)
 	{
 		ei::Vec3 value(0.0f);
 		// Fallback to zero if something goes wrong
-		try { value.x = _node[0]; } catch(...) {}
-		try { value.y = _node[1]; } catch(...) {}
-		try { value.z = _node[2]; } catch(...) {}
+		if(!_reader.beginArray()) {
+			_reader.skipValue();
+			return value;
+		}
+		for(int i = 0; _reader.nextElement(); ++i)
+			if(i >= 3 || !_reader.readNumber(value[i]))
+				_reader.skipValue();
 		return value;
 	}
 
-	void BinaryModel::loadLight(const Json& _node, const std::string& _name)
+	static float readFloat(JsonReader& _reader, float _default)
+	{
+		float value = _default;
+		if(!_reader.readNumber(value))
+			_reader.skipValue();
+		return value;
+	}
+
+	static void readStrings(JsonReader& _reader, std::vector<std::string>& _strings)
+	{
+		if(!_reader.beginArray()) {
+			_reader.skipValue();
+			return;
+		}
+		std::string str;
+		while(_reader.nextElement())
+		{
+			if(_reader.readString(str)) _strings.push_back(str);
+			else _reader.skipValue();
+		}
+	}
+
+	void BinaryModel::loadLight(JsonReader& _reader, const std::string& _name)
 	{
 		// Default values for all possible light properties (some are not
 		// used dependent on the final type).
@@ -546,62 +814,76 @@ namespace bim {
 		std::string map;
 		std::vector<std::string> scenarios;
 
-		auto it = _node.find("type");
-		if(it != _node.end())
-		{
-			type = Light::TypeFromString(*it);
-		} else sendMessage(MessageType::ERROR, "No type given for light source ", _name);
-
-		if((it = _node.find("position")) != _node.end()) position = readVec3(*it);
-		if((it = _node.find("intensity")) != _node.end()) intensity = readVec3(*it);
-		if((it = _node.find("normal")) != _node.end()) normal = readVec3(*it);
-		if((it = _node.find("direction")) != _node.end()) normal = readVec3(*it);
-		if((it = _node.find("irradiance")) != _node.end()) intensity = readVec3(*it);
-		if((it = _node.find("peakIntensity")) != _node.end()) intensity = readVec3(*it);
-		if((it = _node.find("falloff")) != _node.end()) falloff = *it;
-		if((it = _node.find("halfAngle")) != _node.end()) halfAngle =  *it;
-		if((it = _node.find("sunDirection")) != _node.end()) normal = readVec3(*it);
-		if((it = _node.find("turbidity")) != _node.end()) turbidity = *it;
-		if((it = _node.find("aerialPerspective")) != _node.end()) aerialPerspective = *it;
-		if((it = _node.find("intensityMap")) != _node.end()) map = *it;
-		if((it = _node.find("intensityScale")) != _node.end()) intensity = readVec3(*it);
-		if((it = _node.find("radianceMap")) != _node.end()) map = *it;
-		if((it = _node.find("scenario")) != _node.end())
+		// Some attributes are alternatives for the same value. If more than one
+		// is given, the one with the higher priority (later in the list) wins.
+		int intensityPriority = -1, normalPriority = -1, mapPriority = -1;
+		auto readAlternative = [&_reader](const char* const* _names, int _num, const std::string& _key, int& _priority) {
+			for(int i = _num - 1; i > _priority; --i)
+				if(_key == _names[i]) { _priority = i; return true; }
+			return false;
+		};
+		static const char* INTENSITY_NAMES[] = {"intensity", "irradiance", "peakIntensity", "intensityScale"};
+		static const char* NORMAL_NAMES[] = {"normal", "direction", "sunDirection"};
+		static const char* MAP_NAMES[] = {"intensityMap", "radianceMap"};
+
+		bool hasType = false;
+		std::string key, str;
+		if(!_reader.beginObject()) _reader.skipValue();
+		else while(_reader.nextKey(key))
 		{
-			hasExplicitScenarios = true;
-			for(const auto& child : *it)
-				scenarios.push_back(child);
+			if(key == "type") {
+				if(_reader.readString(str)) { type = Light::TypeFromString(str); hasType = true; }
+				else _reader.skipValue();
+			}
+			else if(key == "position") position = readVec3(_reader);
+			else if(readAlternative(INTENSITY_NAMES, 4, key, intensityPriority)) intensity = readVec3(_reader);
+			else if(readAlternative(NORMAL_NAMES, 3, key, normalPriority)) normal = readVec3(_reader);
+			else if(key == "falloff") falloff = readFloat(_reader, falloff);
+			else if(key == "halfAngle") halfAngle = readFloat(_reader, halfAngle);
+			else if(key == "turbidity") turbidity = readFloat(_reader, turbidity);
+			else if(key == "aerialPerspective") { if(!_reader.readBool(aerialPerspective)) _reader.skipValue(); }
+			else if(readAlternative(MAP_NAMES, 2, key, mapPriority)) { if(!_reader.readString(map)) _reader.skipValue(); }
+			else if(key == "scenario")
+			{
+				hasExplicitScenarios = true;
+				readStrings(_reader, scenarios);
+			}
+			else _reader.skipValue();	// Unknown or overwritten by an attribute with higher priority
 		}
+		if(!hasType)
+			sendMessage(MessageType::ERROR, "No type given for light source ", _name);
 
 		normal = normalize(normal);
 
+		std::shared_ptr<Light> light;
 		switch(type)
 		{
 		case Light::Type::POINT:
-			m_lights.push_back(std::make_shared<PointLight>(position, intensity, _name));
+			light = std::make_shared<PointLight>(position, intensity, _name);
 			break;
 		case Light::Type::LAMBERT:
-			m_lights.push_back(std::make_shared<LambertLight>(position, normal, intensity, _name));
+			light = std::make_shared<LambertLight>(position, normal, intensity, _name);
 			break;
 		case Light::Type::DIRECTIONAL:
-			m_lights.push_back(std::make_shared<DirectionalLight>(normal, intensity, _name));
+			light = std::make_shared<DirectionalLight>(normal, intensity, _name);
 			break;
 		case Light::Type::SPOT:
-			m_lights.push_back(std::make_shared<SpotLight>(position, normal, intensity, falloff, halfAngle, _name));
+			light = std::make_shared<SpotLight>(position, normal, intensity, falloff, halfAngle, _name);
 			break;
 		case Light::Type::SKY:
-			m_lights.push_back(std::make_shared<SkyLight>(normal, turbidity, aerialPerspective, _name));
+			light = std::make_shared<SkyLight>(normal, turbidity, aerialPerspective, _name);
 			break;
 		case Light::Type::GONIOMETRIC:
-			m_lights.push_back(std::make_shared<GoniometricLight>(position, intensity, map, _name));
+			light = std::make_shared<GoniometricLight>(position, intensity, map, _name);
 			break;
 		case Light::Type::ENVIRONMENT:
-			m_lights.push_back(std::make_shared<EnvironmentLight>(map, _name));
+			light = std::make_shared<EnvironmentLight>(map, _name);
 			break;
 		default:
 			sendMessage(MessageType::ERROR, "Light ", _name, " does not have a type!");
 			return;
 		}
+		addLight(light);
 
 		// Always add to the default scenario if nothing was specified
 		if(!hasExplicitScenarios)
@@ -612,11 +894,11 @@ namespace bim {
 			Scenario* scenario = getScenario(sname);
 			if(!scenario)
 				scenario = addScenario(sname);
-			scenario->addLight(m_lights.back());
+			scenario->addLight(light);
 		}
 	}
 
-	void BinaryModel::loadCamera(const Json& _node, const std::string& _name)
+	void BinaryModel::loadCamera(JsonReader& _reader, const std::string& _name)
 	{
 		// Default values
 		Camera::Type type = Camera::Type::NUM_TYPES;
@@ -638,34 +920,49 @@ namespace bim {
 		bool hasExplicitScenarios = false;
 		std::vector<std::string> scenarios;
 
-		auto it = _node.find("type");
-		if(it != _node.end())
-		{
-			type = Camera::TypeFromString(*it);
-		} else sendMessage(MessageType::ERROR, "No type given for camera ", _name);
-
-		if((it = _node.find("position")) != _node.end()) position = readVec3(*it);
-		if((it = _node.find("lookAt")) != _node.end()) lookAt = readVec3(*it);
-		if((it = _node.find("viewDir")) != _node.end()) lookAt = position + readVec3(*it);
-		if((it = _node.find("up")) != _node.end()) up = readVec3(*it);
-		if((it = _node.find("fov")) != _node.end()) fieldOfView = *it;
-		if((it = _node.find("left")) != _node.end()) left = *it;
-		if((it = _node.find("right")) != _node.end()) right = *it;
-		if((it = _node.find("bottom")) != _node.end()) bottom = *it;
-		if((it = _node.find("top")) != _node.end()) top = *it;
-		if((it = _node.find("near")) != _node.end()) near = *it;
-		if((it = _node.find("far")) != _node.end()) far = *it;
-		if((it = _node.find("focalLength")) != _node.end()) focalLength = *it;
-		if((it = _node.find("focusDistance")) != _node.end()) focusDistance = *it;
-		if((it = _node.find("sensorSize")) != _node.end()) sensorSize = *it;
-		if((it = _node.find("aperture")) != _node.end()) aperture = *it;
-		if((it = _node.find("velocity")) != _node.end()) velocity = *it;
-		if((it = _node.find("scenario")) != _node.end())
+		// Non-object entries are global camera settings (e.g. controlVelocity).
+		if(!_reader.beginObject()) {
+			_reader.skipValue();
+			return;
+		}
+		// The view direction is relative to the position which may come later.
+		bool hasViewDir = false;
+		ei::Vec3 viewDir;
+		bool hasType = false;
+		std::string key, str;
+		while(_reader.nextKey(key))
 		{
-			hasExplicitScenarios = true;
-			for(const auto& child : *it)
-				scenarios.push_back(child);
+			if(key == "type") {
+				if(_reader.readString(str)) { type = Camera::TypeFromString(str); hasType = true; }
+				else _reader.skipValue();
+			}
+			else if(key == "position") position = readVec3(_reader);
+			else if(key == "lookAt") { if(!hasViewDir) lookAt = readVec3(_reader); else _reader.skipValue(); }
+			else if(key == "viewDir") { viewDir = readVec3(_reader); hasViewDir = true; }
+			else if(key == "up") up = readVec3(_reader);
+			else if(key == "fov") fieldOfView = readFloat(_reader, fieldOfView);
+			else if(key == "left") left = readFloat(_reader, left);
+			else if(key == "right") right = readFloat(_reader, right);
+			else if(key == "bottom") bottom = readFloat(_reader, bottom);
+			else if(key == "top") top = readFloat(_reader, top);
+			else if(key == "near") near = readFloat(_reader, near);
+			else if(key == "far") far = readFloat(_reader, far);
+			else if(key == "focalLength") focalLength = readFloat(_reader, focalLength);
+			else if(key == "focusDistance") focusDistance = readFloat(_reader, focusDistance);
+			else if(key == "sensorSize") sensorSize = readFloat(_reader, sensorSize);
+			else if(key == "aperture") aperture = readFloat(_reader, aperture);
+			else if(key == "velocity") velocity = readFloat(_reader, velocity);
+			else if(key == "scenario")
+			{
+				hasExplicitScenarios = true;
+				readStrings(_reader, scenarios);
+			}
+			else _reader.skipValue();
 		}
+		if(!hasType)
+			sendMessage(MessageType::ERROR, "No type given for camera ", _name);
+		if(hasViewDir)
+			lookAt = position + viewDir;
 
 		fieldOfView *= ei::PI / 180.0f;
 
@@ -745,6 +1042,8 @@ namespace bim {
 				json["accelerator"] = "aabox";
 			else if(m_accelerator == Property::OBOX_BVH)
 				json["accelerator"] = "obox";
+			else if(m_accelerator == Property::SPHERE_BVH)
+				json["accelerator"] = "sphere";
 		}
 
 		Json& materialsNode = json["materials"];
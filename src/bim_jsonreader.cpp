@@ -0,0 +1,288 @@
+#include "bim_jsonreader.hpp"
+#include <cstdlib>
+#include <algorithm>
+
+namespace bim {
+
+	JsonReader::JsonReader(const char* _begin, const char* _end) :
+		m_begin(_begin),
+		m_pos(_begin),
+		m_end(_end),
+		m_first(true)
+	{
+	}
+
+	JsonReader::Type JsonReader::peek()
+	{
+		skipWhitespace();
+		if(hasError()) return Type::INVALID;
+		switch(*m_pos)
+		{
+		case '{': return Type::OBJECT;
+		case '[': return Type::ARRAY;
+		case '"': return Type::STRING;
+		case 't':
+		case 'f': return Type::BOOLEAN;
+		case 'n': return Type::NUL;
+		case '-': return Type::NUMBER;
+		default:
+			if(*m_pos >= '0' && *m_pos <= '9') return Type::NUMBER;
+			return Type::INVALID;
+		}
+	}
+
+	bool JsonReader::beginObject()
+	{
+		if(peek() != Type::OBJECT) return false;
+		++m_pos;
+		m_first = true;
+		return true;
+	}
+
+	bool JsonReader::nextKey(std::string& _key)
+	{
+		if(!next('}')) return false;
+		skipWhitespace();
+		if(*m_pos != '"') { setError("Expected a key"); return false; }
+		return parseString(&_key) && expect(':');
+	}
+
+	bool JsonReader::beginArray()
+	{
+		if(peek() != Type::ARRAY) return false;
+		++m_pos;
+		m_first = true;
+		return true;
+	}
+
+	bool JsonReader::nextElement()
+	{
+		return next(']');
+	}
+
+	bool JsonReader::readString(std::string& _value)
+	{
+		if(peek() != Type::STRING) return false;
+		return parseString(&_value);
+	}
+
+	bool JsonReader::readNumber(float& _value)
+	{
+		if(peek() != Type::NUMBER) return false;
+		// Find the end of the number with the JSON grammar, strtof would also
+		// accept other formats.
+		const char* end = m_pos;
+		if(*end == '-') ++end;
+		if(*end < '0' || *end > '9') { setError("Invalid number"); return false; }
+		while(*end >= '0' && *end <= '9') ++end;
+		if(*end == '.') { ++end; while(*end >= '0' && *end <= '9') ++end; }
+		if(*end == 'e' || *end == 'E')
+		{
+			++end;
+			if(*end == '+' || *end == '-') ++end;
+			if(*end < '0' || *end > '9') { setError("Invalid number"); return false; }
+			while(*end >= '0' && *end <= '9') ++end;
+		}
+		_value = strtof(m_pos, nullptr);
+		m_pos = end;
+		return true;
+	}
+
+	bool JsonReader::readBool(bool& _value)
+	{
+		if(peek() != Type::BOOLEAN) return false;
+		if(m_end - m_pos >= 4 && std::equal(m_pos, m_pos + 4, "true")) { _value = true; m_pos += 4; return true; }
+		if(m_end - m_pos >= 5 && std::equal(m_pos, m_pos + 5, "false")) { _value = false; m_pos += 5; return true; }
+		setError("Invalid literal");
+		return false;
+	}
+
+	void JsonReader::skipValue()
+	{
+		switch(peek())
+		{
+		case Type::OBJECT:
+			beginObject();
+			while(next('}'))
+			{
+				skipWhitespace();
+				if(*m_pos != '"') { setError("Expected a key"); return; }
+				if(!parseString(nullptr) || !expect(':')) return;
+				skipValue();
+			}
+			break;
+		case Type::ARRAY:
+			beginArray();
+			while(next(']'))
+				skipValue();
+			break;
+		case Type::STRING:
+			parseString(nullptr);
+			break;
+		case Type::NUMBER: {
+			float dummy;
+			readNumber(dummy);
+			break; }
+		case Type::BOOLEAN: {
+			bool dummy;
+			readBool(dummy);
+			break; }
+		case Type::NUL:
+			if(m_end - m_pos >= 4 && std::equal(m_pos, m_pos + 4, "null")) m_pos += 4;
+			else setError("Invalid literal");
+			break;
+		default:
+			if(!hasError()) setError(m_pos == m_end ? "Unexpected end of file" : "Unexpected character");
+		}
+	}
+
+	void JsonReader::skipWhitespace()
+	{
+		while(m_pos < m_end)
+		{
+			if(*m_pos == ' ' || *m_pos == '\t' || *m_pos == '\n' || *m_pos == '\r')
+				++m_pos;
+			else if(m_pos[0] == '/' && m_pos[1] == '/')
+			{
+				while(m_pos < m_end && *m_pos != '\n') ++m_pos;
+			} else if(m_pos[0] == '/' && m_pos[1] == '*')
+			{
+				m_pos += 2;
+				while(m_pos < m_end && !(m_pos[0] == '*' && m_pos[1] == '/')) ++m_pos;
+				m_pos = std::min(m_pos + 2, m_end);
+			} else break;
+		}
+	}
+
+	bool JsonReader::expect(char _c)
+	{
+		skipWhitespace();
+		if(hasError()) return false;
+		if(*m_pos != _c)
+		{
+			char msg[] = "Expected 'x'";
+			msg[10] = _c;
+			setError(msg);
+			return false;
+		}
+		++m_pos;
+		return true;
+	}
+
+	bool JsonReader::next(char _close)
+	{
+		skipWhitespace();
+		if(hasError()) return false;
+		if(*m_pos == _close)
+		{
+			++m_pos;
+			m_first = false;
+			return false;
+		}
+		if(!m_first)
+		{
+			if(!expect(',')) return false;
+			// Trailing comma
+			skipWhitespace();
+			if(*m_pos == _close)
+			{
+				++m_pos;
+				m_first = false;
+				return false;
+			}
+		}
+		m_first = false;
+		return true;
+	}
+
+	// Append a code point as UTF-8
+	static void appendUTF8(std::string& _str, unsigned _c)
+	{
+		if(_c < 0x80) _str += char(_c);
+		else if(_c < 0x800) {
+			_str += char(0xc0 | (_c >> 6));
+			_str += char(0x80 | (_c & 0x3f));
+		} else if(_c < 0x10000) {
+			_str += char(0xe0 | (_c >> 12));
+			_str += char(0x80 | ((_c >> 6) & 0x3f));
+			_str += char(0x80 | (_c & 0x3f));
+		} else {
+			_str += char(0xf0 | (_c >> 18));
+			_str += char(0x80 | ((_c >> 12) & 0x3f));
+			_str += char(0x80 | ((_c >> 6) & 0x3f));
+			_str += char(0x80 | (_c & 0x3f));
+		}
+	}
+
+	static bool parseHex4(const char* _str, unsigned& _value)
+	{
+		_value = 0;
+		for(int i = 0; i < 4; ++i)
+		{
+			char c = _str[i];
+			_value <<= 4;
+			if(c >= '0' && c <= '9') _value |= c - '0';
+			else if(c >= 'a' && c <= 'f') _value |= c - 'a' + 10;
+			else if(c >= 'A' && c <= 'F') _value |= c - 'A' + 10;
+			else return false;
+		}
+		return true;
+	}
+
+	bool JsonReader::parseString(std::string* _value)
+	{
+		++m_pos; // "
+		if(_value) _value->clear();
+		while(m_pos < m_end && *m_pos != '"')
+		{
+			// Copy everything up to the next special character at once.
+			const char* begin = m_pos;
+			while(m_pos < m_end && *m_pos != '"' && *m_pos != '\\') ++m_pos;
+			if(_value) _value->append(begin, m_pos);
+			if(m_pos < m_end && *m_pos == '\\')
+			{
+				++m_pos;
+				char c = *m_pos++;
+				switch(c)
+				{
+				case '"': case '\\': case '/': if(_value) *_value += c; break;
+				case 'b': if(_value) *_value += '\b'; break;
+				case 'f': if(_value) *_value += '\f'; break;
+				case 'n': if(_value) *_value += '\n'; break;
+				case 'r': if(_value) *_value += '\r'; break;
+				case 't': if(_value) *_value += '\t'; break;
+				case 'u': {
+					unsigned code;
+					if(m_end - m_pos < 4 || !parseHex4(m_pos, code)) { setError("Invalid unicode escape sequence"); return false; }
+					m_pos += 4;
+					// Surrogate pair
+					unsigned low;
+					if(code >= 0xd800 && code < 0xdc00 && m_end - m_pos >= 6 && m_pos[0] == '\\' && m_pos[1] == 'u'
+						&& parseHex4(m_pos + 2, low) && low >= 0xdc00 && low < 0xe000)
+					{
+						code = 0x10000 + ((code - 0xd800) << 10) + (low - 0xdc00);
+						m_pos += 6;
+					}
+					if(_value) appendUTF8(*_value, code);
+					break; }
+				default:
+					setError("Invalid escape sequence");
+					return false;
+				}
+			}
+		}
+		if(m_pos >= m_end) { setError("Unterminated string"); return false; }
+		++m_pos; // "
+		return true;
+	}
+
+	void JsonReader::setError(const char* _message)
+	{
+		if(hasError()) return;
+		int line = 1 + int(std::count(m_begin, m_pos, '\n'));
+		m_error = std::string("JSON parse error in line ") + std::to_string(line) + ": " + _message;
+		// Stop reading
+		m_pos = m_end;
+	}
+
+} // namespace bim
@@ -0,0 +1,84 @@
+#pragma once
+
+#include <string>
+
+namespace bim {
+
+	/// Streaming reader for JSON documents in memory.
+	/// \details The reader does not build a document tree. The caller walks
+	///		through the document and requests the values in file order:
+	///
+	///		if(reader.beginObject())
+	///			while(reader.nextKey(key))
+	///				if(key == "x") reader.readNumber(x);
+	///				else reader.skipValue();
+	///
+	///		Each value must be consumed (read or skipped) before the next key or
+	///		element is requested. Comments (// and /* */) and trailing commas are
+	///		tolerated. On a syntax error all further calls fail and getError()
+	///		describes the problem.
+	class JsonReader
+	{
+	public:
+		enum class Type
+		{
+			OBJECT,
+			ARRAY,
+			STRING,
+			NUMBER,
+			BOOLEAN,
+			NUL,
+			INVALID		///< End of the document or syntax error
+		};
+
+		/// \param [in] _begin First character. The memory must stay valid and
+		///		must be terminated by a 0 at _end.
+		JsonReader(const char* _begin, const char* _end);
+
+		/// Type of the next value.
+		Type peek();
+
+		/// Enter an object. Returns false (without consuming anything) if the
+		/// next value is not an object.
+		bool beginObject();
+		/// Read the next key and the colon behind it. Returns false at the end
+		/// of the current object (the closing bracket is consumed).
+		bool nextKey(std::string& _key);
+		/// Enter an array. Returns false (without consuming anything) if the
+		/// next value is not an array.
+		bool beginArray();
+		/// Move to the next element. Returns false at the end of the current
+		/// array (the closing bracket is consumed).
+		bool nextElement();
+
+		/// Read a value. If the next value has a different type nothing is
+		/// consumed and false is returned.
+		bool readString(std::string& _value);
+		bool readNumber(float& _value);
+		bool readBool(bool& _value);
+		/// Skip the next value including all its children.
+		void skipValue();
+
+		/// Position of the next value. A later seek() to this position allows
+		/// to read the value again.
+		const char* position() { skipWhitespace(); return m_pos; }
+		void seek(const char* _position) { m_pos = _position; m_first = true; }
+
+		bool hasError() const { return !m_error.empty(); }
+		const std::string& getError() const { return m_error; }
+	private:
+		const char* m_begin;
+		const char* m_pos;
+		const char* m_end;
+		bool m_first;			///< No element read yet in the current object/array
+		std::string m_error;
+
+		void skipWhitespace();
+		bool expect(char _c);
+		// Go to the next key/element. Returns false if the container ends with _close.
+		bool next(char _close);
+		bool parseString(std::string* _value);
+		void setError(const char* _message);
+	};
+
+} // namespace bim
@@ -1,4 +1,5 @@
 #include "bim/chunk.hpp"
+#include "bim_scratch.hpp"
 #include <memory>
 #include <algorithm>
 
@@ -6,77 +7,153 @@ using namespace ei;
 
 namespace bim {
 
+	// Ranges with more elements are processed one after another, each with a
+	// parallel partition. All smaller ranges of a level are processed in parallel.
+	const uint32 PARALLEL_PARTITION_SIZE = 1 << 16;
+	const uint32 PARTITION_BLOCK_SIZE = 1 << 14;
+
 	struct KDTreeBuildInfo
 	{
 		std::vector<Node>& hierarchy;
-		std::vector<uint32>& parents;
 		std::vector<UVec4>& leaves;
 		const std::vector<UVec3>& triangles;
 		const std::vector<uint32>& materials;
 		const uint numTrianglesPerLeaf;
-		const std::unique_ptr<uint32[]>* sorted;
-		Vec3* centers;
+		uint32* const* sorted;
+		const Vec3* centers;
+		uint8* isLeft;	// Per triangle flag for the side of the current split
+		uint32* tmp;	// Temporary copy for the partition, n elements
+	};
+
+	// A range of the sorted arrays which becomes the node _node.
+	struct KDTask
+	{
+		uint32 min, max;	// Inclusive boundaries
+		uint32 node;		// 0 marks an unused task (the root is never a child)
 	};
 
-	static void split( uint32* _list, const Vec3* _centers, uint32 _size, int _splitDim, float _splitPlane )
+	// Number of nodes of a median split tree over _num triangles.
+	// The range sizes on one level differ by at most one. Therefore, it is
+	// sufficient to count ranges with size s and s+1 per level.
+	static uint32 numKDNodes(uint32 _num, uint _maxNumTrianglesPerLeaf)
+	{
+		uint32 numNodes = 0;
+		uint32 size = _num;
+		uint32 count[2] = {1, 0};
+		while(count[0] + count[1] > 0)
+		{
+			uint32 nextSize = size / 2;
+			uint32 nextCount[2] = {0, 0};
+			for(uint32 i = 0; i < 2; ++i)
+			{
+				numNodes += count[i];
+				if(count[i] && size + i > _maxNumTrianglesPerLeaf)
+				{
+					nextCount[(size + i) / 2 - nextSize] += count[i];
+					nextCount[(size + i + 1) / 2 - nextSize] += count[i];
+				}
+			}
+			size = nextSize;
+			count[0] = nextCount[0];
+			count[1] = nextCount[1];
+		}
+		return numNodes;
+	}
+
+	// Stable partition of _list by the flags of the referenced triangles. The
+	// number of elements on the left side (_numLeft) must be known.
+	static void split( uint32* _list, uint32* _tmp, const uint8* _isLeft, uint32 _size, uint32 _numLeft, bool _parallel )
 	{
-		// Make a temporary copy
-		std::vector<uint32> tmp( _size );
-
-		// The first half should have a size of (_size + 1) / 2 which is half of
-		// the elements and in case of a odd number the additional element goes to
-		// the left.
-		uint32 rightOff = (_size + 1) / 2;
-		uint32 l = 0, r = rightOff;
-		for( uint32 i = 0; i < _size; ++i )
+		if(!_parallel)
+		{
+			uint32 l = 0, r = _numLeft;
+			for( uint32 i = 0; i < _size; ++i )
+			{
+				if( _isLeft[_list[i]] )
+					_tmp[l++] = _list[i];
+				else _tmp[r++] = _list[i];
+			}
+			eiAssert( l == _numLeft, "Offset of right half was wrong!" );
+			eiAssert( r == _size, "Inconsistent split - not all elements were copied!" );
+			memcpy( _list, _tmp, _size * sizeof(uint32) );
+			return;
+		}
+
+		// Count the left elements per block, then each block writes its
+		// elements to the offsets given by the prefix sum.
+		int numBlocks = int((_size + PARTITION_BLOCK_SIZE - 1) / PARTITION_BLOCK_SIZE);
+		std::vector<uint32> blockLeft(numBlocks + 1, 0);
+#pragma omp parallel for
+		for(int b = 0; b < numBlocks; ++b)
 		{
-			if( _centers[_list[i]][_splitDim] <= _splitPlane )
-				tmp[l++] = _list[i];
-			else tmp[r++] = _list[i];
+			uint32 end = min(_size, (b + 1) * PARTITION_BLOCK_SIZE);
+			uint32 num = 0;
+			for(uint32 i = b * PARTITION_BLOCK_SIZE; i < end; ++i)
+				num += _isLeft[_list[i]];
+			blockLeft[b + 1] = num;
+		}
+		for(int b = 0; b < numBlocks; ++b)
+			blockLeft[b + 1] += blockLeft[b];
+		eiAssert( blockLeft[numBlocks] == _numLeft, "Offset of right half was wrong!" );
+#pragma omp parallel for
+		for(int b = 0; b < numBlocks; ++b)
+		{
+			uint32 begin = b * PARTITION_BLOCK_SIZE;
+			uint32 end = min(_size, begin + PARTITION_BLOCK_SIZE);
+			uint32 l = blockLeft[b];
+			uint32 r = _numLeft + begin - blockLeft[b];
+			for(uint32 i = begin; i < end; ++i)
+			{
+				if( _isLeft[_list[i]] )
+					_tmp[l++] = _list[i];
+				else _tmp[r++] = _list[i];
+			}
+		}
+#pragma omp parallel for
+		for(int b = 0; b < numBlocks; ++b)
+		{
+			uint32 begin = b * PARTITION_BLOCK_SIZE;
+			uint32 end = min(_size, begin + PARTITION_BLOCK_SIZE);
+			memcpy( _list + begin, _tmp + begin, (end - begin) * sizeof(uint32) );
 		}
-		eiAssert( l == rightOff, "Offset of right half was wrong!" );
-		eiAssert( l+r-rightOff == _size, "Inconsistent split - not all elements were copied!" );
-		// Copy back
-		memcpy( _list, &tmp[0], _size * sizeof(uint32) );
 	}
 
-	static uint32 build( KDTreeBuildInfo& _in, uint32 _min, uint32 _max )
+	// Create the node for one range. If it is split the two child ranges are
+	// written to _children, otherwise they are marked as unused.
+	static void build( KDTreeBuildInfo& _in, const KDTask& _task, KDTask* _children, bool _parallel )
 	{
-		uint32 nodeIdx = (uint32)_in.hierarchy.size();
-		_in.hierarchy.resize(nodeIdx + 1);
-		_in.parents.resize(nodeIdx + 1);
-		_in.hierarchy[nodeIdx].firstChild = _in.hierarchy[nodeIdx].escape = _in.parents[nodeIdx] = 0;
+		uint32 nodeIdx = _task.node;
+		_in.hierarchy[nodeIdx].firstChild = _in.hierarchy[nodeIdx].escape = 0;
+		_children[0].node = _children[1].node = 0;
 
 		// Create a leaf if less than NUM_PRIMITIVES elements remain.
-		uint32 num = _max - _min + 1;
+		uint32 num = _task.max - _task.min + 1;
 		eiAssert(num > 0, "Node without triangles!");
 		if( num <= _in.numTrianglesPerLeaf )
 		{
-			// Allocate a new leaf
-			size_t leafIdx = _in.leaves.size();
-			_in.leaves.resize(_in.leaves.size() + num);
+			// The leaf entries have the same order as the sorted arrays. Therefore,
+			// the range itself is the place of the leaf.
 			// Fill it, use a flag in the materials index to signal that there
 			// are more triangles following. If the flag is not set the current
 			// triangle is the last one.
-			UVec4* trianglesPtr = &_in.leaves[leafIdx];
-			for( uint i = _min; i < _max; ++i )
+			UVec4* trianglesPtr = &_in.leaves[_task.min];
+			for( uint i = _task.min; i < _task.max; ++i )
 				*(trianglesPtr++) = UVec4( _in.triangles[_in.sorted[0][i]], (_in.materials.empty() ? 0 : _in.materials[_in.sorted[0][i]]) | 0x80000000);
-			*(trianglesPtr++) = UVec4( _in.triangles[_in.sorted[0][_max]], _in.materials.empty() ? 0 : _in.materials[_in.sorted[0][_max]]);
+			*(trianglesPtr++) = UVec4( _in.triangles[_in.sorted[0][_task.max]], _in.materials.empty() ? 0 : _in.materials[_in.sorted[0][_task.max]]);
 
 			// Let the new node pointing to this leaf
-			_in.hierarchy[nodeIdx].firstChild = 0x80000000 | (uint32)(leafIdx);
-
-			return nodeIdx;
+			_in.hierarchy[nodeIdx].firstChild = 0x80000000 | _task.min;
+			return;
 		}
 
 		// Find dimension with largest extension
 		Box bb;
-		bb.min = Vec3( _in.centers[_in.sorted[0][_min]].x,
-					   _in.centers[_in.sorted[1][_min]].y,
-					   _in.centers[_in.sorted[2][_min]].z );
-		bb.max = Vec3( _in.centers[_in.sorted[0][_max]].x,
-					   _in.centers[_in.sorted[1][_max]].y,
-					   _in.centers[_in.sorted[2][_max]].z );
+		bb.min = Vec3( _in.centers[_in.sorted[0][_task.min]].x,
+					   _in.centers[_in.sorted[1][_task.min]].y,
+					   _in.centers[_in.sorted[2][_task.min]].z );
+		bb.max = Vec3( _in.centers[_in.sorted[0][_task.max]].x,
+					   _in.centers[_in.sorted[1][_task.max]].y,
+					   _in.centers[_in.sorted[2][_task.max]].z );
 		Vec3 w = bb.max - bb.min;
 		int dim = 0;
 		if( w[1] > w[0] && w[1] > w[2] ) dim = 1;
@@ -84,48 +161,49 @@ namespace bim {
 		int codim1 = (dim + 1) % 3;
 		int codim2 = (dim + 2) % 3;
 
-		// Split at median
-		uint32 m = ( _min + _max ) / 2;
-		// If there are many elements with the same coordinate change their
-		// positions temporary to something greater until split is done. Then
-		// reset them back to the median value.
-		uint32 numChanged = 0;
-		float splitPlane = _in.centers[_in.sorted[dim][m]][dim];
-		while( m+numChanged < _max && _in.centers[_in.sorted[dim][m+1+numChanged]][dim] == splitPlane )
+		// Split at median. The side is defined by the position in the sorted
+		// array, so elements with the same coordinate are divided correctly.
+		uint32 m = ( _task.min + _task.max ) / 2;
+		const uint32* sortedDim = _in.sorted[dim];
+		if(_parallel)
 		{
-			// The added amount is irrelevant because it is reset after split anyway.
-			_in.centers[_in.sorted[dim][m+1+numChanged]][dim] += 1.0f;
-			++numChanged;
+#pragma omp parallel for
+			for( int i = int(_task.min); i <= int(_task.max); ++i )
+				_in.isLeft[sortedDim[i]] = uint32(i) <= m ? 1 : 0;
+		} else {
+			for( uint32 i = _task.min; i <= _task.max; ++i )
+				_in.isLeft[sortedDim[i]] = i <= m ? 1 : 0;
 		}
 		// The split requires to reorder the two other dimension arrays
-		split( &_in.sorted[codim1][_min], _in.centers, _max - _min + 1, dim, splitPlane );
-		split( &_in.sorted[codim2][_min], _in.centers, _max - _min + 1, dim, splitPlane );
-		// Reset dimension values
-		for( uint32 i = m+1; i < m+1+numChanged; ++i )
-			_in.centers[_in.sorted[dim][i]][dim] = splitPlane;
+		uint32 numLeft = m - _task.min + 1;
+		split( &_in.sorted[codim1][_task.min], &_in.tmp[_task.min], _in.isLeft, num, numLeft, _parallel );
+		split( &_in.sorted[codim2][_task.min], &_in.tmp[_task.min], _in.isLeft, num, numLeft, _parallel );
 
+		// Nodes are in preorder: the left subtree directly follows the node.
 		// Set left and right into firstChild and escape. This is corrected later in
 		// remapNodePointers().
-		_in.hierarchy[nodeIdx].firstChild = build( _in, _min, m );
-		_in.hierarchy[nodeIdx].escape = build( _in, m+1, _max );
-
-		eiAssert(nodeIdx < _in.triangles.size(), "There are too many nodes!");
-		return nodeIdx;
+		_children[0] = {_task.min, m, nodeIdx + 1};
+		_children[1] = {m + 1, _task.max, nodeIdx + 1 + numKDNodes(numLeft, _in.numTrianglesPerLeaf)};
+		_in.hierarchy[nodeIdx].firstChild = _children[0].node;
+		_in.hierarchy[nodeIdx].escape = _children[1].node;
 	}
 
 	void Chunk::buildBVH_kdtree(uint _maxNumTrianglesPerLeaf)
 	{
 		uint32 n = getNumTriangles();
-		std::unique_ptr<Vec3[]> centers(new Vec3[n]);
+		// All temporary arrays come from a single allocation
+		ScratchArena arena(n * (sizeof(Vec3) + 4 * sizeof(uint32) + sizeof(uint8)) + 6 * 16);
+		Vec3* centers = arena.alloc<Vec3>(n);
 		// Create 3 sorted arrays for the dimensions
-		std::unique_ptr<uint32[]> sorted[3] = {
-			std::unique_ptr<uint32[]>(new uint32[n]),
-			std::unique_ptr<uint32[]>(new uint32[n]),
-			std::unique_ptr<uint32[]>(new uint32[n])
+		uint32* sorted[3] = {
+			arena.alloc<uint32>(n),
+			arena.alloc<uint32>(n),
+			arena.alloc<uint32>(n)
 		};
 
 		// Initialize unsorted and centers
-		for( uint32 i = 0; i < n; ++i )
+#pragma omp parallel for
+		for( int i = 0; i < int(n); ++i )
 		{
 			sorted[0][i] = i;
 			sorted[1][i] = i;
@@ -134,23 +212,46 @@ namespace bim {
 			centers[i] = (m_positions[t.x] + m_positions[t.y] + m_positions[t.z]) / 3.0f;
 		}
 
-		// Sort according to center
-		std::sort( &sorted[0][0], &sorted[0][n],
-			[&centers](const uint32 _lhs, const uint32 _rhs) { return centers[_lhs].x < centers[_rhs].x; }
-		);
-		std::sort( &sorted[1][0], &sorted[1][n],
-			[&centers](const uint32 _lhs, const uint32 _rhs) { return centers[_lhs].y < centers[_rhs].y; }
-		);
-		std::sort( &sorted[2][0], &sorted[2][n],
-			[&centers](const uint32 _lhs, const uint32 _rhs) { return centers[_lhs].z < centers[_rhs].z; }
-		);
-
-		m_hierarchy.reserve(n*2);
-		m_hierarchyParents.reserve(n*2);
-		KDTreeBuildInfo input = {m_hierarchy, m_hierarchyParents, m_hierarchyLeaves,
+		// Sort according to center, the three dimensions are independent.
+		// Ties are broken by the index to get the same tree in each run.
+#pragma omp parallel for
+		for( int d = 0; d < 3; ++d )
+		{
+			std::sort( sorted[d], sorted[d] + n,
+				[centers, d](const uint32 _lhs, const uint32 _rhs) {
+					return centers[_lhs][d] < centers[_rhs][d] || (centers[_lhs][d] == centers[_rhs][d] && _lhs < _rhs);
+				}
+			);
+		}
+
+		// The number of nodes is known in advance and the kd-tree references
+		// each triangle exactly once.
+		m_hierarchy.resize(numKDNodes(n, _maxNumTrianglesPerLeaf));
+		m_hierarchyParents.resize(m_hierarchy.size(), 0);
+		m_hierarchyLeaves.resize(n);
+		KDTreeBuildInfo input = {m_hierarchy, m_hierarchyLeaves,
 			m_triangles, m_triangleMaterials, _maxNumTrianglesPerLeaf,
-			sorted, centers.get()};
-		build(input, 0, n-1);
+			sorted, centers, arena.alloc<uint8>(n), arena.alloc<uint32>(n)};
+
+		// Build level by level. The ranges of one level are disjoint, so they
+		// can be split independently.
+		std::vector<KDTask> level(1, KDTask{0, n-1, 0});
+		std::vector<KDTask> nextLevel;
+		while(!level.empty())
+		{
+			nextLevel.resize(level.size() * 2);
+			for(size_t i = 0; i < level.size(); ++i)
+				if(level[i].max - level[i].min >= PARALLEL_PARTITION_SIZE)
+					build(input, level[i], &nextLevel[i * 2], true);
+#pragma omp parallel for schedule(dynamic, 16)
+			for(int i = 0; i < int(level.size()); ++i)
+				if(level[i].max - level[i].min < PARALLEL_PARTITION_SIZE)
+					build(input, level[i], &nextLevel[i * 2], false);
+			// Remove the children of leaves
+			level.clear();
+			for(auto& task : nextLevel)
+				if(task.node != 0) level.push_back(task);
+		}
 	}
 
-} // namespace bim
\ No newline at end of file
+} // namespace bim
@@ -0,0 +1,504 @@
+#include "bim/bim.hpp"
+#include "bim/log.hpp"
+#include <algorithm>
+#include <cstring>
+#include <unordered_map>
+
+using namespace ei;
+
+namespace bim {
+
+	const uint32 LIGHT_TREE_LEAF = 0x80000000;
+	const uint32 LIGHT_TREES_VERSION = 2;
+
+	// The parameters of one light which are relevant for the structures.
+	// The leaves of the BVH store a copy of them.
+	struct LightInfo
+	{
+		uint32 index;
+		Vec3 position;
+		Vec3 axis;
+		float normalAngle;
+		float emissionAngle;
+		float power;
+	};
+
+	static bool getLightInfo(const Light& _light, LightInfo& _info)
+	{
+		switch(_light.type)
+		{
+		case Light::Type::POINT: {
+			const PointLight& light = static_cast<const PointLight&>(_light);
+			_info.position = light.position;
+			_info.axis = Vec3(0.0f, 0.0f, 1.0f);
+			_info.normalAngle = PI;
+			_info.emissionAngle = PI / 2.0f;
+			_info.power = 4.0f * PI * max(0.0f, sum(light.intensity) / 3.0f);
+			return true; }
+		case Light::Type::SPOT: {
+			const SpotLight& light = static_cast<const SpotLight&>(_light);
+			_info.position = light.position;
+			_info.axis = normalize(light.direction);
+			_info.normalAngle = 0.0f;
+			_info.emissionAngle = clamp(light.halfAngle, 0.0f, PI);
+			// Upper bound, the falloff is ignored
+			_info.power = 2.0f * PI * (1.0f - cos(_info.emissionAngle)) * max(0.0f, sum(light.peakIntensity) / 3.0f);
+			return true; }
+		case Light::Type::LAMBERT: {
+			const LambertLight& light = static_cast<const LambertLight&>(_light);
+			_info.position = light.position;
+			_info.axis = normalize(light.normal);
+			_info.normalAngle = 0.0f;
+			_info.emissionAngle = PI / 2.0f;
+			_info.power = PI * max(0.0f, sum(light.intensity) / 3.0f);
+			return true; }
+		default:
+			return false;
+		}
+	}
+
+	// Lights from the JSON file differ from those the tree was built for in the
+	// last digits (6 significant digits, normals are normalized on load).
+	static bool nearlyEqual(float _a, float _b)
+	{
+		return abs(_a - _b) <= 1e-4f * max(1.0f, max(abs(_a), abs(_b)));
+	}
+
+	static bool nearlyEqual(const Vec3& _a, const Vec3& _b)
+	{
+		return nearlyEqual(_a.x, _b.x) && nearlyEqual(_a.y, _b.y) && nearlyEqual(_a.z, _b.z);
+	}
+
+	static std::vector<LightInfo> collectLights(const std::vector<std::shared_ptr<Light>>& _lights)
+	{
+		std::vector<LightInfo> infos(_lights.size());
+		std::vector<uint8> isUsed(_lights.size());
+#pragma omp parallel for
+		for(int i = 0; i < int(_lights.size()); ++i)
+		{
+			infos[i].index = uint32(i);
+			isUsed[i] = _lights[i] && getLightInfo(*_lights[i], infos[i]) ? 1 : 0;
+		}
+		size_t num = 0;
+		for(size_t i = 0; i < infos.size(); ++i)
+			if(isUsed[i]) infos[num++] = infos[i];
+		infos.resize(num);
+		return infos;
+	}
+
+	// Spread the lower 10 bits such that there are two zeros between each.
+	static uint32 spreadBits(uint32 _x)
+	{
+		_x = (_x | (_x << 16)) & 0x030000ff;
+		_x = (_x | (_x << 8)) & 0x0300f00f;
+		_x = (_x | (_x << 4)) & 0x030c30c3;
+		_x = (_x | (_x << 2)) & 0x09249249;
+		return _x;
+	}
+
+	static void mergeCones(const LightTree::Node& _a, const LightTree::Node& _b, LightTree::Node& _target)
+	{
+		// The wider cone is a
+		const LightTree::Node& a = _a.normalAngle >= _b.normalAngle ? _a : _b;
+		const LightTree::Node& b = _a.normalAngle >= _b.normalAngle ? _b : _a;
+		_target.emissionAngle = max(a.emissionAngle, b.emissionAngle);
+		float cosD = clamp(dot(a.axis, b.axis), -1.0f, 1.0f);
+		float d = acos(cosD);
+		// b inside a?
+		if(min(d + b.normalAngle, PI) <= a.normalAngle)
+		{
+			_target.axis = a.axis;
+			_target.normalAngle = a.normalAngle;
+			return;
+		}
+		float angle = (a.normalAngle + d + b.normalAngle) * 0.5f;
+		if(angle >= PI)
+		{
+			_target.axis = a.axis;
+			_target.normalAngle = PI;
+			return;
+		}
+		// Rotate a's axis towards b's axis
+		Vec3 ortho = b.axis - a.axis * cosD;
+		float orthoLen = len(ortho);
+		if(orthoLen < 1e-6f)
+		{
+			// Opposite axes, any perpendicular direction works
+			ortho = abs(a.axis.x) < 0.9f ? cross(a.axis, Vec3(1.0f, 0.0f, 0.0f)) : cross(a.axis, Vec3(0.0f, 1.0f, 0.0f));
+			orthoLen = len(ortho);
+		}
+		float rotation = angle - a.normalAngle;
+		_target.axis = normalize(a.axis * cos(rotation) + ortho * (sin(rotation) / orthoLen));
+		_target.normalAngle = angle;
+	}
+
+	// A range of the sorted lights which becomes the node _node.
+	struct LightTask
+	{
+		uint32 min, max;	// Inclusive boundaries
+		uint32 node;
+	};
+
+	void LightTree::build(const std::vector<std::shared_ptr<Light>>& _lights)
+	{
+		clear();
+		std::vector<LightInfo> infos = collectLights(_lights);
+		uint32 n = uint32(infos.size());
+		if(n == 0) return;
+
+		// Sort the lights along a Morton curve. Ties are broken by the index
+		// to get the same tree in each run.
+		Vec3 boxMin = infos[0].position;
+		Vec3 boxMax = infos[0].position;
+		for(auto& info : infos)
+		{
+			boxMin = min(boxMin, info.position);
+			boxMax = max(boxMax, info.position);
+		}
+		Vec3 scale = 1023.0f / max(boxMax - boxMin, Vec3(1e-20f));
+		std::vector<uint32> codes(n);
+#pragma omp parallel for
+		for(int i = 0; i < int(n); ++i)
+		{
+			Vec3 cell = (infos[i].position - boxMin) * scale;
+			codes[i] = spreadBits(uint32(cell.x)) | (spreadBits(uint32(cell.y)) << 1) | (spreadBits(uint32(cell.z)) << 2);
+		}
+		std::vector<uint32> order(n);
+		for(uint32 i = 0; i < n; ++i) order[i] = i;
+		std::sort(order.begin(), order.end(), [&codes](uint32 _lhs, uint32 _rhs) {
+			return codes[_lhs] < codes[_rhs] || (codes[_lhs] == codes[_rhs] && _lhs < _rhs);
+		});
+
+		m_lights.resize(n);
+		std::vector<float> powers(n);
+		double totalPower = 0.0;
+		for(uint32 i = 0; i < n; ++i)
+		{
+			m_lights[i] = infos[order[i]].index;
+			powers[i] = infos[order[i]].power;
+			totalPower += powers[i];
+		}
+		m_totalPower = float(totalPower);
+
+		// Alias table (Vose's method)
+		m_aliasTable.resize(n);
+		std::vector<float> scaled(n);
+		std::vector<uint32> small, large;
+		for(uint32 i = 0; i < n; ++i)
+		{
+			m_aliasTable[i].probability = totalPower > 0.0 ? float(powers[i] / totalPower) : 1.0f / n;
+			scaled[i] = m_aliasTable[i].probability * n;
+			if(scaled[i] < 1.0f) small.push_back(i);
+			else large.push_back(i);
+		}
+		while(!small.empty() && !large.empty())
+		{
+			uint32 s = small.back(); small.pop_back();
+			uint32 l = large.back();
+			m_aliasTable[s].threshold = scaled[s];
+			m_aliasTable[s].alias = l;
+			scaled[l] -= 1.0f - scaled[s];
+			if(scaled[l] < 1.0f) {
+				large.pop_back();
+				small.push_back(l);
+			}
+		}
+		// The remaining entries are 1 up to rounding errors
+		for(uint32 i : small) { m_aliasTable[i].threshold = 1.0f; m_aliasTable[i].alias = i; }
+		for(uint32 i : large) { m_aliasTable[i].threshold = 1.0f; m_aliasTable[i].alias = i; }
+
+		// Light BVH with median splits. A subtree over k lights has 2k-1 nodes,
+		// so the position of each node is known in advance. Build the topology
+		// and the leaves level by level, then merge the bounds bottom up.
+		m_nodes.resize(2 * n - 1);
+		std::vector<std::vector<uint32>> innerNodes;
+		std::vector<LightTask> level(1, LightTask{0, n - 1, 0});
+		std::vector<LightTask> nextLevel;
+		while(!level.empty())
+		{
+			innerNodes.emplace_back();
+			nextLevel.resize(level.size() * 2);
+#pragma omp parallel for
+			for(int i = 0; i < int(level.size()); ++i)
+			{
+				const LightTask& task = level[i];
+				Node& node = m_nodes[task.node];
+				memset(&node, 0, sizeof(Node));
+				if(task.min == task.max)
+				{
+					const LightInfo& info = infos[order[task.min]];
+					node.boxMin = node.boxMax = info.position;
+					node.rightChild = LIGHT_TREE_LEAF | task.min;
+					node.power = info.power;
+					node.axis = info.axis;
+					node.normalAngle = info.normalAngle;
+					node.emissionAngle = info.emissionAngle;
+					nextLevel[i * 2].node = nextLevel[i * 2 + 1].node = 0;
+				} else {
+					uint32 m = (task.min + task.max) / 2;
+					nextLevel[i * 2] = {task.min, m, task.node + 1};
+					nextLevel[i * 2 + 1] = {m + 1, task.max, task.node + 2 * (m - task.min + 1)};
+					node.rightChild = nextLevel[i * 2 + 1].node;
+				}
+			}
+			for(auto& task : level)
+				if(task.min != task.max) innerNodes.back().push_back(task.node);
+			// Remove the children of leaves
+			level.clear();
+			for(auto& task : nextLevel)
+				if(task.node != 0) level.push_back(task);
+		}
+		for(size_t l = innerNodes.size(); l-- > 0; )
+		{
+			const std::vector<uint32>& nodes = innerNodes[l];
+#pragma omp parallel for
+			for(int i = 0; i < int(nodes.size()); ++i)
+			{
+				Node& node = m_nodes[nodes[i]];
+				const Node& left = m_nodes[nodes[i] + 1];
+				const Node& right = m_nodes[node.rightChild];
+				node.boxMin = min(left.boxMin, right.boxMin);
+				node.boxMax = max(left.boxMax, right.boxMax);
+				node.power = left.power + right.power;
+				mergeCones(left, right, node);
+			}
+		}
+	}
+
+	void LightTree::clear()
+	{
+		m_totalPower = 0.0f;
+		m_lights.clear();
+		m_aliasTable.clear();
+		m_nodes.clear();
+	}
+
+	bool LightTree::isValidFor(const std::vector<std::shared_ptr<Light>>& _lights) const
+	{
+		std::vector<LightInfo> infos = collectLights(_lights);
+		if(infos.size() != m_lights.size()) return false;
+		// Each supported light must be referenced exactly once.
+		std::vector<uint32> infoOf(_lights.size(), INVALID);
+		for(uint32 i = 0; i < infos.size(); ++i)
+			infoOf[infos[i].index] = i;
+		std::vector<uint8> isReferenced(infos.size(), 0);
+		for(uint32 light : m_lights)
+		{
+			if(light >= _lights.size() || infoOf[light] == INVALID || isReferenced[infoOf[light]])
+				return false;
+			isReferenced[infoOf[light]] = 1;
+		}
+		// The leaves contain the parameters the tree was built with.
+		for(const Node& node : m_nodes)
+		{
+			if(!(node.rightChild & LIGHT_TREE_LEAF)) continue;
+			const LightInfo& info = infos[infoOf[m_lights[node.rightChild & ~LIGHT_TREE_LEAF]]];
+			if(!nearlyEqual(node.boxMin, info.position) || !nearlyEqual(node.axis, info.axis)
+				|| !nearlyEqual(node.normalAngle, info.normalAngle) || !nearlyEqual(node.emissionAngle, info.emissionAngle)
+				|| !nearlyEqual(node.power, info.power))
+				return false;
+		}
+		return true;
+	}
+
+	uint32 LightTree::sampleAlias(float _u, float& _pdf) const
+	{
+		_pdf = 0.0f;
+		if(m_aliasTable.empty()) return INVALID;
+		uint32 n = uint32(m_aliasTable.size());
+		float x = _u * n;
+		uint32 i = min(uint32(x), n - 1);
+		if(x - i >= m_aliasTable[i].threshold)
+			i = m_aliasTable[i].alias;
+		_pdf = m_aliasTable[i].probability;
+		return m_lights[i];
+	}
+
+	uint32 LightTree::sample(const Vec3& _position, const Vec3& _normal, float _u, float& _pdf) const
+	{
+		_pdf = 0.0f;
+		if(m_nodes.empty()) return INVALID;
+		float pdf = 1.0f;
+		uint32 node = 0;
+		while(!(m_nodes[node].rightChild & LIGHT_TREE_LEAF))
+		{
+			uint32 right = m_nodes[node].rightChild;
+			float importanceLeft = importance(m_nodes[node + 1], _position, _normal);
+			float importanceRight = importance(m_nodes[right], _position, _normal);
+			if(importanceLeft + importanceRight <= 0.0f)
+				return INVALID;
+			// Choose a child and reuse the random number
+			float pLeft = importanceLeft / (importanceLeft + importanceRight);
+			if(_u < pLeft)
+			{
+				_u /= pLeft;
+				pdf *= pLeft;
+				node = node + 1;
+			} else {
+				_u = (_u - pLeft) / (1.0f - pLeft);
+				pdf *= 1.0f - pLeft;
+				node = right;
+			}
+			_u = min(_u, 0.99999994f);
+		}
+		_pdf = pdf;
+		return m_lights[m_nodes[node].rightChild & ~LIGHT_TREE_LEAF];
+	}
+
+	float LightTree::importance(const Node& _node, const Vec3& _position, const Vec3& _normal)
+	{
+		if(_node.power <= 0.0f) return 0.0f;
+		Vec3 toCenter = (_node.boxMin + _node.boxMax) * 0.5f - _position;
+		float distSq = lensq(toCenter);
+		float radiusSq = lensq(_node.boxMax - _node.boxMin) * 0.25f;
+		// Inside the bounding sphere no direction can be excluded
+		if(distSq <= radiusSq || distSq == 0.0f)
+			return _node.power / max(radiusSq, 1e-12f);
+		float dist = sqrt(distSq);
+		Vec3 dir = toCenter / dist;
+		// Angle under which the bounding sphere is seen
+		float boundAngle = asin(min(1.0f, sqrt(radiusSq / distSq)));
+		// Angle between the emitted directions and the point
+		float angle = acos(clamp(-dot(_node.axis, dir), -1.0f, 1.0f));
+		angle = max(0.0f, angle - _node.normalAngle - boundAngle);
+		if(angle >= _node.emissionAngle) return 0.0f;
+		float result = _node.power * max(0.0f, cos(angle)) / distSq;
+		if(_normal != Vec3(0.0f))
+		{
+			float incidentAngle = acos(clamp(dot(_normal, dir), -1.0f, 1.0f));
+			incidentAngle = max(0.0f, incidentAngle - boundAngle);
+			result *= max(0.0f, cos(incidentAngle));
+		}
+		return result;
+	}
+
+	void LightTree::pack(std::vector<uint32>& _blob, const std::vector<std::shared_ptr<Light>>& _lights) const
+	{
+		// Total power, number of lights and nodes, the names of the lights
+		// (length and padded characters each), then the alias table and the
+		// nodes.
+		static_assert(sizeof(AliasEntry) == 3 * sizeof(uint32) && sizeof(Node) == 16 * sizeof(uint32), "Unexpected padding.");
+		size_t offset = _blob.size();
+		_blob.resize(offset + 3);
+		memcpy(&_blob[offset], &m_totalPower, sizeof(float));
+		_blob[offset + 1] = uint32(m_lights.size());
+		_blob[offset + 2] = uint32(m_nodes.size());
+		for(uint32 light : m_lights)
+		{
+			const std::string& name = _lights[light]->name;
+			offset = _blob.size();
+			_blob.resize(offset + 1 + (name.size() + 3) / 4, 0);
+			_blob[offset] = uint32(name.size());
+			memcpy(&_blob[offset + 1], name.data(), name.size());
+		}
+		offset = _blob.size();
+		_blob.resize(offset + m_aliasTable.size() * 3 + m_nodes.size() * 16);
+		memcpy(&_blob[offset], m_aliasTable.data(), m_aliasTable.size() * sizeof(AliasEntry));
+		memcpy(&_blob[offset + m_aliasTable.size() * 3], m_nodes.data(), m_nodes.size() * sizeof(Node));
+	}
+
+	bool LightTree::unpack(const uint32*& _data, const uint32* _end, const std::vector<std::shared_ptr<Light>>& _lights)
+	{
+		clear();
+		if(_end - _data < 3) return false;
+		uint32 numLights = _data[1];
+		uint32 numNodes = _data[2];
+		// Each name needs at least one word
+		if(numLights > uint64(_end - _data - 3) || numNodes != (numLights ? 2 * numLights - 1 : 0))
+			return false;
+		memcpy(&m_totalPower, &_data[0], sizeof(float));
+		_data += 3;
+		// Names which are not in _lights become INVALID, isValidFor() fails then.
+		std::unordered_map<std::string, uint32> lightIndices;
+		for(uint32 i = 0; i < _lights.size(); ++i)
+			if(_lights[i]) lightIndices.emplace(_lights[i]->name, i);
+		m_lights.resize(numLights);
+		for(uint32 i = 0; i < numLights; ++i)
+		{
+			if(_data == _end || uint64(_end - _data - 1) * sizeof(uint32) < *_data) { clear(); return false; }
+			std::string name(reinterpret_cast<const char*>(_data + 1), *_data);
+			_data += 1 + (name.size() + 3) / 4;
+			auto it = lightIndices.find(name);
+			m_lights[i] = it == lightIndices.end() ? INVALID : it->second;
+		}
+		if(uint64(_end - _data) < uint64(numLights) * 3 + uint64(numNodes) * 16) { clear(); return false; }
+		m_aliasTable.resize(numLights);
+		memcpy(m_aliasTable.data(), _data, numLights * sizeof(AliasEntry));
+		_data += numLights * 3;
+		m_nodes.resize(numNodes);
+		memcpy(m_nodes.data(), _data, numNodes * sizeof(Node));
+		_data += numNodes * 16;
+		// The traversal must not leave the arrays
+		for(uint32 i = 0; i < numNodes; ++i)
+		{
+			uint32 child = m_nodes[i].rightChild;
+			if((child & LIGHT_TREE_LEAF) ? (child & ~LIGHT_TREE_LEAF) >= numLights : (child <= i + 1 || child >= numNodes))
+			{
+				clear();
+				return false;
+			}
+		}
+		for(uint32 i = 0; i < numLights; ++i)
+			if(m_aliasTable[i].alias >= numLights) { clear(); return false; }
+		return true;
+	}
+
+	void BinaryModel::buildLightTrees()
+	{
+		for(auto& scenario : m_scenarios)
+			scenario.buildLightTree();
+	}
+
+	bool BinaryModel::packLightTrees(std::vector<uint32>& _blob) const
+	{
+		// version, number of trees, per tree: name length, padded name
+		// characters and the data of LightTree::pack().
+		_blob.clear();
+		_blob.push_back(LIGHT_TREES_VERSION);
+		_blob.push_back(0);
+		for(auto& scenario : m_scenarios)
+		{
+			if(scenario.getLightTree().isEmpty()) continue;
+			const std::string& name = scenario.getName();
+			size_t offset = _blob.size();
+			_blob.resize(offset + 1 + (name.size() + 3) / 4, 0);
+			_blob[offset] = uint32(name.size());
+			memcpy(&_blob[offset + 1], name.data(), name.size());
+			scenario.getLightTree().pack(_blob, scenario.getLights());
+			++_blob[1];
+		}
+		return _blob[1] > 0;
+	}
+
+	void BinaryModel::unpackLightTrees(const uint32* _blob, size_t _numWords)
+	{
+		const uint32* end = _blob + _numWords;
+		if(_numWords < 2 || _blob[0] != LIGHT_TREES_VERSION)
+		{
+			sendMessage(MessageType::WARNING, "Unknown light tree version. The light trees are ignored.");
+			return;
+		}
+		uint32 num = _blob[1];
+		_blob += 2;
+		for(uint32 i = 0; i < num; ++i)
+		{
+			if(_blob == end || (end - _blob - 1) * sizeof(uint32) < *_blob)
+			{
+				sendMessage(MessageType::ERROR, "Invalid light tree section!");
+				return;
+			}
+			std::string name(reinterpret_cast<const char*>(_blob + 1), *_blob);
+			_blob += 1 + (name.size() + 3) / 4;
+			Scenario* scenario = getScenario(name);
+			LightTree tree;
+			if(!tree.unpack(_blob, end, scenario ? scenario->getLights() : std::vector<std::shared_ptr<Light>>()))
+			{
+				sendMessage(MessageType::ERROR, "Invalid light tree section!");
+				return;
+			}
+			if(!scenario || !scenario->setLightTree(std::move(tree)))
+				sendMessage(MessageType::INFO, "The light tree of scenario ", name, " does not match the lights and is ignored.");
+		}
+	}
+
+} // namespace bim
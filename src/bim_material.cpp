@@ -1,4 +1,9 @@
 #include "bim/material.hpp"
+#include "bim/bim.hpp"
+#include "bim/log.hpp"
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
 
 namespace bim {
 
@@ -103,4 +108,370 @@ namespace bim {
 		m_textureNames[_name] = move(_textureFile);
 	}
 
+	// Number of Vec4 per cache line (64 byte)
+	static const uint32 VALUES_PER_LINE = 64 / sizeof(ei::Vec4);
+
+	const uint32 MaterialTable::INVALID_ID;
+
+	MaterialTable::MaterialTable() :
+		m_numMaterials(0),
+		m_stride(0),
+		m_valueOffset(0)
+	{
+	}
+
+	// Find or add a string in an interned list.
+	static uint32 intern(std::vector<std::string>& _list, std::unordered_map<std::string, uint32>& _ids, const std::string& _name)
+	{
+		auto it = _ids.find(_name);
+		if(it != _ids.end())
+			return it->second;
+		uint32 id = static_cast<uint32>(_list.size());
+		_ids.emplace(_name, id);
+		_list.push_back(_name);
+		return id;
+	}
+
+	void MaterialTable::build(const std::vector<const Material*>& _materials)
+	{
+		clear();
+		m_numMaterials = static_cast<uint32>(_materials.size());
+		m_stride = (m_numMaterials + VALUES_PER_LINE - 1) / VALUES_PER_LINE * VALUES_PER_LINE;
+
+		// Collect all property names. They are sorted to get the same IDs
+		// independent of the hash map iteration order.
+		for(const Material* mat : _materials)
+		{
+			if(!mat) continue;
+			for(auto& it : mat->m_values) m_propertyNames.push_back(it.first);
+			for(auto& it : mat->m_textureNames) m_propertyNames.push_back(it.first);
+		}
+		std::sort(m_propertyNames.begin(), m_propertyNames.end());
+		m_propertyNames.erase(std::unique(m_propertyNames.begin(), m_propertyNames.end()), m_propertyNames.end());
+		for(uint32 i = 0; i < m_propertyNames.size(); ++i)
+			m_propertyIDs.emplace(m_propertyNames[i], i);
+
+		// Allocate the columns. Add one cache line to be able to align the start.
+		size_t size = m_stride * m_propertyNames.size();
+		m_valueStorage.resize(size + VALUES_PER_LINE, ei::Vec4(0.0f));
+		m_valueOffset = ((64 - reinterpret_cast<std::uintptr_t>(m_valueStorage.data()) % 64) % 64) / sizeof(ei::Vec4);
+		m_numComponents.resize(size, 0);
+		m_textures.resize(size, INVALID_ID);
+		m_types.resize(m_numMaterials, INVALID_ID);
+
+		std::unordered_map<std::string, uint32> typeIDs, textureIDs;
+		for(uint32 m = 0; m < m_numMaterials; ++m)
+		{
+			const Material* mat = _materials[m];
+			if(!mat) continue;
+			m_types[m] = intern(m_typeNames, typeIDs, mat->m_type);
+			for(auto& it : mat->m_values)
+			{
+				size_t i = idx(m, m_propertyIDs[it.first]);
+				m_valueStorage[m_valueOffset + i] = it.second.values;
+				m_numComponents[i] = static_cast<uint8>(it.second.numComponents);
+			}
+			for(auto& it : mat->m_textureNames)
+				m_textures[idx(m, m_propertyIDs[it.first])] = intern(m_textureNames, textureIDs, it.second);
+		}
+	}
+
+	void MaterialTable::clear()
+	{
+		m_numMaterials = 0;
+		m_stride = 0;
+		m_valueOffset = 0;
+		m_valueStorage.clear();
+		m_numComponents.clear();
+		m_textures.clear();
+		m_types.clear();
+		m_propertyNames.clear();
+		m_typeNames.clear();
+		m_textureNames.clear();
+		m_propertyIDs.clear();
+	}
+
+	uint32 MaterialTable::getPropertyID(const std::string& _name) const
+	{
+		auto it = m_propertyIDs.find(_name);
+		if(it != m_propertyIDs.end())
+			return it->second;
+		return INVALID_ID;
+	}
+
+	uint32 MaterialTable::getTypeID(const std::string& _typeName) const
+	{
+		for(size_t i = 0; i < m_typeNames.size(); ++i)
+			if(m_typeNames[i] == _typeName)
+				return static_cast<uint32>(i);
+		return INVALID_ID;
+	}
+
+	float MaterialTable::get(uint32 _material, uint32 _property, const float _default) const
+	{
+		if(_property == INVALID_ID || !m_numComponents[idx(_material, _property)])
+			return _default;
+		return value(_material, _property).x;
+	}
+
+	ei::Vec2 MaterialTable::get(uint32 _material, uint32 _property, const ei::Vec2& _default) const
+	{
+		if(_property == INVALID_ID) return _default;
+		ei::Vec2 res(value(_material, _property));
+		// Fill missing components with the default.
+		for(int i = m_numComponents[idx(_material, _property)]; i < 2; ++i)
+			res[i] = _default[i];
+		return res;
+	}
+
+	ei::Vec3 MaterialTable::get(uint32 _material, uint32 _property, const ei::Vec3& _default) const
+	{
+		if(_property == INVALID_ID) return _default;
+		ei::Vec3 res(value(_material, _property));
+		// Fill missing components with the default.
+		for(int i = m_numComponents[idx(_material, _property)]; i < 3; ++i)
+			res[i] = _default[i];
+		return res;
+	}
+
+	ei::Vec4 MaterialTable::get(uint32 _material, uint32 _property, const ei::Vec4& _default) const
+	{
+		if(_property == INVALID_ID) return _default;
+		ei::Vec4 res = value(_material, _property);
+		// Fill missing components with the default.
+		for(int i = m_numComponents[idx(_material, _property)]; i < 4; ++i)
+			res[i] = _default[i];
+		return res;
+	}
+
+	// Layouts with the defaults from the readme
+	static const PackedMaterialProperty PHYSICAL_PROPERTIES[] = {
+		{"albedo",			3, {0.5f, 0.5f, 0.5f}},
+		{"refractionIdxN",	3, {1.3f, 1.3f, 1.3f}},
+		{"refractionIdxK",	3, {0.0f, 0.0f, 0.0f}},
+		{"emissivity",		3, {0.0f, 0.0f, 0.0f}},
+		{"roughness",		3, {0.0f, 0.0f, 0.0f}},
+		{"reflectivity",	1, {1.0f}},
+		{"displacement",	1, {0.0f}},
+		{"absorption",		1, {0.5f}},
+		{"scattering",		3, {1e30f, 1e30f, 1e30f}},
+		{"density",			1, {1.0f}},
+		{"phase",			1, {0.0f}}
+	};
+	static const PackedMaterialProperty GENERAL_PROPERTIES[] = {
+		{"color",			3, {0.5f, 0.5f, 0.5f}},
+		{"metalness",		1, {0.0f}},
+		{"roughness",		3, {0.0f, 0.0f, 0.0f}},
+		{"reflectivity",	1, {1.0f}},
+		{"emissivity",		3, {0.0f, 0.0f, 0.0f}},
+		{"transmissivity",	3, {0.0f, 0.0f, 0.0f}},
+		{"subscattering",	1, {0.0f}},
+		{"refractionIdxN",	3, {1.3f, 1.3f, 1.3f}},
+		{"displacement",	1, {0.0f}}
+	};
+	static const PackedMaterialProperty LEGACY_PROPERTIES[] = {
+		{"albedo",			3, {0.5f, 0.5f, 0.5f}},
+		{"specularColor",	3, {1.0f, 1.0f, 1.0f}},
+		{"reflectivity",	1, {0.05f}},
+		{"roughness",		3, {0.5f, 0.5f, 0.0f}},
+		{"emissivity",		3, {0.0f, 0.0f, 0.0f}}
+	};
+	static const PackedMaterialProperty TRANSPARENT_PROPERTIES[] = {
+		{"roughness",		3, {0.5f, 0.5f, 0.0f}},
+		{"reflectivity",	3, {0.05f, 0.05f, 0.05f}},
+		{"optDensity",		4, {0.0f, 0.0f, 0.0f, 1.3f}}
+	};
+	static const PackedMaterialProperty THINLAYER_PROPERTIES[] = {
+		{"diffuseUpAlpha",			4, {0.5f, 0.5f, 0.5f, 1.0f}},
+		{"diffuseDown",				3, {0.2f, 0.2f, 0.2f}},
+		{"reflectivityUpDown",		2, {0.05f, 0.05f}},
+		{"roughnessUpDownInner",	3, {0.8f, 0.8f, 0.8f}},
+		{"transmittance",			4, {0.0f, 0.0f, 0.0f, 1.0f}}
+	};
+	static const PackedMaterialProperty VOLUMETRIC_PROPERTIES[] = {
+		{"absorption",		3, {10.0f, 20.0f, 40.0f}},
+		{"scattering",		3, {100.0f, 100.0f, 100.0f}},
+		{"density",			1, {1.0f}},
+		{"phase",			1, {0.0f}}
+	};
+
+	const PackedMaterialLayout PACKED_MATERIAL_LAYOUTS[] = {
+		{"physical",	11, PHYSICAL_PROPERTIES},
+		{"general",		9, GENERAL_PROPERTIES},
+		{"legacy",		5, LEGACY_PROPERTIES},
+		{"transparent",	3, TRANSPARENT_PROPERTIES},
+		{"thinLayer",	5, THINLAYER_PROPERTIES},
+		{"volumetric",	4, VOLUMETRIC_PROPERTIES}
+	};
+	const uint32 NUM_PACKED_MATERIAL_LAYOUTS = 6;
+
+	static const uint32 NO_PACKED_ENTRY = 0xffffffff;
+
+	bool BinaryModel::packMaterials(std::vector<uint32>& _blob) const
+	{
+		uint32 numMaterials = getNumUsedMaterials();
+		_blob.clear();
+		_blob.push_back(PACKED_MATERIAL_VERSION);
+		_blob.push_back(numMaterials);
+		_blob.push_back(0);	// Number of textures is known at the end
+		_blob.resize(4 + numMaterials);
+		std::vector<std::string> textureNames;
+		std::unordered_map<std::string, uint32> textureIDs;
+		for(uint32 m = 0; m < numMaterials; ++m)
+		{
+			_blob[3 + m] = static_cast<uint32>(_blob.size());
+			const Material* mat = getMaterial(m);
+			if(!mat) {
+				_blob.insert(_blob.end(), {NO_PACKED_ENTRY, 0, 0, 0});
+				continue;
+			}
+			uint32 type = 0;
+			while(type < NUM_PACKED_MATERIAL_LAYOUTS && mat->m_type != PACKED_MATERIAL_LAYOUTS[type].type)
+				++type;
+			if(type == NUM_PACKED_MATERIAL_LAYOUTS) {
+				sendMessage(MessageType::WARNING, "Cannot pack material '", mat->m_name, "' of unknown type '", mat->m_type, "'.");
+				return false;
+			}
+			const PackedMaterialLayout& layout = PACKED_MATERIAL_LAYOUTS[type];
+			size_t recordStart = _blob.size();
+			_blob.insert(_blob.end(), {type, 0, 0, 0});
+			size_t numPacked = 0;
+			for(uint32 p = 0; p < layout.numProperties; ++p)
+			{
+				const PackedMaterialProperty& prop = layout.properties[p];
+				uint32 texture = NO_PACKED_ENTRY;
+				uint32 numComponents = prop.numComponents;
+				ei::Vec4 value(prop.defaultValue[0], prop.defaultValue[1], prop.defaultValue[2], prop.defaultValue[3]);
+				auto itv = mat->m_values.find(prop.name);
+				if(itv != mat->m_values.end())
+				{
+					if(itv->second.numComponents > int(prop.numComponents)) {
+						sendMessage(MessageType::WARNING, "Cannot pack material '", mat->m_name, "': property '", prop.name, "' has too many components.");
+						return false;
+					}
+					numComponents = ei::max(1, itv->second.numComponents);
+					for(uint32 i = 0; i < numComponents; ++i)
+						value[i] = itv->second.values[i];
+					// A scalar for an (S, RGB) property means the same value in all channels.
+					if(numComponents == 1)
+						for(uint32 i = 1; i < prop.numComponents; ++i)
+							value[i] = value[0];
+					_blob[recordStart + 1] |= 1 << p;
+					++numPacked;
+				}
+				auto itt = mat->m_textureNames.find(prop.name);
+				if(itt != mat->m_textureNames.end())
+				{
+					texture = intern(textureNames, textureIDs, itt->second);
+					_blob[recordStart + 2] |= 1 << p;
+					++numPacked;
+				}
+				_blob[recordStart + 3] |= (numComponents - 1) << (2 * p);
+				for(uint32 i = 0; i < prop.numComponents; ++i)
+					_blob.push_back(*reinterpret_cast<const uint32*>(&value[i]));
+				_blob.push_back(texture);
+			}
+			// Everything which is not part of the layout would get lost.
+			if(numPacked != mat->m_values.size() + mat->m_textureNames.size()) {
+				sendMessage(MessageType::WARNING, "Cannot pack material '", mat->m_name, "': it has properties which are not defined for the type '", mat->m_type, "'.");
+				return false;
+			}
+		}
+		_blob[3 + numMaterials] = static_cast<uint32>(_blob.size());
+		_blob[2] = static_cast<uint32>(textureNames.size());
+
+		// String section
+		size_t offsetStart = _blob.size();
+		_blob.resize(offsetStart + numMaterials + textureNames.size() + 1);
+		std::string strings;
+		for(uint32 m = 0; m < numMaterials; ++m)
+		{
+			_blob[offsetStart + m] = static_cast<uint32>(strings.size());
+			strings += m_materialIndirection[m];
+		}
+		for(size_t t = 0; t < textureNames.size(); ++t)
+		{
+			_blob[offsetStart + numMaterials + t] = static_cast<uint32>(strings.size());
+			strings += textureNames[t];
+		}
+		_blob.back() = static_cast<uint32>(strings.size());
+		size_t charStart = _blob.size();
+		_blob.resize(charStart + (strings.size() + 3) / 4, 0);
+		if(!strings.empty())
+			memcpy(&_blob[charStart], strings.data(), strings.size());
+		return true;
+	}
+
+	bool BinaryModel::unpackMaterials(const uint32* _blob, size_t _numWords)
+	{
+		if(_numWords < 4 || _blob[0] != PACKED_MATERIAL_VERSION) {
+			sendMessage(MessageType::WARNING, "Packed materials have an unsupported version. Using the environment file instead.");
+			return false;
+		}
+		uint32 numMaterials = _blob[1];
+		uint32 numTextures = _blob[2];
+		size_t offsetStart = 4 + size_t(numMaterials);
+		size_t stringStart = offsetStart <= _numWords ? _blob[3 + numMaterials] : _numWords;
+		size_t charStart = stringStart + numMaterials + numTextures + 1;
+		if(stringStart < offsetStart || charStart > _numWords || (_blob[charStart - 1] + 3) / 4 > _numWords - charStart) {
+			sendMessage(MessageType::ERROR, "Packed material section is corrupted!");
+			return false;
+		}
+		const uint32* stringOffsets = _blob + stringStart;
+		for(uint32 i = 0; i < numMaterials + numTextures; ++i)
+			if(stringOffsets[i] > stringOffsets[i + 1]) {
+				sendMessage(MessageType::ERROR, "Packed material section is corrupted!");
+				return false;
+			}
+		const char* chars = reinterpret_cast<const char*>(_blob + charStart);
+		auto getString = [&](uint32 _index) {
+			return std::string(chars + stringOffsets[_index], chars + stringOffsets[_index + 1]);
+		};
+
+		for(uint32 m = 0; m < numMaterials; ++m)
+		{
+			// Records must lie between the offset table and the strings.
+			size_t recordStart = _blob[3 + m];
+			size_t recordSize = 4;
+			if(recordStart < offsetStart || recordStart + recordSize > stringStart) {
+				sendMessage(MessageType::ERROR, "Packed material section is corrupted!");
+				return false;
+			}
+			const uint32* record = _blob + recordStart;
+			if(record[0] < NUM_PACKED_MATERIAL_LAYOUTS)
+				for(uint32 p = 0; p < PACKED_MATERIAL_LAYOUTS[record[0]].numProperties; ++p)
+					recordSize += PACKED_MATERIAL_LAYOUTS[record[0]].properties[p].numComponents + 1;
+			if(recordStart + recordSize > stringStart) {
+				sendMessage(MessageType::ERROR, "Packed material section is corrupted!");
+				return false;
+			}
+			if(record[0] == NO_PACKED_ENTRY) continue;
+			if(record[0] >= NUM_PACKED_MATERIAL_LAYOUTS) {
+				sendMessage(MessageType::ERROR, "Packed material section is corrupted!");
+				return false;
+			}
+			const PackedMaterialLayout& layout = PACKED_MATERIAL_LAYOUTS[record[0]];
+			Material mat(getString(m), layout.type);
+			const uint32* data = record + 4;
+			for(uint32 p = 0; p < layout.numProperties; ++p)
+			{
+				const PackedMaterialProperty& prop = layout.properties[p];
+				if(record[1] & (1 << p))
+				{
+					// Only the given components, like after parsing the JSON file.
+					Material::MultiValue value{ei::Vec4(0.0f), int((record[3] >> (2 * p)) & 3) + 1};
+					for(int i = 0; i < value.numComponents; ++i)
+						value.values[i] = reinterpret_cast<const float*>(data)[i];
+					mat.m_values.emplace(prop.name, value);
+				}
+				data += prop.numComponents;
+				if((record[2] & (1 << p)) && *data < numTextures)
+					mat.m_textureNames.emplace(prop.name, getString(numMaterials + *data));
+				++data;
+			}
+			m_materials.emplace(mat.getName(), std::move(mat));
+		}
+		return true;
+	}
+
 } // namespace bim
\ No newline at end of file
@@ -0,0 +1,411 @@
+#include "bim/chunk.hpp"
+#include "bim/log.hpp"
+
+using namespace ei;
+
+namespace bim {
+
+	// Same costs as in the SAH of analyzeHierarchy().
+	static const float INNER_NODE_COST = 1.2f;
+	static const float TRIANGLE_COST = 1.0f;
+	// Number of leaves of a treelet. The optimal topology is searched over all
+	// subsets of them (2^7 subsets, 3^7 partition steps).
+	static const int TREELET_SIZE = 7;
+
+	// Explicit binary tree used during the optimisation. Indices are the
+	// original node indices.
+	struct OptNode
+	{
+		uint32 left, right;	// Children or ~0 for leaves
+		uint32 parent;
+		Box box;
+		float cost;			// SAH cost of the subtree (not normalized)
+	};
+
+	// Breadth first order of the current tree.
+	static void computeLevels(const std::vector<OptNode>& _nodes, std::vector<uint32>& _order, std::vector<uint32>& _levelOffsets)
+	{
+		_order.clear();
+		_levelOffsets.clear();
+		_order.push_back(0);
+		_levelOffsets.push_back(0);
+		uint32 levelBegin = 0;
+		while(levelBegin < _order.size())
+		{
+			uint32 levelEnd = (uint32)_order.size();
+			_levelOffsets.push_back(levelEnd);
+			for(uint32 i = levelBegin; i < levelEnd; ++i)
+			{
+				const OptNode& node = _nodes[_order[i]];
+				if(node.left != 0xffffffff)
+				{
+					_order.push_back(node.left);
+					_order.push_back(node.right);
+				}
+			}
+			levelBegin = levelEnd;
+		}
+	}
+
+	// Try to find a better topology for the treelet below _root. Returns true
+	// if the treelet was changed.
+	static bool restructureTreelet(std::vector<OptNode>& _nodes, uint32 _root)
+	{
+		// Form the treelet by expanding the leaf with the largest surface.
+		uint32 leaves[TREELET_SIZE];
+		uint32 inner[TREELET_SIZE - 1];
+		int numLeaves = 2, numInner = 1;
+		leaves[0] = _nodes[_root].left;
+		leaves[1] = _nodes[_root].right;
+		inner[0] = _root;
+		while(numLeaves < TREELET_SIZE)
+		{
+			int best = -1;
+			float bestArea = -1.0f;
+			for(int i = 0; i < numLeaves; ++i)
+			{
+				if(_nodes[leaves[i]].left == 0xffffffff) continue;
+				float area = surface(_nodes[leaves[i]].box);
+				if(area > bestArea) { bestArea = area; best = i; }
+			}
+			if(best == -1) break;
+			uint32 expand = leaves[best];
+			inner[numInner++] = expand;
+			leaves[best] = _nodes[expand].left;
+			leaves[numLeaves++] = _nodes[expand].right;
+		}
+
+		// Dynamic programming over all subsets of leaves.
+		const int numSubsets = 1 << numLeaves;
+		Box box[1 << TREELET_SIZE];
+		float cost[1 << TREELET_SIZE];
+		uint8 split[1 << TREELET_SIZE];
+		for(int s = 1; s < numSubsets; ++s)
+		{
+			int lowBit = s & -s;
+			if(s == lowBit)
+			{
+				int i = 0; while(!(s & (1 << i))) ++i;
+				box[s] = _nodes[leaves[i]].box;
+				cost[s] = _nodes[leaves[i]].cost;
+				continue;
+			}
+			box[s] = Box(box[s & (s - 1)], box[lowBit]);
+			// Enumerate each partition once (the first part contains the lowest bit).
+			float bestCost = 1e30f;
+			for(int p = (s - 1) & s; p > 0; p = (p - 1) & s)
+			{
+				if(!(p & lowBit)) continue;
+				float c = cost[p] + cost[s ^ p];
+				if(c < bestCost) { bestCost = c; split[s] = uint8(p); }
+			}
+			cost[s] = INNER_NODE_COST * surface(box[s]) + bestCost;
+		}
+		if(cost[numSubsets - 1] >= _nodes[_root].cost * 0.99999f)
+			return false;
+
+		// Rebuild the treelet from the partitions. The root keeps its index, the
+		// other inner nodes are reused in arbitrary order.
+		int nextInner = 1;
+		struct Rebuild {
+			std::vector<OptNode>& nodes;
+			const uint32* leaves; const uint32* inner; int& nextInner;
+			const Box* box; const float* cost; const uint8* split;
+			uint32 operator()(int _set, uint32 _node, uint32 _parent) const
+			{
+				int p = split[_set];
+				uint32 l = child(p, _node);
+				uint32 r = child(_set ^ p, _node);
+				OptNode& n = nodes[_node];
+				n.left = l; n.right = r; n.parent = _parent;
+				n.box = box[_set];
+				n.cost = cost[_set];
+				return _node;
+			}
+			uint32 child(int _set, uint32 _parent) const
+			{
+				if(!(_set & (_set - 1)))
+				{
+					int i = 0; while(!(_set & (1 << i))) ++i;
+					nodes[leaves[i]].parent = _parent;
+					return leaves[i];
+				}
+				return (*this)(_set, inner[nextInner++], _parent);
+			}
+		} rebuild = {_nodes, leaves, inner, nextInner, box, cost, split};
+		rebuild(numSubsets - 1, _root, _nodes[_root].parent);
+		return true;
+	}
+
+	// Reorder per node data: _data[i] = old _data[_order[i]]. Empty arrays
+	// (property not available) are skipped.
+	template<typename T>
+	static void permute(std::vector<T>& _data, const std::vector<uint32>& _order)
+	{
+		if(_data.size() != _order.size()) return;
+		std::vector<T> tmp(_data.size());
+		for(size_t i = 0; i < _order.size(); ++i)
+			tmp[i] = _data[_order[i]];
+		_data.swap(tmp);
+	}
+
+	// Append all nodes of the subtree of _node with a relative depth < _levels in
+	// van Emde Boas order.
+	static void vanEmdeBoasOrder(const Node* _hierarchy, const uint32* _parents, uint32 _node, uint _levels, std::vector<uint32>& _order)
+	{
+		if(_levels <= 1) { _order.push_back(_node); return; }
+		uint bottomLevels = _levels / 2;
+		uint topLevels = _levels - bottomLevels;
+		vanEmdeBoasOrder(_hierarchy, _parents, _node, topLevels, _order);
+		// Find the roots of the bottom subtrees from left to right.
+		struct Entry { uint32 node; uint depth; };
+		std::vector<Entry> stack;
+		stack.push_back({_node, 0});
+		std::vector<uint32> children;
+		while(!stack.empty())
+		{
+			Entry e = stack.back();
+			stack.pop_back();
+			if(e.depth == topLevels)
+			{
+				vanEmdeBoasOrder(_hierarchy, _parents, e.node, bottomLevels, _order);
+				continue;
+			}
+			uint32 child = _hierarchy[e.node].firstChild;
+			if(child & 0x80000000) continue;
+			children.clear();
+			do {
+				children.push_back(child);
+				child = _hierarchy[child].escape;
+			} while(_parents[child] == e.node && child != 0);
+			for(auto it = children.rbegin(); it != children.rend(); ++it)
+				stack.push_back({*it, e.depth + 1});
+		}
+	}
+
+	void Chunk::reorderHierarchy(NodeLayout _layout)
+	{
+		if(!(m_properties & Property::HIERARCHY) || m_hierarchy.empty()) {
+			sendMessage(MessageType::ERROR, "Cannot reorder a hierarchy which does not exist!");
+			return;
+		}
+		uint32 numNodes = (uint32)m_hierarchy.size();
+		// New order of the old node indices. The root stays at 0.
+		std::vector<uint32> order;
+		order.reserve(numNodes);
+		std::vector<uint32> stack;
+		switch(_layout)
+		{
+		case NodeLayout::DEPTH_FIRST:
+			// The escape pointers already give the preorder.
+			for(uint32 node = 0; order.size() < numNodes; )
+			{
+				order.push_back(node);
+				uint32 child = m_hierarchy[node].firstChild;
+				node = (child & 0x80000000) ? m_hierarchy[node].escape : child;
+				if(node == 0) break;
+			}
+			break;
+		case NodeLayout::VAN_EMDE_BOAS: {
+			// The stored level count may come from a file. A wrong value would
+			// miss nodes or, if 0, never end the recursion.
+			std::vector<uint32> nodes, levelOffsets;
+			computeNodeLevels(nodes, levelOffsets);
+			m_numTreeLevels = (uint)levelOffsets.size() - 1;
+			vanEmdeBoasOrder(m_hierarchy.data(), m_hierarchyParents.data(), 0, m_numTreeLevels, order);
+			break; }
+		case NodeLayout::CLUSTERED: {
+			const uint CLUSTER_SIZE = 32;
+			// Each cluster starts at an already placed node and adds the children
+			// of its nodes in breadth first order, all siblings at once.
+			order.push_back(0);
+			stack.push_back(0);
+			std::vector<uint32> queue, children;
+			while(!stack.empty())
+			{
+				queue.clear();
+				queue.push_back(stack.back());
+				stack.pop_back();
+				uint count = 0;
+				std::vector<uint32> nextRoots;
+				for(size_t q = 0; q < queue.size(); ++q)
+				{
+					uint32 node = queue[q];
+					uint32 child = m_hierarchy[node].firstChild;
+					if(child & 0x80000000) continue;
+					children.clear();
+					do {
+						children.push_back(child);
+						child = m_hierarchy[child].escape;
+					} while(m_hierarchyParents[child] == node && child != 0);
+					if(count + children.size() <= CLUSTER_SIZE)
+					{
+						order.insert(order.end(), children.begin(), children.end());
+						queue.insert(queue.end(), children.begin(), children.end());
+						count += (uint)children.size();
+					} else nextRoots.push_back(node);
+				}
+				// Process the clusters below in left to right order.
+				stack.insert(stack.end(), nextRoots.rbegin(), nextRoots.rend());
+			}
+			break; }
+		}
+		if(order.size() != numNodes) {
+			sendMessage(MessageType::ERROR, "Reordering found ", order.size(), " of ", numNodes, " nodes. The hierarchy is invalid!");
+			return;
+		}
+
+		std::vector<uint32> newIndex(numNodes);
+		for(uint32 i = 0; i < numNodes; ++i)
+			newIndex[order[i]] = i;
+		std::vector<Node> hierarchy(numNodes);
+		std::vector<uint32> parents(numNodes);
+#pragma omp parallel for schedule(static)
+		for(int i = 0; i < int(numNodes); ++i)
+		{
+			const Node& node = m_hierarchy[order[i]];
+			hierarchy[i].firstChild = (node.firstChild & 0x80000000) ? node.firstChild : newIndex[node.firstChild];
+			hierarchy[i].escape = newIndex[node.escape];
+			parents[i] = newIndex[m_hierarchyParents[order[i]]];
+		}
+		m_hierarchy.swap(hierarchy);
+		m_hierarchyParents.swap(parents);
+		m_vertexLeafOffsets.clear();
+		m_vertexLeafNodes.clear();
+		permute(m_aaBoxes, order);
+		permute(m_oBoxes, order);
+		permute(m_spheres, order);
+		permute(m_nodeNDFs, order);
+	}
+
+	void Chunk::optimizeHierarchy(uint _iterations)
+	{
+		if(!(m_properties & Property::HIERARCHY) || m_hierarchy.empty()) {
+			sendMessage(MessageType::ERROR, "Cannot optimize a hierarchy which does not exist!");
+			return;
+		}
+		uint32 numNodes = (uint32)m_hierarchy.size();
+
+		// Convert to the explicit binary tree and compute all boxes and costs.
+		std::vector<OptNode> nodes(numNodes);
+		for(uint32 i = 0; i < numNodes; ++i)
+		{
+			uint32 child = m_hierarchy[i].firstChild;
+			nodes[i].parent = i == 0 ? 0xffffffff : m_hierarchyParents[i];
+			if(child & 0x80000000)
+			{
+				nodes[i].left = nodes[i].right = 0xffffffff;
+				continue;
+			}
+			nodes[i].left = child;
+			nodes[i].right = m_hierarchy[child].escape;
+			if(m_hierarchyParents[nodes[i].right] != i || nodes[i].right == 0
+				|| (m_hierarchy[nodes[i].right].escape != 0 && m_hierarchyParents[m_hierarchy[nodes[i].right].escape] == i)) {
+				sendMessage(MessageType::ERROR, "Hierarchy optimization requires a binary tree!");
+				return;
+			}
+		}
+		std::vector<uint32> order, levelOffsets;
+		computeLevels(nodes, order, levelOffsets);
+		for(int level = int(levelOffsets.size()) - 2; level >= 0; --level)
+		{
+#pragma omp parallel for schedule(dynamic, 256)
+			for(int i = int(levelOffsets[level]); i < int(levelOffsets[level + 1]); ++i)
+			{
+				OptNode& node = nodes[order[i]];
+				if(node.left == 0xffffffff)
+				{
+					uint32 leafIdx = m_hierarchy[order[i]].firstChild & 0x7fffffff;
+					uint numTriangles = 1;
+					node.box = Box(m_positions[m_hierarchyLeaves[leafIdx].x], m_positions[m_hierarchyLeaves[leafIdx].y], m_positions[m_hierarchyLeaves[leafIdx].z]);
+					while(m_hierarchyLeaves[leafIdx].w & 0x80000000)
+					{
+						++leafIdx; ++numTriangles;
+						node.box = Box(node.box, Box(m_positions[m_hierarchyLeaves[leafIdx].x], m_positions[m_hierarchyLeaves[leafIdx].y], m_positions[m_hierarchyLeaves[leafIdx].z]));
+					}
+					node.cost = TRIANGLE_COST * numTriangles * surface(node.box);
+				} else {
+					node.box = Box(nodes[node.left].box, nodes[node.right].box);
+					node.cost = INNER_NODE_COST * surface(node.box) + nodes[node.left].cost + nodes[node.right].cost;
+				}
+			}
+		}
+		float initialCost = nodes[0].cost;
+
+		// Each iteration is a bottom-up sweep which tries to restructure the
+		// treelet of each inner node. Treelets of the same level are disjoint.
+		for(uint it = 0; it < _iterations; ++it)
+		{
+			if(it > 0) computeLevels(nodes, order, levelOffsets);
+			int numChanged = 0;
+			for(int level = int(levelOffsets.size()) - 2; level >= 0; --level)
+			{
+#pragma omp parallel for schedule(dynamic, 64) reduction(+:numChanged)
+				for(int i = int(levelOffsets[level]); i < int(levelOffsets[level + 1]); ++i)
+				{
+					OptNode& node = nodes[order[i]];
+					if(node.left == 0xffffffff) continue;
+					// The subtrees may have changed.
+					node.cost = INNER_NODE_COST * surface(node.box) + nodes[node.left].cost + nodes[node.right].cost;
+					if(restructureTreelet(nodes, order[i]))
+						++numChanged;
+				}
+			}
+			if(numChanged == 0) break;
+		}
+
+		// Write the tree in preorder, such that the escape pointers are valid.
+		// The new index of the right child follows from the size of the left subtree.
+		computeLevels(nodes, order, levelOffsets);
+		std::vector<uint32> subtreeSize(numNodes, 1);
+		for(int i = numNodes - 1; i >= 0; --i)
+			if(nodes[order[i]].left != 0xffffffff)
+				subtreeSize[order[i]] = 1 + subtreeSize[nodes[order[i]].left] + subtreeSize[nodes[order[i]].right];
+		std::vector<uint32> newIndex(numNodes);
+		std::vector<Node> hierarchy(numNodes);
+		std::vector<uint32> parents(numNodes);
+		m_aaBoxes.resize(numNodes);
+		newIndex[0] = 0;
+		hierarchy[0].escape = 0;
+		parents[0] = 0;
+		for(uint32 i = 0; i < numNodes; ++i)
+		{
+			uint32 old = order[i];
+			uint32 idx = newIndex[old];
+			const OptNode& node = nodes[old];
+			m_aaBoxes[idx] = node.box;
+			if(node.left == 0xffffffff)
+			{
+				hierarchy[idx].firstChild = m_hierarchy[old].firstChild;
+				continue;
+			}
+			uint32 l = idx + 1;
+			uint32 r = idx + 1 + subtreeSize[node.left];
+			newIndex[node.left] = l;
+			newIndex[node.right] = r;
+			hierarchy[idx].firstChild = l;
+			hierarchy[l].escape = r;
+			hierarchy[r].escape = hierarchy[idx].escape;
+			parents[l] = parents[r] = idx;
+		}
+		m_hierarchy.swap(hierarchy);
+		m_hierarchyParents.swap(parents);
+		m_numTreeLevels = (uint)levelOffsets.size() - 1;
+
+		// All other per node data is invalid now.
+		m_oBoxes.clear();
+		m_spheres.clear();
+		m_nodeNDFs.clear();
+		m_compressedNodes.clear();
+		m_properties = Property::Val((m_properties | Property::AABOX_BVH)
+			& ~(Property::OBOX_BVH | Property::SPHERE_BVH | Property::NDF_SGGX | Property::COMPRESSED_BVH));
+		m_referenceSAHCost = 0.0f;
+		m_refitSAHSum = -1.0;
+		m_vertexLeafOffsets.clear();
+		m_vertexLeafNodes.clear();
+
+		sendMessage(MessageType::INFO, "Optimized hierarchy: SAH cost ", initialCost / surface(nodes[0].box),
+			" -> ", nodes[0].cost / surface(nodes[0].box));
+	}
+
+} // namespace bim
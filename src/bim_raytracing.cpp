@@ -0,0 +1,697 @@
+#include "bim/bim.hpp"
+#include "bim/log.hpp"
+#include "bim_simd.hpp"
+#include <algorithm>
+
+using namespace ei;
+
+namespace bim {
+
+	// Ray data which is reused for all box and triangle tests.
+	struct TraversalRay
+	{
+		Float4 origin;			// xyz = origin, w = 0
+		Float4 invDirection;	// xyz = 1/direction, w = 1
+		Vec3x4 o;				// Broadcasted origin for 4-wide triangle tests
+		Vec3x4 d;				// Broadcasted direction
+
+		TraversalRay(const Ray& _ray) :
+			origin(_ray.origin.x, _ray.origin.y, _ray.origin.z, 0.0f),
+			invDirection(1.0f / _ray.direction.x, 1.0f / _ray.direction.y, 1.0f / _ray.direction.z, 1.0f),
+			o(_ray.origin),
+			d(_ray.direction)
+		{}
+	};
+
+	// Slab test with all three axes in parallel. The fourth lane carries the
+	// ray interval [0, _maxDistance], so the horizontal min/max directly clip
+	// the box interval against it.
+	static bool intersectBox(const TraversalRay& _ray, const Box& _box, float _maxDistance)
+	{
+		Float4 t0 = (Float4(_box.min.x, _box.min.y, _box.min.z, 0.0f) - _ray.origin) * _ray.invDirection;
+		Float4 t1 = (Float4(_box.max.x, _box.max.y, _box.max.z, _maxDistance) - _ray.origin) * _ray.invDirection;
+		return min(t0, t1).hmax() <= max(t0, t1).hmin();
+	}
+
+	// Geometry of the leaves. If precomputed triangles (LEAF_TRIANGLES) exist
+	// they replace the gathers through the vertex indices.
+	struct LeafData
+	{
+		const Vec3* positions;
+		const UVec4* leaves;
+		const TriangleBlock* triangles;
+	};
+
+	static LeafData getLeafData(const Chunk& _chunk)
+	{
+		LeafData data;
+		data.positions = _chunk.getPositions();
+		data.leaves = _chunk.getLeafNodes();
+		data.triangles = (_chunk.getProperties() & Property::LEAF_TRIANGLES) ? _chunk.getLeafTriangles() : nullptr;
+		return data;
+	}
+
+	// Möller-Trumbore for up to four triangles of a leaf at once. Starts at
+	// _leafIdx and continues while the 'same leaf' flag is set.
+	// Returns true if any triangle got a hit closer than _hit.distance. With
+	// ANY_HIT the test stops at the first such triangle.
+	template<bool ANY_HIT>
+	static bool intersectLeaf(const TraversalRay& _ray, const LeafData& _data, uint32 _leafIdx, Hit& _hit)
+	{
+		bool found = false;
+		bool more = true;
+		while(more)
+		{
+			Vec3x4 v0, e1, e2;
+			uint32 idx[4];
+			int lanes = 0;		// Mask of the lanes which belong to the leaf
+			if(_data.triangles)
+			{
+				// Load the block of the current entry and use all lanes up to the
+				// end of the leaf or block.
+				const TriangleBlock& block = _data.triangles[_leafIdx / 4];
+				uint32 first = _leafIdx & ~3u;
+				do {
+					lanes |= 1 << (_leafIdx & 3);
+					more = (_data.leaves[_leafIdx].w & 0x80000000) != 0;
+					++_leafIdx;
+				} while(more && (_leafIdx & 3));
+				for(int i = 0; i < 4; ++i) idx[i] = first + i;
+				v0 = Vec3x4(Float4::load(block.v0[0]), Float4::load(block.v0[1]), Float4::load(block.v0[2]));
+				e1 = Vec3x4(Float4::load(block.e1[0]), Float4::load(block.e1[1]), Float4::load(block.e1[2]));
+				e2 = Vec3x4(Float4::load(block.e2[0]), Float4::load(block.e2[1]), Float4::load(block.e2[2]));
+			} else {
+				// Gather the triangles in SoA layout. Unused lanes repeat the last
+				// triangle, which cannot change the result.
+				float v[9][4];
+				int num = 0;
+				do {
+					const UVec4& tri = _data.leaves[_leafIdx];
+					const Vec3& p0 = _data.positions[tri.x];
+					const Vec3& p1 = _data.positions[tri.y];
+					const Vec3& p2 = _data.positions[tri.z];
+					for(int c = 0; c < 3; ++c)
+					{
+						v[c][num] = p0[c];
+						v[3+c][num] = p1[c];
+						v[6+c][num] = p2[c];
+					}
+					idx[num++] = _leafIdx;
+					more = (tri.w & 0x80000000) != 0;
+					++_leafIdx;
+				} while(more && num < 4);
+				lanes = (1 << num) - 1;
+				for(int i = num; i < 4; ++i)
+				{
+					for(int c = 0; c < 9; ++c)
+						v[c][i] = v[c][num-1];
+					idx[i] = idx[num-1];
+				}
+				v0 = Vec3x4(Float4::load(v[0]), Float4::load(v[1]), Float4::load(v[2]));
+				e1 = Vec3x4(Float4::load(v[3]), Float4::load(v[4]), Float4::load(v[5])) - v0;
+				e2 = Vec3x4(Float4::load(v[6]), Float4::load(v[7]), Float4::load(v[8])) - v0;
+			}
+
+			Vec3x4 p = cross(_ray.d, e2);
+			Float4 det = dot(e1, p);
+			Float4 invDet = Float4(1.0f) / det;
+			Vec3x4 t = _ray.o - v0;
+			Float4 u = dot(t, p) * invDet;
+			Vec3x4 q = cross(t, e1);
+			Float4 w = dot(_ray.d, q) * invDet;
+			Float4 dist = dot(e2, q) * invDet;
+			// All comparisons with NaN (det == 0) fail.
+			Float4 valid = (det != Float4(0.0f)) & (u >= Float4(0.0f)) & (w >= Float4(0.0f))
+				& (u + w <= Float4(1.0f)) & (dist > Float4(0.0f)) & (dist < Float4(_hit.distance));
+			int mask = valid.mask() & lanes;
+			if(mask)
+			{
+				found = true;
+				for(int i = 0; i < 4; ++i)
+				{
+					if((mask & (1 << i)) && dist[i] < _hit.distance)
+					{
+						_hit.distance = dist[i];
+						_hit.leafTriangle = idx[i];
+						_hit.barycentric = Vec2(u[i], w[i]);
+						if(ANY_HIT) return true;
+					}
+				}
+			}
+		}
+		return found;
+	}
+
+	// Stackless traversal in preorder: descend into a node if its box is hit,
+	// otherwise (and after a leaf) continue with the escape pointer.
+	template<bool ANY_HIT>
+	static bool traverseEscape(const TraversalRay& _ray, const LeafData& _data, const Node* _hierarchy, const Box* _aaBoxes, Hit& _hit)
+	{
+		bool found = false;
+		uint32 node = 0;
+		do {
+			if(intersectBox(_ray, _aaBoxes[node], _hit.distance))
+			{
+				uint32 child = _hierarchy[node].firstChild;
+				if(child & 0x80000000)
+				{
+					if(intersectLeaf<ANY_HIT>(_ray, _data, child & 0x7fffffff, _hit))
+					{
+						found = true;
+						if(ANY_HIT) return true;
+					}
+					node = _hierarchy[node].escape;
+				} else node = child;
+			} else node = _hierarchy[node].escape;
+		} while(node != 0);
+		return found;
+	}
+
+	// Traversal of the compressed hierarchy. This requires a stack, but allows
+	// to visit the closer child first.
+	template<bool ANY_HIT>
+	static bool traverseCompressed(const TraversalRay& _ray, const LeafData& _data, const CompressedNode* _nodes, uint _numTreeLevels, Hit& _hit)
+	{
+		bool found = false;
+		// The depth is bounded by the number of levels. Only one child per level
+		// can be on the stack. The level count may come from a file, so the
+		// stack still grows if it is too small.
+		uint32 localStack[64];
+		std::vector<uint32> largeStack;
+		uint32* stack = localStack;
+		int capacity = 64;
+		if(_numTreeLevels >= 64) {
+			largeStack.resize(_numTreeLevels + 1);
+			stack = largeStack.data();
+			capacity = int(largeStack.size());
+		}
+		int top = 0;
+		stack[top++] = 0;
+		while(top > 0)
+		{
+			const CompressedNode& node = _nodes[stack[--top]];
+			float entry[2];
+			bool hit[2];
+			for(int c = 0; c < 2; ++c)
+			{
+				hit[c] = false;
+				if(node.child[c] == 0xffffffff) continue;
+				Box box = decodeChildBox(node, c);
+				Float4 t0 = (Float4(box.min.x, box.min.y, box.min.z, 0.0f) - _ray.origin) * _ray.invDirection;
+				Float4 t1 = (Float4(box.max.x, box.max.y, box.max.z, _hit.distance) - _ray.origin) * _ray.invDirection;
+				entry[c] = min(t0, t1).hmax();
+				hit[c] = entry[c] <= max(t0, t1).hmin();
+			}
+			// Push the far child first, so the closer one is popped next.
+			// Leaves are tested immediately.
+			int first = (hit[0] && hit[1] && entry[1] < entry[0]) ? 1 : 0;
+			for(int i = 1; i >= 0; --i)
+			{
+				int c = i == 0 ? first : 1 - first;
+				if(!hit[c]) continue;
+				if(node.child[c] & 0x80000000)
+				{
+					if(intersectLeaf<ANY_HIT>(_ray, _data, node.child[c] & 0x7fffffff, _hit))
+					{
+						found = true;
+						if(ANY_HIT) return true;
+					}
+				} else {
+					if(top == capacity)
+					{
+						if(stack == localStack)
+							largeStack.assign(localStack, localStack + top);
+						largeStack.resize(capacity * 2);
+						stack = largeStack.data();
+						capacity = int(largeStack.size());
+					}
+					stack[top++] = node.child[c];
+				}
+			}
+		}
+		return found;
+	}
+
+	template<bool ANY_HIT>
+	static bool traverse(const Chunk& _chunk, Property::Val _properties, const Ray& _ray, Hit& _hit)
+	{
+		TraversalRay ray(_ray);
+		LeafData data = getLeafData(_chunk);
+		if(_properties & Property::AABOX_BVH)
+			return traverseEscape<ANY_HIT>(ray, data, _chunk.getHierarchy(), _chunk.getHierarchyAABoxes(), _hit);
+		if(_properties & Property::COMPRESSED_BVH)
+			return traverseCompressed<ANY_HIT>(ray, data, _chunk.getCompressedHierarchy(), _chunk.getNumTreeLevels(), _hit);
+		sendMessage(MessageType::ERROR, "Ray tracing requires a hierarchy with AABOX_BVH or COMPRESSED_BVH!");
+		return false;
+	}
+
+	bool Chunk::intersect(const Ray& _ray, Hit& _hit, float _maxDistance) const
+	{
+		_hit.distance = _maxDistance;
+		_hit.leafTriangle = 0xffffffff;
+		return traverse<false>(*this, m_properties, _ray, _hit);
+	}
+
+	bool Chunk::occluded(const Ray& _ray, float _maxDistance) const
+	{
+		Hit hit;
+		hit.distance = _maxDistance;
+		hit.leafTriangle = 0xffffffff;
+		return traverse<true>(*this, m_properties, _ray, hit);
+	}
+
+	void Chunk::intersect(const Ray* _rays, Hit* _hits, uint _numRays, float _maxDistance) const
+	{
+		if(!(m_properties & (Property::AABOX_BVH | Property::COMPRESSED_BVH))) {
+			sendMessage(MessageType::ERROR, "Ray tracing requires a hierarchy with AABOX_BVH or COMPRESSED_BVH!");
+			return;
+		}
+		// Small chunks of rays, because the costs per ray vary a lot.
+#pragma omp parallel for schedule(dynamic, 64)
+		for(int i = 0; i < int(_numRays); ++i)
+			intersect(_rays[i], _hits[i], _maxDistance);
+	}
+
+
+	// Up to RAY_PACKET_SIZE rays in groups of four (SoA).
+	struct RayPacket
+	{
+		static const int MAX_GROUPS = Chunk::RAY_PACKET_SIZE / 4;
+		Vec3x4 o[MAX_GROUPS];
+		Vec3x4 d[MAX_GROUPS];
+		Vec3x4 invD[MAX_GROUPS];
+		// Per ray results. tmax is the current closest distance.
+		float tmax[Chunk::RAY_PACKET_SIZE];
+		float u[Chunk::RAY_PACKET_SIZE];
+		float v[Chunk::RAY_PACKET_SIZE];
+		uint32 leafTriangle[Chunk::RAY_PACKET_SIZE];
+		int alive[MAX_GROUPS];	// Lane bits of rays which still need to traverse
+		int numGroups;
+		// Bounds of origins and inverse directions (xyz; w = 0, 0, 1, 1) for the
+		// interval test. Only valid if 'coherent' is set.
+		bool coherent;
+		Float4 negative;		// Mask of negative directions
+		Float4 oLo, oHi;
+		Float4 iLo, iHi;
+
+		RayPacket(const Ray* _rays, const float* _maxDistances, uint _num)
+		{
+			numGroups = (_num + 3) / 4;
+			Vec3 oMin = _rays[0].origin, oMax = _rays[0].origin;
+			Vec3 iMin(1e30f), iMax(-1e30f);
+			int signs[3] = {0, 0, 0};
+			coherent = true;
+			for(int g = 0; g < numGroups; ++g)
+			{
+				float c[9][4];
+				alive[g] = 0;
+				for(int i = 0; i < 4; ++i)
+				{
+					// Unused lanes copy the first ray, but are never alive.
+					uint r = g * 4 + i < _num ? g * 4 + i : 0;
+					const Ray& ray = _rays[r];
+					Vec3 inv(1.0f / ray.direction.x, 1.0f / ray.direction.y, 1.0f / ray.direction.z);
+					for(int k = 0; k < 3; ++k)
+					{
+						c[k][i] = ray.origin[k];
+						c[3+k][i] = ray.direction[k];
+						c[6+k][i] = inv[k];
+						// The interval arithmetic needs finite inverse directions with equal signs.
+						int sign = ray.direction[k] > 0.0f ? 1 : (ray.direction[k] < 0.0f ? -1 : 0);
+						if(sign == 0 || (signs[k] != 0 && signs[k] != sign) || !(ei::abs(inv[k]) < 1e30f))
+							coherent = false;
+						signs[k] = sign;
+					}
+					oMin = ei::min(oMin, ray.origin);
+					oMax = ei::max(oMax, ray.origin);
+					iMin = ei::min(iMin, inv);
+					iMax = ei::max(iMax, inv);
+					if(g * 4 + i < _num) alive[g] |= 1 << i;
+					tmax[g * 4 + i] = _maxDistances[r];
+					leafTriangle[g * 4 + i] = 0xffffffff;
+					u[g * 4 + i] = v[g * 4 + i] = 0.0f;
+				}
+				o[g] = Vec3x4(Float4::load(c[0]), Float4::load(c[1]), Float4::load(c[2]));
+				d[g] = Vec3x4(Float4::load(c[3]), Float4::load(c[4]), Float4::load(c[5]));
+				invD[g] = Vec3x4(Float4::load(c[6]), Float4::load(c[7]), Float4::load(c[8]));
+			}
+			negative = Float4(0.0f) > Float4(float(signs[0]), float(signs[1]), float(signs[2]), 0.0f);
+			oLo = Float4(oMin.x, oMin.y, oMin.z, 0.0f);
+			oHi = Float4(oMax.x, oMax.y, oMax.z, 0.0f);
+			iLo = Float4(iMin.x, iMin.y, iMin.z, 1.0f);
+			iHi = Float4(iMax.x, iMax.y, iMax.z, 1.0f);
+		}
+	};
+
+	// Compute a mask of rays per group which hit the box. Returns false if
+	// no ray hits.
+	static bool intersectBoxPacket(const RayPacket& _packet, const Box& _box, int* _masks)
+	{
+		float maxDistance = 0.0f;
+		for(int g = 0; g < _packet.numGroups; ++g)
+			maxDistance = ei::max(maxDistance, Float4::load(_packet.tmax + g * 4).hmax());
+		if(_packet.coherent)
+		{
+			// Interval arithmetic over all origins and directions: a lower bound of
+			// the entry and an upper bound of the exit distance of all rays.
+			Float4 bmin(_box.min.x, _box.min.y, _box.min.z, 0.0f);
+			Float4 bmax(_box.max.x, _box.max.y, _box.max.z, maxDistance);
+			Float4 nearPlane = select(_packet.negative, bmax, bmin);
+			Float4 farPlane = select(_packet.negative, bmin, bmax);
+			Float4 a = nearPlane - _packet.oHi;
+			Float4 b = nearPlane - _packet.oLo;
+			Float4 entryLo = min(min(a * _packet.iLo, a * _packet.iHi), min(b * _packet.iLo, b * _packet.iHi));
+			a = farPlane - _packet.oHi;
+			b = farPlane - _packet.oLo;
+			Float4 exitHi = max(max(a * _packet.iLo, a * _packet.iHi), max(b * _packet.iLo, b * _packet.iHi));
+			if(entryLo.hmax() > exitHi.hmin())
+				return false;
+		}
+
+		// Slab test for four rays at once.
+		Float4 bmin[3] = {Float4(_box.min.x), Float4(_box.min.y), Float4(_box.min.z)};
+		Float4 bmax[3] = {Float4(_box.max.x), Float4(_box.max.y), Float4(_box.max.z)};
+		int any = 0;
+		for(int g = 0; g < _packet.numGroups; ++g)
+		{
+			_masks[g] = 0;
+			if(!_packet.alive[g]) continue;
+			const Vec3x4& o = _packet.o[g];
+			const Vec3x4& invD = _packet.invD[g];
+			Float4 t0 = (bmin[0] - o.x) * invD.x, t1 = (bmax[0] - o.x) * invD.x;
+			Float4 entry = max(min(t0, t1), Float4(0.0f));
+			Float4 exit = min(max(t0, t1), Float4::load(_packet.tmax + g * 4));
+			t0 = (bmin[1] - o.y) * invD.y; t1 = (bmax[1] - o.y) * invD.y;
+			entry = max(min(t0, t1), entry);
+			exit = min(max(t0, t1), exit);
+			t0 = (bmin[2] - o.z) * invD.z; t1 = (bmax[2] - o.z) * invD.z;
+			entry = max(min(t0, t1), entry);
+			exit = min(max(t0, t1), exit);
+			_masks[g] = (entry <= exit).mask() & _packet.alive[g];
+			any |= _masks[g];
+		}
+		return any != 0;
+	}
+
+	// Test each triangle of the leaf against the rays in _masks (4 rays at once).
+	template<bool ANY_HIT>
+	static void intersectLeafPacket(RayPacket& _packet, const int* _masks, const LeafData& _data, uint32 _leafIdx)
+	{
+		bool more;
+		do {
+			const UVec4& tri = _data.leaves[_leafIdx];
+			Vec3x4 v0, e1, e2;
+			if(_data.triangles)
+			{
+				const TriangleBlock& block = _data.triangles[_leafIdx / 4];
+				uint32 lane = _leafIdx & 3;
+				v0 = Vec3x4(Vec3(block.v0[0][lane], block.v0[1][lane], block.v0[2][lane]));
+				e1 = Vec3x4(Vec3(block.e1[0][lane], block.e1[1][lane], block.e1[2][lane]));
+				e2 = Vec3x4(Vec3(block.e2[0][lane], block.e2[1][lane], block.e2[2][lane]));
+			} else {
+				v0 = Vec3x4(_data.positions[tri.x]);
+				e1 = Vec3x4(_data.positions[tri.y]) - v0;
+				e2 = Vec3x4(_data.positions[tri.z]) - v0;
+			}
+			for(int g = 0; g < _packet.numGroups; ++g)
+			{
+				int active = _masks[g] & _packet.alive[g];
+				if(!active) continue;
+				Vec3x4 p = cross(_packet.d[g], e2);
+				Float4 det = dot(e1, p);
+				Float4 invDet = Float4(1.0f) / det;
+				Vec3x4 t = _packet.o[g] - v0;
+				Float4 u = dot(t, p) * invDet;
+				Vec3x4 q = cross(t, e1);
+				Float4 w = dot(_packet.d[g], q) * invDet;
+				Float4 dist = dot(e2, q) * invDet;
+				Float4 valid = (det != Float4(0.0f)) & (u >= Float4(0.0f)) & (w >= Float4(0.0f))
+					& (u + w <= Float4(1.0f)) & (dist > Float4(0.0f)) & (dist < Float4::load(_packet.tmax + g * 4));
+				int mask = valid.mask() & active;
+				for(int i = 0; i < 4; ++i) if(mask & (1 << i))
+				{
+					_packet.tmax[g * 4 + i] = dist[i];
+					_packet.u[g * 4 + i] = u[i];
+					_packet.v[g * 4 + i] = w[i];
+					_packet.leafTriangle[g * 4 + i] = _leafIdx;
+				}
+				// Rays with any hit are done.
+				if(ANY_HIT) _packet.alive[g] &= ~mask;
+			}
+			more = (tri.w & 0x80000000) != 0;
+			++_leafIdx;
+		} while(more);
+	}
+
+	// All rays of the packet follow the same stackless preorder. A node is
+	// entered if any ray hits its box.
+	template<bool ANY_HIT>
+	static void traversePacket(RayPacket& _packet, const LeafData& _data, const Node* _hierarchy, const Box* _aaBoxes)
+	{
+		int masks[RayPacket::MAX_GROUPS];
+		uint32 node = 0;
+		do {
+			if(intersectBoxPacket(_packet, _aaBoxes[node], masks))
+			{
+				uint32 child = _hierarchy[node].firstChild;
+				if(child & 0x80000000)
+				{
+					intersectLeafPacket<ANY_HIT>(_packet, masks, _data, child & 0x7fffffff);
+					if(ANY_HIT)
+					{
+						int alive = 0;
+						for(int g = 0; g < _packet.numGroups; ++g)
+							alive |= _packet.alive[g];
+						if(!alive) return;
+					}
+					node = _hierarchy[node].escape;
+				} else node = child;
+			} else node = _hierarchy[node].escape;
+		} while(node != 0);
+	}
+
+	void Chunk::intersectPacket(const Ray* _rays, Hit* _hits, uint _numRays, float _maxDistance) const
+	{
+		if(!(m_properties & Property::AABOX_BVH)) {
+			sendMessage(MessageType::ERROR, "Packet tracing requires a hierarchy with AABOX_BVH!");
+			return;
+		}
+		LeafData data = getLeafData(*this);
+		float maxDistances[RAY_PACKET_SIZE];
+		for(uint i = 0; i < RAY_PACKET_SIZE; ++i)
+			maxDistances[i] = _maxDistance;
+		for(uint first = 0; first < _numRays; first += RAY_PACKET_SIZE)
+		{
+			uint num = ei::min(RAY_PACKET_SIZE, _numRays - first);
+			RayPacket packet(_rays + first, maxDistances, num);
+			traversePacket<false>(packet, data, m_hierarchy.data(), m_aaBoxes.data());
+			for(uint i = 0; i < num; ++i)
+			{
+				_hits[first + i].distance = packet.tmax[i];
+				_hits[first + i].leafTriangle = packet.leafTriangle[i];
+				_hits[first + i].barycentric = Vec2(packet.u[i], packet.v[i]);
+			}
+		}
+	}
+
+	void Chunk::occludedPacket(const Ray* _rays, const float* _maxDistances, bool* _occluded, uint _numRays) const
+	{
+		if(!(m_properties & Property::AABOX_BVH)) {
+			sendMessage(MessageType::ERROR, "Packet tracing requires a hierarchy with AABOX_BVH!");
+			return;
+		}
+		LeafData data = getLeafData(*this);
+		for(uint first = 0; first < _numRays; first += RAY_PACKET_SIZE)
+		{
+			uint num = ei::min(RAY_PACKET_SIZE, _numRays - first);
+			RayPacket packet(_rays + first, _maxDistances + first, num);
+			traversePacket<true>(packet, data, m_hierarchy.data(), m_aaBoxes.data());
+			for(uint i = 0; i < num; ++i)
+				_occluded[first + i] = packet.leafTriangle[i] != 0xffffffff;
+		}
+	}
+
+	// Traverse the tree with a stream of rays. The active rays of a node are
+	// always the first _numRays entries of _active. Partitioning only permutes
+	// within this prefix, so the pending siblings keep their sets.
+	static void traverseStream(const TraversalRay* _rays, Hit* _hits, uint32* _active, uint32 _numRays, const LeafData& _data, const Node* _hierarchy, const Box* _aaBoxes, uint _numTreeLevels)
+	{
+		struct Task { uint32 node; uint32 numRays; };
+		// The level count is only a hint (it may come from a file), the stack
+		// grows if necessary.
+		std::vector<Task> stack;
+		stack.reserve(_numTreeLevels + 1);
+		stack.push_back({0, _numRays});
+		while(!stack.empty())
+		{
+			Task task = stack.back();
+			stack.pop_back();
+			// Move all rays which hit the node to the front.
+			uint32 numHits = 0;
+			for(uint32 i = 0; i < task.numRays; ++i)
+			{
+				uint32 r = _active[i];
+				if(intersectBox(_rays[r], _aaBoxes[task.node], _hits[r].distance))
+					std::swap(_active[i], _active[numHits++]);
+			}
+			if(numHits == 0) continue;
+
+			uint32 child = _hierarchy[task.node].firstChild;
+			if(child & 0x80000000)
+			{
+				for(uint32 i = 0; i < numHits; ++i)
+					intersectLeaf<false>(_rays[_active[i]], _data, child & 0x7fffffff, _hits[_active[i]]);
+			} else {
+				// Right child (escape of the left one) first, so the left one is
+				// processed next.
+				stack.push_back({_hierarchy[child].escape, numHits});
+				stack.push_back({child, numHits});
+			}
+		}
+	}
+
+	void Chunk::intersectStream(const Ray* _rays, Hit* _hits, uint _numRays, float _maxDistance) const
+	{
+		if(!(m_properties & Property::AABOX_BVH)) {
+			sendMessage(MessageType::ERROR, "Stream tracing requires a hierarchy with AABOX_BVH!");
+			return;
+		}
+		// Streams must be large enough to share node visits, but there must be
+		// enough of them to use all threads.
+		const int STREAM_SIZE = 4096;
+		LeafData data = getLeafData(*this);
+		int numStreams = int(_numRays + STREAM_SIZE - 1) / STREAM_SIZE;
+#pragma omp parallel for schedule(dynamic, 1)
+		for(int s = 0; s < numStreams; ++s)
+		{
+			uint32 first = s * STREAM_SIZE;
+			uint32 num = ei::min(uint32(STREAM_SIZE), _numRays - first);
+			std::vector<TraversalRay> rays;
+			rays.reserve(num);
+			std::vector<uint32> active(num);
+			for(uint32 i = 0; i < num; ++i)
+			{
+				rays.push_back(TraversalRay(_rays[first + i]));
+				active[i] = i;
+				_hits[first + i].distance = _maxDistance;
+				_hits[first + i].leafTriangle = 0xffffffff;
+			}
+			traverseStream(rays.data(), _hits + first, active.data(), num, data, m_hierarchy.data(), m_aaBoxes.data(), m_numTreeLevels);
+		}
+	}
+
+
+	// Median split build over chunk centers. The tree of n leaves has 2n-1
+	// nodes, so the escape pointers are known while building in preorder.
+	static void buildChunkHierarchyRec(const Chunk* _chunks, uint32* _indices, uint32 _num, uint32 _escape, std::vector<Node>& _hierarchy, std::vector<Box>& _boxes)
+	{
+		uint32 nodeIdx = (uint32)_hierarchy.size();
+		Box box = _chunks[_indices[0]].getBoundingBox();
+		for(uint32 i = 1; i < _num; ++i)
+			box = Box(box, _chunks[_indices[i]].getBoundingBox());
+		_hierarchy.push_back({0, _escape});
+		_boxes.push_back(box);
+		if(_num == 1)
+		{
+			_hierarchy[nodeIdx].firstChild = 0x80000000 | _indices[0];
+			return;
+		}
+		// Split at the median of the largest dimension
+		int dim = 0;
+		Vec3 size = box.max - box.min;
+		if(size.y > size[dim]) dim = 1;
+		if(size.z > size[dim]) dim = 2;
+		uint32 numLeft = _num / 2;
+		std::nth_element(_indices, _indices + numLeft, _indices + _num, [&](uint32 _a, uint32 _b) {
+			const Box& a = _chunks[_a].getBoundingBox();
+			const Box& b = _chunks[_b].getBoundingBox();
+			return a.min[dim] + a.max[dim] < b.min[dim] + b.max[dim];
+		});
+		uint32 rightIdx = nodeIdx + 1 + 2 * numLeft - 1;
+		_hierarchy[nodeIdx].firstChild = nodeIdx + 1;
+		buildChunkHierarchyRec(_chunks, _indices, numLeft, rightIdx, _hierarchy, _boxes);
+		buildChunkHierarchyRec(_chunks, _indices + numLeft, _num - numLeft, _escape, _hierarchy, _boxes);
+	}
+
+	void BinaryModel::buildChunkHierarchy()
+	{
+		m_chunkHierarchy.clear();
+		m_chunkHierarchyBoxes.clear();
+		m_chunkHierarchyDirty = false;
+		// Skip chunks which are known to be empty.
+		std::vector<uint32> indices;
+		for(uint32 i = 0; i < (uint32)m_chunks.size(); ++i)
+		{
+			bool empty = m_chunkStates[i] == ChunkState::LOADED ? m_chunks[i].getNumTriangles() == 0
+				: m_chunks[i].m_address == 0;
+			if(!empty) indices.push_back(i);
+		}
+		if(indices.empty()) return;
+		m_chunkHierarchy.reserve(indices.size() * 2 - 1);
+		m_chunkHierarchyBoxes.reserve(indices.size() * 2 - 1);
+		buildChunkHierarchyRec(m_chunks.data(), indices.data(), (uint32)indices.size(), 0, m_chunkHierarchy, m_chunkHierarchyBoxes);
+	}
+
+	template<typename F>
+	void BinaryModel::traverseChunks(const Ray& _ray, float _maxDistance, F _chunkCallback) const
+	{
+		if(m_chunkHierarchyDirty) {
+			sendMessage(MessageType::ERROR, "The chunk hierarchy is outdated. Call buildChunkHierarchy() after editing chunks!");
+			return;
+		}
+		if(m_chunkHierarchy.empty())
+			return;
+		TraversalRay ray(_ray);
+		uint32 node = 0;
+		do {
+			if(intersectBox(ray, m_chunkHierarchyBoxes[node], _maxDistance))
+			{
+				uint32 child = m_chunkHierarchy[node].firstChild;
+				if(child & 0x80000000)
+				{
+					uint32 chunkIdx = child & 0x7fffffff;
+					IVec3 chunkPos(chunkIdx % m_numChunks.x, (chunkIdx / m_numChunks.x) % m_numChunks.y, chunkIdx / (m_numChunks.x * m_numChunks.y));
+					if(m_chunkStates[chunkIdx] != ChunkState::LOADED)
+					{
+						if(m_chunkMissPolicy == ChunkMissPolicy::REQUEST)
+							requestChunk(chunkIdx);
+					} else if(m_chunks[chunkIdx].getNumTriangles() > 0)
+						_maxDistance = _chunkCallback(chunkIdx, chunkPos, _maxDistance);
+					// A negative distance terminates the traversal
+					if(_maxDistance < 0.0f) return;
+					node = m_chunkHierarchy[node].escape;
+				} else node = child;
+			} else node = m_chunkHierarchy[node].escape;
+		} while(node != 0);
+	}
+
+	bool BinaryModel::intersect(const Ray& _ray, Hit& _hit, IVec3& _chunkPos, float _maxDistance) const
+	{
+		_hit.distance = _maxDistance;
+		_hit.leafTriangle = 0xffffffff;
+		bool found = false;
+		traverseChunks(_ray, _maxDistance, [&](uint32 _chunkIdx, const IVec3& _pos, float _currentMax) {
+			Hit hit;
+			if(m_chunks[_chunkIdx].intersect(_ray, hit, _currentMax))
+			{
+				_hit = hit;
+				_chunkPos = _pos;
+				found = true;
+				return hit.distance;
+			}
+			return _currentMax;
+		});
+		return found;
+	}
+
+	bool BinaryModel::occluded(const Ray& _ray, float _maxDistance) const
+	{
+		bool found = false;
+		traverseChunks(_ray, _maxDistance, [&](uint32 _chunkIdx, const IVec3&, float _currentMax) {
+			found = m_chunks[_chunkIdx].occluded(_ray, _currentMax);
+			return found ? -1.0f : _currentMax;
+		});
+		return found;
+	}
+
+} // namespace bim
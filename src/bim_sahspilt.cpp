@@ -1,4 +1,5 @@
 ﻿#include "bim/chunk.hpp"
+#include "bim_scratch.hpp"
 #include <memory>
 #include <algorithm>
 
@@ -18,6 +19,8 @@ namespace bim {
 		uint32* sortedIDs;
 		Vec4* centers; // position .xyz and projection in .w
 		Vec2* heuristics; // auxiliary buffer for left/right heuristic pairs
+		uint32 numNodes; // Used part of the preallocated node pool
+		uint32 numLeaves;
 	};
 
 	static float surfaceAreaHeuristic(const Box& _bv, int _num)
@@ -27,9 +30,8 @@ namespace bim {
 
 	static uint32 build( SAHBuildInfo& _in, uint32 _min, uint32 _max )
 	{
-		uint32 nodeIdx = (uint32)_in.hierarchy.size();
-		_in.hierarchy.resize(nodeIdx + 1);
-		_in.parents.resize(nodeIdx + 1);
+		uint32 nodeIdx = _in.numNodes++;
+		eiAssert(nodeIdx < _in.hierarchy.size(), "Node pool is too small!");
 		_in.hierarchy[nodeIdx].firstChild = _in.hierarchy[nodeIdx].escape = _in.parents[nodeIdx] = 0;
 
 		// Create a leaf if less than NUM_PRIMITIVES elements remain.
@@ -38,8 +40,8 @@ namespace bim {
 		if( num <= _in.numTrianglesPerLeaf )
 		{
 			// Allocate a new leaf
-			size_t leafIdx = _in.leaves.size();
-			_in.leaves.resize(_in.leaves.size() + num);
+			size_t leafIdx = _in.numLeaves;
+			_in.numLeaves += num;
 			// Fill it, use a flag in the materials index to signal that there
 			// are more triangles following. If the flag is not set the current
 			// triangle is the last one.
@@ -133,9 +135,10 @@ namespace bim {
 	void Chunk::buildBVH_SAHsplit(uint _maxNumTrianglesPerLeaf)
 	{
 		uint32 n = getNumTriangles();
-		std::unique_ptr<Vec4[]> centers(new Vec4[n]);
-		std::unique_ptr<uint32[]> ids(new uint32[n]);
-		std::unique_ptr<Vec2[]> heuristics(new Vec2[n-1]); // n-1 split positions
+		ScratchArena arena(n * (sizeof(Vec4) + sizeof(uint32) + sizeof(Vec2)) + 3 * 16);
+		Vec4* centers = arena.alloc<Vec4>(n);
+		uint32* ids = arena.alloc<uint32>(n);
+		Vec2* heuristics = arena.alloc<Vec2>(n-1); // n-1 split positions
 		for( uint32 i = 0; i < n; ++i )
 		{
 			ids[i] = i;
@@ -143,13 +146,16 @@ namespace bim {
 			centers[i] = Vec4((m_positions[t.x] + m_positions[t.y] + m_positions[t.z]) / 3.0f, 0.0f);
 		}
 
-		m_hierarchy.reserve(n*2);
-		m_hierarchyParents.reserve(n*2);
-		m_hierarchyLeaves.reserve(n);
+		// Each triangle is referenced once -> at most 2n-1 nodes
+		m_hierarchy.resize(n*2);
+		m_hierarchyParents.resize(n*2);
+		m_hierarchyLeaves.resize(n);
 		SAHBuildInfo input = {m_hierarchy, m_hierarchyParents, m_hierarchyLeaves, m_positions,
 			m_triangles, m_triangleMaterials, _maxNumTrianglesPerLeaf,
-			ids.get(), centers.get(), heuristics.get()};
+			ids, centers, heuristics, 0, 0};
 		build(input, 0, n-1);
+		m_hierarchy.resize(input.numNodes);
+		m_hierarchyParents.resize(input.numNodes);
 	}
 
 } // namespace bim
\ No newline at end of file
@@ -1,5 +1,6 @@
 #define DEBUG
 #include "bim/chunk.hpp"
+#include "bim_scratch.hpp"
 #include <memory>
 #include <algorithm>
 #include "bim/log.hpp"
@@ -30,6 +31,9 @@ namespace bim {
 		uint32* aux; // auxiliary work space 1
 		Bin * bins;
 		float rootSurface;
+		ScratchArena& scratch; // Index sets of spatial splits
+		uint32 numNodes; // Used part of the node pool
+		uint32 numLeaves;
 	};
 
 	const uint NUM_BINS = 256;
@@ -178,12 +182,28 @@ namespace bim {
 	}
 
 
-	static uint32 makeLeaf( SBVBuildInfo& _in, uint32* _triangles, uint32 _num )
+	// Get the next node from the pool. Duplicated references make the final
+	// size unknown, so the pool grows geometrically if necessary.
+	static uint32 allocNode( SBVBuildInfo& _in )
+	{
+		uint32 nodeIdx = _in.numNodes++;
+		if(nodeIdx >= _in.hierarchy.size())
+		{
+			size_t size = std::max<size_t>(16, _in.hierarchy.size() * 2);
+			_in.hierarchy.resize(size);
+			_in.parents.resize(size);
+			_in.aaBoxes.resize(size);
+		}
+		return nodeIdx;
+	}
+
+	static uint32 makeLeaf( SBVBuildInfo& _in, uint32 _nodeIdx, uint32* _triangles, uint32 _num )
 	{
-		uint32 nodeIdx = (uint32)_in.hierarchy.size()-1;
 		// Allocate a new leaf
-		size_t leafIdx = _in.leaves.size();
-		_in.leaves.resize(_in.leaves.size() + _num);
+		size_t leafIdx = _in.numLeaves;
+		_in.numLeaves += _num;
+		if(_in.numLeaves > _in.leaves.size())
+			_in.leaves.resize(std::max<size_t>(_in.numLeaves, _in.leaves.size() * 2));
 		// Fill it, use a flag in the materials index to signal that there
 		// are more triangles following. If the flag is not set the current
 		// triangle is the last one.
@@ -193,24 +213,22 @@ namespace bim {
 		*(trianglesPtr) = UVec4(_in.triangles[_triangles[_num-1]], _in.materials.empty() ? 0 : _in.materials[_triangles[_num-1]]);
 
 		// Let the new node pointing to this leaf
-		_in.hierarchy[nodeIdx].firstChild = 0x80000000 | (uint32)(leafIdx);
+		_in.hierarchy[_nodeIdx].firstChild = 0x80000000 | (uint32)(leafIdx);
 
-		return nodeIdx;
+		return _nodeIdx;
 	}
 
 	static uint32 build( SBVBuildInfo& _in, uint32* _triangles, uint32 _num, const Box& _aab )
 	{
 		eiAssert(_num > 0, "Node without triangles!");
 
-		uint32 nodeIdx = (uint32)_in.hierarchy.size();
-		_in.hierarchy.resize(nodeIdx + 1);
-		_in.parents.resize(nodeIdx + 1);
+		uint32 nodeIdx = allocNode(_in);
 		_in.hierarchy[nodeIdx].firstChild = _in.hierarchy[nodeIdx].escape = _in.parents[nodeIdx] = 0;
-		_in.aaBoxes.push_back(_aab);
+		_in.aaBoxes[nodeIdx] = _aab;
 
 		// Create a leaf if less than NUM_PRIMITIVES elements remain.
 		if( _num <= _in.numTrianglesPerLeaf )
-			return makeLeaf(_in, _triangles, _num);//*/
+			return makeLeaf(_in, nodeIdx, _triangles, _num);//*/
 
 		// Find SAH object split candidate.
 		uint32 splitIndex = 0; // Last triangle of left set
@@ -369,49 +387,49 @@ namespace bim {
 		// Create a leaf node based on the cost
 		//if(leafSAH < objSplitSAH && leafSAH < binSplitSAH)
 		/*if(_num < SBVH_TRAVERSAL_COST + min(objSplitSAH, binSplitSAH))
-			return makeLeaf(_in, _triangles, _num);//*/
+			return makeLeaf(_in, nodeIdx, _triangles, _num);//*/
 
 		bool useObjSplit = objSplitSAH <= binSplitSAH;
 
-		// Build a new index set for the left side
-		std::unique_ptr<uint32[]> tmpIndexSet(new uint32[_num]);
-		uint32 n = 0;
-		if(useObjSplit)
-		{
-			n = splitIndex+1;
-			memcpy(tmpIndexSet.get(), _triangles, n * 4);
-		} else {
-			// Get all triangles which start before the split plane
-			n = 0;
-			for(uint32 i = 0; i < _num; ++i)
-			{
-				UVec3 t = _in.triangles[_triangles[i]];
-				float tmin = min(_in.positions[t.x][binSplitDim], _in.positions[t.y][binSplitDim], _in.positions[t.z][binSplitDim]);
-				float tmax = max(_in.positions[t.x][binSplitDim], _in.positions[t.y][binSplitDim], _in.positions[t.z][binSplitDim]);
-				if(tmin < binSplitPlane || tmax <= binSplitPlane) // Must start truly in bucket or be on boundary
-					tmpIndexSet[n++] = _triangles[i];
-			}
-		}
 		// Set left and right into firstChild and escape. This is corrected later in
 		// remapNodePointers().
-		_in.hierarchy[nodeIdx].firstChild = build( _in, tmpIndexSet.get(), n, optLeftBox );
-		// Build index set for the right side
 		if(useObjSplit)
 		{
-			n = _num - splitIndex - 1;
-			memcpy(tmpIndexSet.get(), _triangles + splitIndex + 1, n * 4);
-		} else {
-			// Get all triangles which end after the split plane
-			n = 0;
-			for(uint32 i = 0; i < _num; ++i)
-			{
-				UVec3 t = _in.triangles[_triangles[i]];
-				float tmax = max(_in.positions[t.x][binSplitDim], _in.positions[t.y][binSplitDim], _in.positions[t.z][binSplitDim]);
-				if(tmax > binSplitPlane)
-					tmpIndexSet[n++] = _triangles[i];
-			}
+			// The sorted set is already partitioned and each child only reorders
+			// its own range -> recurse in place.
+			uint32 n = splitIndex+1;
+			_in.hierarchy[nodeIdx].firstChild = build( _in, _triangles, n, optLeftBox );
+			_in.hierarchy[nodeIdx].escape = build( _in, _triangles + n, _num - n, optRightBox );
+			return nodeIdx;
+		}
+
+		// Spatial splits duplicate references, the children need new index sets.
+		// Both are taken from the scratch arena and released on return, so all
+		// recursion levels share the same memory.
+		ScratchArena::Marker marker = _in.scratch.mark();
+		uint32* tmpIndexSet = _in.scratch.alloc<uint32>(_num);
+		// Get all triangles which start before the split plane
+		uint32 n = 0;
+		for(uint32 i = 0; i < _num; ++i)
+		{
+			UVec3 t = _in.triangles[_triangles[i]];
+			float tmin = min(_in.positions[t.x][binSplitDim], _in.positions[t.y][binSplitDim], _in.positions[t.z][binSplitDim]);
+			float tmax = max(_in.positions[t.x][binSplitDim], _in.positions[t.y][binSplitDim], _in.positions[t.z][binSplitDim]);
+			if(tmin < binSplitPlane || tmax <= binSplitPlane) // Must start truly in bucket or be on boundary
+				tmpIndexSet[n++] = _triangles[i];
+		}
+		_in.hierarchy[nodeIdx].firstChild = build( _in, tmpIndexSet, n, optLeftBox );
+		// Get all triangles which end after the split plane
+		n = 0;
+		for(uint32 i = 0; i < _num; ++i)
+		{
+			UVec3 t = _in.triangles[_triangles[i]];
+			float tmax = max(_in.positions[t.x][binSplitDim], _in.positions[t.y][binSplitDim], _in.positions[t.z][binSplitDim]);
+			if(tmax > binSplitPlane)
+				tmpIndexSet[n++] = _triangles[i];
 		}
-		_in.hierarchy[nodeIdx].escape = build( _in, tmpIndexSet.get(), n, optRightBox );
+		_in.hierarchy[nodeIdx].escape = build( _in, tmpIndexSet, n, optRightBox );
+		_in.scratch.release(marker);
 
 		return nodeIdx;
 	}
@@ -425,11 +443,15 @@ namespace bim {
 		Box res = clippedBox(a, b, c, 0, 0.5f, 0.75f);
 
 		uint32 n = getNumTriangles();
-		std::unique_ptr<Vec3[]> centers(new Vec3[n]);
-		std::unique_ptr<Vec2[]> heuristics(new Vec2[max(NUM_BINS,n-1)]); // n-1 split positions
-		std::unique_ptr<uint32[]> auxA(new uint32[max(NUM_BINS,n)]);
-		std::unique_ptr<uint32[]> indices(new uint32[n]);
-		std::unique_ptr<Bin[]> bins(new Bin[NUM_BINS]);
+		// Fixed buffers plus space for some levels of spatial split index sets.
+		// The arena grows if this is not enough.
+		ScratchArena arena(n * (sizeof(Vec3) + sizeof(Vec2) + 2 * sizeof(uint32))
+			+ NUM_BINS * (sizeof(Vec2) + sizeof(uint32) + sizeof(Bin)) + n * 4 * sizeof(uint32));
+		Vec3* centers = arena.alloc<Vec3>(n);
+		Vec2* heuristics = arena.alloc<Vec2>(max(NUM_BINS,n-1)); // n-1 split positions
+		uint32* auxA = arena.alloc<uint32>(max(NUM_BINS,n));
+		uint32* indices = arena.alloc<uint32>(n);
+		Bin* bins = arena.alloc<Bin>(NUM_BINS);
 
 		// Initialize unsorted and centers
 		for( uint32 i = 0; i < n; ++i )
@@ -439,15 +461,20 @@ namespace bim {
 			indices[i] = i;
 		}
 
-		m_hierarchy.reserve(n*2);
-		m_hierarchyParents.reserve(n*2);
-		m_aaBoxes.reserve(n*2);
-		m_hierarchyLeaves.reserve(n);
+		// Pools for the case without duplication, they grow on demand.
+		m_hierarchy.resize(n*2);
+		m_hierarchyParents.resize(n*2);
+		m_aaBoxes.resize(n*2);
+		m_hierarchyLeaves.resize(n);
 		SBVBuildInfo input = {m_hierarchy, m_hierarchyParents, m_hierarchyLeaves,
 			m_aaBoxes, m_positions, m_triangles, m_triangleMaterials,
-			_maxNumTrianglesPerLeaf, centers.get(), heuristics.get(),
-			auxA.get(), bins.get(), surface(m_boundingBox)};
-		build(input, indices.get(), n, m_boundingBox);
+			_maxNumTrianglesPerLeaf, centers, heuristics,
+			auxA, bins, surface(m_boundingBox), arena, 0, 0};
+		build(input, indices, n, m_boundingBox);
+		m_hierarchy.resize(input.numNodes);
+		m_hierarchyParents.resize(input.numNodes);
+		m_aaBoxes.resize(input.numNodes);
+		m_hierarchyLeaves.resize(input.numLeaves);
 		m_properties = Property::Val(m_properties | Property::AABOX_BVH);
 
 		bim::sendMessage(MessageType::INFO, "SBVH split produced ", m_hierarchyLeaves.size() / float(n) * 100.0f, " % references.");
@@ -0,0 +1,77 @@
+#pragma once
+
+#include <memory>
+#include <vector>
+#include <algorithm>
+
+namespace bim {
+
+	/// Stack like scratch memory for the hierarchy builders.
+	/// \details Allocations are released in reverse order by going back to a
+	///		marker. Recursive builders reuse the same memory on each level instead
+	///		of calling new/delete per node. If a block is full a new one is
+	///		added, all blocks are kept until the arena is destroyed.
+	class ScratchArena
+	{
+	public:
+		struct Marker
+		{
+			size_t block;
+			size_t offset;
+		};
+
+		/// \param [in] _blockSize Size of the first block in bytes. Should be
+		///		large enough for the whole build to avoid further allocations.
+		explicit ScratchArena(size_t _blockSize) :
+			m_blockSize(std::max<size_t>(_blockSize, 4096)),
+			m_current(0),
+			m_offset(0)
+		{
+			addBlock(m_blockSize);
+		}
+
+		/// Get uninitialized memory for _num elements (16 byte aligned).
+		template<typename T>
+		T* alloc(size_t _num)
+		{
+			size_t size = (_num * sizeof(T) + 15) & ~size_t(15);
+			while(m_offset + size > m_blocks[m_current].size)
+			{
+				++m_current;
+				m_offset = 0;
+				if(m_current == m_blocks.size())
+					addBlock(std::max(size, m_blockSize));
+			}
+			T* ptr = reinterpret_cast<T*>(m_blocks[m_current].data.get() + m_offset);
+			m_offset += size;
+			return ptr;
+		}
+
+		/// Current fill state. Everything allocated after this call is released
+		/// by release(marker).
+		Marker mark() const { return {m_current, m_offset}; }
+		void release(const Marker& _marker)
+		{
+			m_current = _marker.block;
+			m_offset = _marker.offset;
+		}
+
+	private:
+		struct Block
+		{
+			std::unique_ptr<char[]> data;
+			size_t size;
+		};
+		std::vector<Block> m_blocks;
+		size_t m_blockSize;
+		size_t m_current;	///< Block of the next allocation
+		size_t m_offset;	///< Byte offset in the current block
+
+		void addBlock(size_t _size)
+		{
+			// operator new[] returns memory aligned for any fundamental type (>= 16 byte on x64)
+			m_blocks.push_back({std::unique_ptr<char[]>(new char[_size]), _size});
+		}
+	};
+
+} // namespace bim
@@ -0,0 +1,116 @@
+#pragma once
+
+#include <ei/vector.hpp>
+
+// Use SSE if the target supports it. Otherwise, the same interface is
+// implemented with plain arrays.
+#if !defined(BIM_NO_SIMD) && (defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+#define BIM_SSE
+#include <xmmintrin.h>
+#endif
+
+namespace bim {
+
+	/// Four floats which are processed in parallel. Comparisons return masks
+	/// of the same type (all bits set for true).
+	/// This is an internal helper for the ray tracing kernels.
+	struct Float4
+	{
+#ifdef BIM_SSE
+		__m128 v;
+
+		Float4() = default;
+		Float4(__m128 _v) : v(_v) {}
+		Float4(float _s) : v(_mm_set1_ps(_s)) {}
+		Float4(float _a, float _b, float _c, float _d) : v(_mm_setr_ps(_a, _b, _c, _d)) {}
+		static Float4 load(const float* _ptr) { return _mm_loadu_ps(_ptr); }
+		void store(float* _ptr) const { _mm_storeu_ps(_ptr, v); }
+
+		Float4 operator + (const Float4& _o) const { return _mm_add_ps(v, _o.v); }
+		Float4 operator - (const Float4& _o) const { return _mm_sub_ps(v, _o.v); }
+		Float4 operator * (const Float4& _o) const { return _mm_mul_ps(v, _o.v); }
+		Float4 operator / (const Float4& _o) const { return _mm_div_ps(v, _o.v); }
+		Float4 operator < (const Float4& _o) const { return _mm_cmplt_ps(v, _o.v); }
+		Float4 operator <= (const Float4& _o) const { return _mm_cmple_ps(v, _o.v); }
+		Float4 operator > (const Float4& _o) const { return _mm_cmpgt_ps(v, _o.v); }
+		Float4 operator >= (const Float4& _o) const { return _mm_cmpge_ps(v, _o.v); }
+		Float4 operator != (const Float4& _o) const { return _mm_cmpneq_ps(v, _o.v); }
+		Float4 operator & (const Float4& _o) const { return _mm_and_ps(v, _o.v); }
+		Float4 operator | (const Float4& _o) const { return _mm_or_ps(v, _o.v); }
+		/// Get one bit per lane (lane i -> bit i).
+		int mask() const { return _mm_movemask_ps(v); }
+		float operator [] (int _i) const { float tmp[4]; store(tmp); return tmp[_i]; }
+		float hmin() const {
+			__m128 m = _mm_min_ps(v, _mm_shuffle_ps(v, v, _MM_SHUFFLE(2,3,0,1)));
+			return _mm_cvtss_f32(_mm_min_ss(m, _mm_movehl_ps(m, m)));
+		}
+		float hmax() const {
+			__m128 m = _mm_max_ps(v, _mm_shuffle_ps(v, v, _MM_SHUFFLE(2,3,0,1)));
+			return _mm_cvtss_f32(_mm_max_ss(m, _mm_movehl_ps(m, m)));
+		}
+#else
+		float v[4];
+
+		Float4() = default;
+		Float4(float _s) { v[0] = v[1] = v[2] = v[3] = _s; }
+		Float4(float _a, float _b, float _c, float _d) { v[0] = _a; v[1] = _b; v[2] = _c; v[3] = _d; }
+		static Float4 load(const float* _ptr) { return Float4(_ptr[0], _ptr[1], _ptr[2], _ptr[3]); }
+		void store(float* _ptr) const { for(int i = 0; i < 4; ++i) _ptr[i] = v[i]; }
+
+		Float4 operator + (const Float4& _o) const { return Float4(v[0]+_o.v[0], v[1]+_o.v[1], v[2]+_o.v[2], v[3]+_o.v[3]); }
+		Float4 operator - (const Float4& _o) const { return Float4(v[0]-_o.v[0], v[1]-_o.v[1], v[2]-_o.v[2], v[3]-_o.v[3]); }
+		Float4 operator * (const Float4& _o) const { return Float4(v[0]*_o.v[0], v[1]*_o.v[1], v[2]*_o.v[2], v[3]*_o.v[3]); }
+		Float4 operator / (const Float4& _o) const { return Float4(v[0]/_o.v[0], v[1]/_o.v[1], v[2]/_o.v[2], v[3]/_o.v[3]); }
+		Float4 operator < (const Float4& _o) const { Float4 r; for(int i = 0; i < 4; ++i) r.v[i] = maskValue(v[i] < _o.v[i]); return r; }
+		Float4 operator <= (const Float4& _o) const { Float4 r; for(int i = 0; i < 4; ++i) r.v[i] = maskValue(v[i] <= _o.v[i]); return r; }
+		Float4 operator > (const Float4& _o) const { Float4 r; for(int i = 0; i < 4; ++i) r.v[i] = maskValue(v[i] > _o.v[i]); return r; }
+		Float4 operator >= (const Float4& _o) const { Float4 r; for(int i = 0; i < 4; ++i) r.v[i] = maskValue(v[i] >= _o.v[i]); return r; }
+		Float4 operator != (const Float4& _o) const { Float4 r; for(int i = 0; i < 4; ++i) r.v[i] = maskValue(v[i] != _o.v[i]); return r; }
+		Float4 operator & (const Float4& _o) const { Float4 r; for(int i = 0; i < 4; ++i) r.v[i] = maskValue(bits(v[i]) && bits(_o.v[i])); return r; }
+		Float4 operator | (const Float4& _o) const { Float4 r; for(int i = 0; i < 4; ++i) r.v[i] = maskValue(bits(v[i]) || bits(_o.v[i])); return r; }
+		int mask() const { return (bits(v[0]) ? 1 : 0) | (bits(v[1]) ? 2 : 0) | (bits(v[2]) ? 4 : 0) | (bits(v[3]) ? 8 : 0); }
+		float operator [] (int _i) const { return v[_i]; }
+		float hmin() const { return ei::min(ei::min(v[0], v[1]), ei::min(v[2], v[3])); }
+		float hmax() const { return ei::max(ei::max(v[0], v[1]), ei::max(v[2], v[3])); }
+	private:
+		static float maskValue(bool _b) { uint32 m = _b ? 0xffffffff : 0; return *reinterpret_cast<const float*>(&m); }
+		static bool bits(float _f) { return *reinterpret_cast<const uint32*>(&_f) != 0; }
+	public:
+#endif
+	};
+
+	// Element wise minimum/maximum. If one of the operands is NaN the second
+	// one is returned (like the SSE instructions).
+#ifdef BIM_SSE
+	inline Float4 min(const Float4& _a, const Float4& _b) { return _mm_min_ps(_a.v, _b.v); }
+	inline Float4 max(const Float4& _a, const Float4& _b) { return _mm_max_ps(_a.v, _b.v); }
+	/// Per lane _mask ? _a : _b
+	inline Float4 select(const Float4& _mask, const Float4& _a, const Float4& _b) { return _mm_or_ps(_mm_and_ps(_mask.v, _a.v), _mm_andnot_ps(_mask.v, _b.v)); }
+#else
+	inline Float4 min(const Float4& _a, const Float4& _b) { Float4 r; for(int i = 0; i < 4; ++i) r.v[i] = _a.v[i] < _b.v[i] ? _a.v[i] : _b.v[i]; return r; }
+	inline Float4 max(const Float4& _a, const Float4& _b) { Float4 r; for(int i = 0; i < 4; ++i) r.v[i] = _a.v[i] > _b.v[i] ? _a.v[i] : _b.v[i]; return r; }
+	inline Float4 select(const Float4& _mask, const Float4& _a, const Float4& _b) { Float4 r; for(int i = 0; i < 4; ++i) r.v[i] = (_mask.mask() & (1<<i)) ? _a.v[i] : _b.v[i]; return r; }
+#endif
+
+	/// Four 3D vectors in SoA layout.
+	struct Vec3x4
+	{
+		Float4 x, y, z;
+
+		Vec3x4() = default;
+		Vec3x4(const Float4& _x, const Float4& _y, const Float4& _z) : x(_x), y(_y), z(_z) {}
+		explicit Vec3x4(const ei::Vec3& _v) : x(_v.x), y(_v.y), z(_v.z) {}
+
+		Vec3x4 operator + (const Vec3x4& _o) const { return Vec3x4(x + _o.x, y + _o.y, z + _o.z); }
+		Vec3x4 operator - (const Vec3x4& _o) const { return Vec3x4(x - _o.x, y - _o.y, z - _o.z); }
+	};
+
+	inline Float4 dot(const Vec3x4& _a, const Vec3x4& _b) { return _a.x * _b.x + _a.y * _b.y + _a.z * _b.z; }
+	inline Vec3x4 cross(const Vec3x4& _a, const Vec3x4& _b)
+	{
+		return Vec3x4(_a.y * _b.z - _a.z * _b.y,
+					  _a.z * _b.x - _a.x * _b.z,
+					  _a.x * _b.y - _a.y * _b.x);
+	}
+
+} // namespace bim
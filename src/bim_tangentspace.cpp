@@ -5,12 +5,98 @@ using namespace ei;
 
 namespace bim {
 
+	// Tangent space of a single triangle and the angles at its corners.
+	struct TriangleFrame
+	{
+		Vec3 normal, tangent, bitangent;
+		Vec3 weights;
+		bool valid;	// Degenerated triangles (NaN normal) do not contribute
+	};
+
+	static TriangleFrame computeTriangleFrame(const UVec3& _triangle, const Vec3* _positions, const Vec2* _texCoords)
+	{
+		TriangleFrame frame;
+		Vec3 e0 = _positions[_triangle.y] - _positions[_triangle.x];
+		Vec3 e1 = _positions[_triangle.z] - _positions[_triangle.x];
+		Vec3 e2 = _positions[_triangle.z] - _positions[_triangle.y];
+		Vec3& triNormal = frame.normal;
+		Vec3& triTangent = frame.tangent;
+		Vec3& triBitangent = frame.bitangent;
+		triNormal = normalize(cross(e0, e1));
+		// If there are invalid triangles (cause NaN) skip them
+		frame.valid = triNormal == triNormal;
+		if(!frame.valid)
+			return frame;
+		if(_texCoords) {
+			Vec2 uva = _texCoords[_triangle.y] - _texCoords[_triangle.x];
+			Vec2 uvb = _texCoords[_triangle.z] - _texCoords[_triangle.x];
+			float det = uva.x * uvb.y - uva.y * uvb.x; // may swap the sign
+			if(det == 0.0f) det = 1.0f;
+			triTangent = (uvb.y * e0 - uva.y * e1) / det;
+			triBitangent = (uva.x * e1 - uvb.x * e0) / det;
+			// Try to recover direction if it got NaN
+			bool invalidTangent = !(triTangent == triTangent) || len(triTangent) < 1e-10f;
+			bool invalidBitangent = !(triBitangent == triBitangent) || len(triBitangent) < 1e-10f;
+			if(invalidTangent && invalidBitangent)
+			{
+				// Create a random orthonormal basis (no uv given)
+				triTangent = Vec3(1.0f, triNormal.x, 0.0f);
+				triBitangent = Vec3(0.0f, triNormal.z, 1.0f);
+			} else if(invalidTangent)
+				triTangent = cross(triBitangent, triNormal) * det;
+			else if(invalidBitangent)
+					triBitangent = cross(triNormal, triTangent) * det;
+			if(!ei::orthonormalize(triNormal, triTangent, triBitangent))
+				triBitangent = cross(triNormal, triTangent);
+			eiAssert((triTangent == triTangent), "NaN in tangent computation!");
+			eiAssert((triBitangent == triBitangent), "NaN in bitangent computation!");
+			eiAssert(approx(len(triTangent), 1.0f, 1e-4f), "Computed tangent has a wrong length!");
+			eiAssert(approx(len(triBitangent), 1.0f, 1e-4f), "Computed bitangent has a wrong length!");
+		}
+		float lenE0 = len(e0), lenE1 = len(e1), lenE2 = len(e2);
+		frame.weights.x = acos(saturate(dot(e0, e1) / (lenE0 * lenE1)));
+		frame.weights.y = acos(saturate(-dot(e0, e2) / (lenE0 * lenE2)));
+		frame.weights.z = acos(saturate(dot(e1, e2) / (lenE1 * lenE2)));
+		eiAssert(frame.weights == frame.weights, "weight is NaN");
+		return frame;
+	}
+
+	// Rotation of an orthonormalized tangent space. Mirrored spaces cannot be
+	// represented by a rotation, their bitangent is negated.
+	static Quaternion tangentSpaceToQormal(Vec3 _normal, Vec3 _tangent, Vec3 _bitangent)
+	{
+		ei::orthonormalize(_normal, _tangent, _bitangent);
+		if(dot(cross(_normal, _tangent), _bitangent) < 0.0f)
+			_bitangent = -_bitangent;
+		return Quaternion(_normal, _tangent, _bitangent);
+	}
+
+	// Compressed sparse row adjacency from vertices to triangle corners. The
+	// corners of vertex v are _corners[_offsets[v]] to _corners[_offsets[v+1]-1],
+	// each encoded as triangle * 3 + corner and sorted by triangle.
+	static void buildVertexAdjacency(const std::vector<UVec3>& _triangles, uint32 _numVertices,
+		std::vector<uint32>& _offsets, std::vector<uint32>& _corners)
+	{
+		_offsets.assign(_numVertices + 1, 0);
+		for(size_t i = 0; i < _triangles.size(); ++i)
+			for(int j = 0; j < 3; ++j)
+				++_offsets[_triangles[i][j] + 1];
+		for(uint32 v = 0; v < _numVertices; ++v)
+			_offsets[v + 1] += _offsets[v];
+		_corners.resize(_triangles.size() * 3);
+		std::vector<uint32> fill(_offsets.begin(), _offsets.end() - 1);
+		for(size_t i = 0; i < _triangles.size(); ++i)
+			for(int j = 0; j < 3; ++j)
+				_corners[fill[_triangles[i][j]]++] = uint32(i * 3 + j);
+	}
+
 	void Chunk::computeTangentSpace(Property::Val _components, bool _preserveOriginals)
 	{
 		// Either compute normals only or compute the entire tangent space,
 		// orthonormalize and discard the unwanted.
 		// For quaternions the entire space is computed and then converted.
-		bool needsAll = (_components & Property::QORMAL) || (_components & Property::TANGENT) || (m_properties & Property::BITANGENT);
+		bool computeQormal = (_components & Property::QORMAL) || (_components & Property::QORMAL16);
+		bool needsAll = computeQormal || (_components & Property::TANGENT) || (m_properties & Property::BITANGENT);
 		bool useTexCoords = needsAll;
 		bool computeNormal = (_components & Property::NORMAL) || (needsAll && !(m_properties & Property::NORMAL));
 		// Positions and texture coordinates are required for tangent space calculation.
@@ -31,99 +117,74 @@ namespace bim {
 			m_tangents.resize(m_positions.size(), Vec3(0.0f));
 			m_bitangents.resize(m_positions.size(), Vec3(0.0f));
 		}
-		if(_components & Property::QORMAL) m_qormals.resize(m_positions.size(), Vec3(0.0f));
+		// Qormals are always computed in float precision and quantised at the end.
+		// The zero quaternion marks missing ones.
+		if(computeQormal) m_qormals.resize(m_positions.size(), Quaternion(0.0f, 0.0f, 0.0f, 0.0f));
+		if(_components & Property::QORMAL16) m_qormals16.resize(m_positions.size(), Vec<int16,4>(0));
 
 		// Check all vectors if they need to be recomputed.
-		// Store flags 1=normal, 2=tangent, 4=bitangent, 8=qormal as booleans
+		// Store flags 1=normal, 2=tangent, 4=bitangent, 8=qormal, 16=qormal16 as booleans
 		std::vector<uint8_t> isValidVector(m_positions.size(), 0);
 		if(_preserveOriginals)
 		{
-			for(size_t i = 0; i < m_positions.size(); ++i)
+#pragma omp parallel for
+			for(int i = 0; i < int(m_positions.size()); ++i)
 			{
 				if(!m_normals.empty() && approx(len(m_normals[i]), 1.0f)) isValidVector[i] |= 1;
 				if(!m_tangents.empty() && approx(len(m_tangents[i]), 1.0f)) isValidVector[i] |= 2;
 				if(!m_bitangents.empty() && approx(len(m_bitangents[i]), 1.0f)) isValidVector[i] |= 4;
 				if(!m_qormals.empty() && approx(len(m_qormals[i]), 1.0f)) isValidVector[i] |= 8;
+				if(!m_qormals16.empty() && m_qormals16[i] != Vec<int16,4>(0)) isValidVector[i] |= 16;
 			}
 		}
 
 		// Get tangent spaces on triangles and average them on vertex locations
 		if(computeNormal || useTexCoords)
-		for(size_t i = 0; i < m_triangles.size(); ++i)
 		{
-			Vec3 e0 = m_positions[m_triangles[i].y] - m_positions[m_triangles[i].x];
-			Vec3 e1 = m_positions[m_triangles[i].z] - m_positions[m_triangles[i].x];
-			Vec3 e2 = m_positions[m_triangles[i].z] - m_positions[m_triangles[i].y];
-			Vec3 triNormal, triTangent, triBitangent;
-			triNormal = normalize(cross(e0, e1));
-			// If there are invalid triangles (cause NaN) skip them
-			if(triNormal == triNormal)
+			int numTriangles = int(m_triangles.size());
+			std::vector<TriangleFrame> frames(numTriangles);
+#pragma omp parallel for
+			for(int i = 0; i < numTriangles; ++i)
+				frames[i] = computeTriangleFrame(m_triangles[i], m_positions.data(), useTexCoords ? m_texCoords0.data() : nullptr);
+
+			// Gather the weighted frames of all adjacent triangles for each vertex.
+			// The adjacency lists are sorted by triangle, so the sums are the same
+			// as when adding the triangles one after another.
+			std::vector<uint32> adjOffsets, adjCorners;
+			buildVertexAdjacency(m_triangles, uint32(m_positions.size()), adjOffsets, adjCorners);
+#pragma omp parallel for schedule(dynamic, 1024)
+			for(int v = 0; v < int(m_positions.size()); ++v)
 			{
-				if(useTexCoords) {
-					Vec2 uva = m_texCoords0[m_triangles[i].y] - m_texCoords0[m_triangles[i].x];
-					Vec2 uvb = m_texCoords0[m_triangles[i].z] - m_texCoords0[m_triangles[i].x];
-					float det = uva.x * uvb.y - uva.y * uvb.x; // may swap the sign
-					if(det == 0.0f) det = 1.0f;
-					triTangent = (uvb.y * e0 - uva.y * e1) / det;
-					triBitangent = (uva.x * e1 - uvb.x * e0) / det;
-					// Try to recover direction if it got NaN
-					bool invalidTangent = !(triTangent == triTangent) || len(triTangent) < 1e-10f;
-					bool invalidBitangent = !(triBitangent == triBitangent) || len(triBitangent) < 1e-10f;
-					if(invalidTangent && invalidBitangent)
-					{
-						// Create a random orthonormal basis (no uv given)
-						triTangent = Vec3(1.0f, triNormal.x, 0.0f);
-						triBitangent = Vec3(0.0f, triNormal.z, 1.0f);
-					} else if(invalidTangent)
-						triTangent = cross(triBitangent, triNormal) * det;
-					else if(invalidBitangent)
-							triBitangent = cross(triNormal, triTangent) * det;
-					if(!ei::orthonormalize(triNormal, triTangent, triBitangent))
-						triBitangent = cross(triNormal, triTangent);
-					eiAssert((triTangent == triTangent), "NaN in tangent computation!");
-					eiAssert((triBitangent == triBitangent), "NaN in bitangent computation!");
-					eiAssert(approx(len(triTangent), 1.0f, 1e-4f), "Computed tangent has a wrong length!");
-					eiAssert(approx(len(triBitangent), 1.0f, 1e-4f), "Computed bitangent has a wrong length!");
+				bool addNormal = computeNormal && !(isValidVector[v] & 1);
+				bool addTangent = useTexCoords && !(isValidVector[v] & 2);
+				bool addBitangent = useTexCoords && !(isValidVector[v] & 4);
+				for(uint32 k = adjOffsets[v]; k < adjOffsets[v+1]; ++k)
+				{
+					const TriangleFrame& frame = frames[adjCorners[k] / 3];
+					if(!frame.valid) continue;
+					float weight = frame.weights[adjCorners[k] % 3];
+					if(addNormal) m_normals[v] += frame.normal * weight;
+					if(addTangent) m_tangents[v] += frame.tangent * weight;
+					if(addBitangent) m_bitangents[v] += frame.bitangent * weight;
 				}
-				float lenE0 = len(e0), lenE1 = len(e1), lenE2 = len(e2);
-				float weight = acos(saturate(dot(e0, e1) / (lenE0 * lenE1)));
-				eiAssert(weight == weight, "weight is NaN");
-				if(computeNormal && !(isValidVector[m_triangles[i].x] & 1))
-					m_normals[m_triangles[i].x] += triNormal * weight;
-				if(useTexCoords && !(isValidVector[m_triangles[i].x] & 2))
-					m_tangents[m_triangles[i].x] += triTangent * weight;
-				if(useTexCoords && !(isValidVector[m_triangles[i].x] & 4))
-					m_bitangents[m_triangles[i].x] += triBitangent * weight;
-				weight = acos(saturate(-dot(e0, e2) / (lenE0 * lenE2)));
-				eiAssert(weight == weight, "weight is NaN");
-				if(computeNormal && !(isValidVector[m_triangles[i].y] & 1))
-					m_normals[m_triangles[i].y] += triNormal * weight;
-				if(useTexCoords && !(isValidVector[m_triangles[i].y] & 2))
-					m_tangents[m_triangles[i].y] += triTangent * weight;
-				if(useTexCoords && !(isValidVector[m_triangles[i].y] & 4))
-					m_bitangents[m_triangles[i].y] += triBitangent * weight;
-				weight = acos(saturate(dot(e1, e2) / (lenE1 * lenE2)));
-				eiAssert(weight == weight, "weight is NaN");
-				if(computeNormal && !(isValidVector[m_triangles[i].z] & 1))
-					m_normals[m_triangles[i].z] += triNormal * weight;
-				if(useTexCoords && !(isValidVector[m_triangles[i].z] & 2))
-					m_tangents[m_triangles[i].z] += triTangent * weight;
-				if(useTexCoords && !(isValidVector[m_triangles[i].z] & 4))
-					m_bitangents[m_triangles[i].z] += triBitangent * weight;
 			}
 		}
 
 		// Orthonormalize
 		if(useTexCoords)
-			for(size_t i = 0; i < m_normals.size(); ++i)
+		{
+#pragma omp parallel for
+			for(int i = 0; i < int(m_normals.size()); ++i)
 				ei::orthonormalize(m_normals[i], m_tangents[i], m_bitangents[i]);
-		else if(computeNormal)
-			for(size_t i = 0; i < m_normals.size(); ++i)
+		} else if(computeNormal) {
+#pragma omp parallel for
+			for(int i = 0; i < int(m_normals.size()); ++i)
 			{
 				float length = len(m_normals[i]);
 				if(length > 0.0f)
 					m_normals[i] /= length;
 			}
+		}
 
 		// Generate some "random" tangent spaces without the need of texture coordinates.
 		if(needsAll && !useTexCoords)
@@ -137,16 +198,34 @@ namespace bim {
 		}
 
 		// Compute qormals by conversion
-		if(_components & Property::QORMAL)
-			for(size_t i = 0; i < m_normals.size(); ++i)
-				if(isValidVector[i] & 8)
-					m_qormals[i] = Quaternion(m_normals[i], m_tangents[i], m_bitangents[i]);
+		if(computeQormal)
+		{
+#pragma omp parallel for
+			for(int i = 0; i < int(m_positions.size()); ++i)
+			{
+				if(isValidVector[i] & 8) continue;
+				if(isValidVector[i] & 16)
+					m_qormals[i] = decodeQormal16(m_qormals16[i]);
+				else
+					m_qormals[i] = tangentSpaceToQormal(m_normals[i], m_tangents[i], m_bitangents[i]);
+			}
+			// Make interpolation within triangles valid. This may add vertices.
+			unifyQormals();
+			if(_components & Property::QORMAL16)
+			{
+				m_qormals16.resize(m_qormals.size());
+#pragma omp parallel for
+				for(int i = 0; i < int(m_qormals.size()); ++i)
+					m_qormals16[i] = encodeQormal16(m_qormals[i]);
+			}
+		}
 
 		// Discard all the undesired properties for size reasons.
 		if(!(_components & Property::NORMAL) && !(m_properties & Property::NORMAL)) swap(m_normals, std::vector<Vec3>());
 		if(!(_components & Property::TANGENT) && !(m_properties & Property::TANGENT)) swap(m_tangents, std::vector<Vec3>());
 		if(!(_components & Property::BITANGENT) && !(m_properties & Property::BITANGENT)) swap(m_bitangents, std::vector<Vec3>());
 		if(!(_components & Property::QORMAL) && !(m_properties & Property::QORMAL)) swap(m_qormals, std::vector<Quaternion>());
+		if(!(_components & Property::QORMAL16) && !(m_properties & Property::QORMAL16)) std::vector<Vec<int16,4>>().swap(m_qormals16);
 
 		// Update flags
 		m_properties = Property::Val(m_properties | _components);
@@ -154,14 +233,108 @@ namespace bim {
 
 	void Chunk::flipNormals()
 	{
-		for(size_t i = 0; i < m_normals.size(); ++i)
+#pragma omp parallel for
+		for(int i = 0; i < int(m_normals.size()); ++i)
 			m_normals[i] = -m_normals[i];
 
-		// TODO: flip Qormals too
+		if(m_qormals.empty() && m_qormals16.empty())
+			return;
+		// Flip in float precision, the quantised qormals are derived afterwards.
+		bool temporaryQormals = m_qormals.empty();
+		if(temporaryQormals)
+		{
+			m_qormals.resize(m_qormals16.size());
+#pragma omp parallel for
+			for(int i = 0; i < int(m_qormals.size()); ++i)
+				m_qormals[i] = decodeQormal16(m_qormals16[i]);
+		}
+		// Negating the normal alone would mirror the frame. Negating the
+		// bitangent too gives a rotation by 180° around the tangent.
+#pragma omp parallel for
+		for(int i = 0; i < int(m_qormals.size()); ++i)
+		{
+			const Quaternion& q = m_qormals[i];
+			m_qormals[i] = Quaternion(-xaxis(q), yaxis(q), -zaxis(q));
+		}
+		// The conversion chooses arbitrary signs
+		unifyQormals();
+		if(!m_qormals16.empty())
+		{
+			m_qormals16.resize(m_qormals.size());
+#pragma omp parallel for
+			for(int i = 0; i < int(m_qormals.size()); ++i)
+				m_qormals16[i] = encodeQormal16(m_qormals[i]);
+		}
+		if(temporaryQormals)
+			std::vector<Quaternion>().swap(m_qormals);
 	}
 
 	void Chunk::unifyQormals()
 	{
+		if(m_qormals.empty())
+			return;
+
+		// Greedy propagation over the triangles: the first vertex of a triangle
+		// which has a sign already is the reference, the others are flipped into
+		// its hemisphere. If a vertex was fixed with the other sign before, the
+		// triangle gets a flipped copy of it.
+		std::vector<uint8> isFixed(m_positions.size(), 0);
+		std::vector<uint32> flippedCopy(m_positions.size(), ~0u);
+		uint32 numDuplicates = 0;
+		for(size_t i = 0; i < m_triangles.size(); ++i)
+		{
+			UVec3& triangle = m_triangles[i];
+			int ref = 0;
+			for(int j = 0; j < 3; ++j)
+				if(isFixed[triangle[j]]) { ref = j; break; }
+			isFixed[triangle[ref]] = 1;
+			Quaternion refQ = m_qormals[triangle[ref]];
+			for(int j = 0; j < 3; ++j)
+			{
+				uint32 v = triangle[j];
+				if(j == ref || dot(m_qormals[v], refQ) >= 0.0f) {
+					isFixed[v] = 1;
+				} else if(!isFixed[v]) {
+					m_qormals[v] = -m_qormals[v];
+					isFixed[v] = 1;
+				} else {
+					if(flippedCopy[v] == ~0u)
+					{
+						uint32 copy = duplicateVertex(v);
+						m_qormals[copy] = -m_qormals[v];
+						isFixed.push_back(1);
+						flippedCopy.push_back(v);
+						flippedCopy[v] = copy;
+						++numDuplicates;
+					}
+					triangle[j] = flippedCopy[v];
+				}
+			}
+		}
+
+		if(numDuplicates > 0)
+		{
+			// The leaves contain copies of the triangles
+			if(!m_hierarchy.empty()) invalidateHierarchy();
+			sendMessage(MessageType::INFO, "qormal unification duplicated ", numDuplicates, " vertices.");
+		}
+	}
+
+	void Chunk::removeVertexProperties(Property::Val _properties)
+	{
+		if(_properties & Property::NORMAL) std::vector<Vec3>().swap(m_normals);
+		if(_properties & Property::TANGENT) std::vector<Vec3>().swap(m_tangents);
+		if(_properties & Property::BITANGENT) std::vector<Vec3>().swap(m_bitangents);
+		if(_properties & Property::QORMAL) std::vector<Quaternion>().swap(m_qormals);
+		if(_properties & Property::QORMAL16) std::vector<Vec<int16,4>>().swap(m_qormals16);
+		if(_properties & Property::TEXCOORD0) std::vector<Vec2>().swap(m_texCoords0);
+		if(_properties & Property::TEXCOORD1) std::vector<Vec2>().swap(m_texCoords1);
+		if(_properties & Property::TEXCOORD2) std::vector<Vec2>().swap(m_texCoords2);
+		if(_properties & Property::TEXCOORD3) std::vector<Vec2>().swap(m_texCoords3);
+		if(_properties & Property::COLOR) std::vector<uint32>().swap(m_colors);
+		m_properties = Property::Val(m_properties & ~(_properties & (Property::NORMAL | Property::TANGENT
+			| Property::BITANGENT | Property::QORMAL | Property::QORMAL16 | Property::TEXCOORD0
+			| Property::TEXCOORD1 | Property::TEXCOORD2 | Property::TEXCOORD3 | Property::COLOR)));
 	}
 
-} // namespace bim
\ No newline at end of file
+} // namespace bim
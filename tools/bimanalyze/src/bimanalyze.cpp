@@ -0,0 +1,143 @@
+#include <string>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <cstring>
+
+#include "bim/bim.hpp"
+#include "bim/log.hpp"
+#include "../../../deps/json/json.hpp"
+
+using namespace std::chrono;
+
+static const char* buildMethodName(bim::Chunk::BuildMethod _method)
+{
+	switch(_method)
+	{
+	case bim::Chunk::BuildMethod::KD_TREE: return "KD_TREE";
+	case bim::Chunk::BuildMethod::SAH: return "SAH";
+	case bim::Chunk::BuildMethod::SBVH: return "SBVH";
+	}
+	return "UNKNOWN";
+}
+
+static nlohmann::json toJson(const bim::HierarchyStatistics& _stats)
+{
+	nlohmann::json result;
+	result["sahCost"] = _stats.sahCost;
+	result["epo"] = _stats.epo;
+	result["siblingOverlap"] = _stats.siblingOverlap;
+	result["innerNodes"] = _stats.numInnerNodes;
+	result["leafNodes"] = _stats.numLeafNodes;
+	result["triangleReferences"] = _stats.numTriangleReferences;
+	result["bytesPerTriangle"] = _stats.bytesPerTriangle;
+	result["leafSizeHistogram"] = _stats.leafSizeHistogram;
+	result["leafDepthHistogram"] = _stats.leafDepthHistogram;
+	return result;
+}
+
+static void printSummary(const char* _name, const bim::HierarchyStatistics& _stats)
+{
+	uint depthSum = 0;
+	for(size_t i = 0; i < _stats.leafDepthHistogram.size(); ++i)
+		depthSum += uint(i) * _stats.leafDepthHistogram[i];
+	bim::sendMessage(bim::MessageType::INFO, "    ", _name, ": SAH ", _stats.sahCost, ", EPO ", _stats.epo,
+		", sibling overlap ", _stats.siblingOverlap, ", leaves ", _stats.numLeafNodes,
+		", avg. leaf depth ", depthSum / float(ei::max(1u, _stats.numLeafNodes)),
+		", max. leaf depth ", _stats.leafDepthHistogram.size() - 1,
+		", ", _stats.bytesPerTriangle, " bytes/triangle");
+}
+
+int main(int _numArgs, const char** _args)
+{
+	std::string inputFileName;
+	std::string outputFileName;
+	std::string methodFilter;
+	bool rebuild = true;
+	uint maxNumTrianglesPerLeaf = 2;
+	for(int i = 1; i < _numArgs; ++i)
+	{
+		if(_args[i][0] != '-') { bim::sendMessage(bim::MessageType::WARNING, "Ignoring input ", _args[i]); continue; }
+		switch(_args[i][1])
+		{
+		case 'i': inputFileName = _args[i] + 2;
+			break;
+		case 'o': outputFileName = _args[i] + 2;
+			break;
+		case 'm': methodFilter = _args[i] + 2;
+			break;
+		case 'n': rebuild = false;
+			break;
+		case 't': maxNumTrianglesPerLeaf = atoi(_args[i] + 2);
+			break;
+		default:
+			bim::sendMessage(bim::MessageType::WARNING, "Unknown option in argument ", _args[i]);
+		}
+	}
+	if(inputFileName.empty()) { bim::sendMessage(bim::MessageType::ERROR, "Input file must be given!"); return 1; }
+
+	// Load everything which is in the file to see the stored hierarchy as it is.
+	bim::BinaryModel model;
+	if(!model.load(inputFileName.c_str(), bim::Property::Val(bim::Property::POSITION | bim::Property::TRIANGLE_IDX), bim::Property::DONT_CARE, true))
+		return 1;
+
+	const bim::Chunk::BuildMethod methods[] = {bim::Chunk::BuildMethod::KD_TREE, bim::Chunk::BuildMethod::SAH, bim::Chunk::BuildMethod::SBVH};
+	nlohmann::json report;
+	report["file"] = inputFileName;
+	report["maxTrianglesPerLeaf"] = maxNumTrianglesPerLeaf;
+	report["chunks"] = nlohmann::json::array();
+	ei::IVec3 numChunks = model.getNumChunks();
+	for(int z = 0; z < numChunks.z; ++z) for(int y = 0; y < numChunks.y; ++y) for(int x = 0; x < numChunks.x; ++x)
+	{
+		ei::IVec3 chunkPos(x, y, z);
+		model.makeChunkResident(chunkPos);
+		bim::Chunk& chunk = *model.getChunk(chunkPos);
+		if(chunk.getNumTriangles() == 0) {
+			model.deleteChunk(chunkPos);
+			continue;
+		}
+		bim::sendMessage(bim::MessageType::INFO, "Chunk (", x, ", ", y, ", ", z, "): ", chunk.getNumTriangles(), " triangles");
+
+		nlohmann::json chunkReport;
+		chunkReport["position"] = {x, y, z};
+		chunkReport["triangles"] = chunk.getNumTriangles();
+		if(chunk.getProperties() & bim::Property::HIERARCHY)
+		{
+			if(!(chunk.getProperties() & bim::Property::AABOX_BVH))
+				chunk.computeBVHAABoxes();
+			bim::HierarchyStatistics stats = chunk.analyzeHierarchy();
+			printSummary("stored", stats);
+			chunkReport["stored"] = toJson(stats);
+		}
+
+		chunkReport["builds"] = nlohmann::json::array();
+		for(auto method : methods)
+		{
+			if(!rebuild || (!methodFilter.empty() && methodFilter != buildMethodName(method)))
+				continue;
+			auto t0 = high_resolution_clock::now();
+			chunk.buildHierarchy(method, maxNumTrianglesPerLeaf);
+			// SBVH creates its boxes during the build
+			if(method != bim::Chunk::BuildMethod::SBVH)
+				chunk.computeBVHAABoxes();
+			auto t1 = high_resolution_clock::now();
+			bim::HierarchyStatistics stats = chunk.analyzeHierarchy();
+			printSummary(buildMethodName(method), stats);
+			nlohmann::json build = toJson(stats);
+			build["method"] = buildMethodName(method);
+			build["buildTime"] = duration_cast<duration<double>>(t1 - t0).count();
+			chunkReport["builds"].push_back(build);
+		}
+		report["chunks"].push_back(chunkReport);
+		model.deleteChunk(chunkPos);
+	}
+
+	if(outputFileName.empty())
+		std::cout << report.dump(4) << std::endl;
+	else {
+		std::ofstream file(outputFileName);
+		if(!file) { bim::sendMessage(bim::MessageType::ERROR, "Cannot open output file ", outputFileName.c_str()); return 1; }
+		file << report.dump(4) << std::endl;
+	}
+	return 0;
+}
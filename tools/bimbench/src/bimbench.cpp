@@ -0,0 +1,457 @@
+#include <string>
+#include <vector>
+#include <random>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <cstring>
+#include <cmath>
+
+#include "bim/bim.hpp"
+#include "bim/log.hpp"
+#include "../../../deps/json/json.hpp"
+
+using namespace std::chrono;
+using namespace ei;
+
+// ************************************************************************* //
+// Procedural scenes
+
+struct Scene
+{
+	std::string name;
+	Vec3 cameraPosition;
+	Vec3 cameraLookAt;
+	Vec3 lightPosition;
+};
+
+static void addVertex(bim::Chunk& _chunk, const Vec3& _position)
+{
+	bim::Chunk::FullVertex vertex;
+	vertex.position = _position;
+	_chunk.addVertex(vertex);
+}
+
+// Tessellated parallelogram with _nu x _nv quads.
+static void addQuadGrid(bim::Chunk& _chunk, const Vec3& _corner, const Vec3& _u, const Vec3& _v, int _nu, int _nv)
+{
+	uint32 first = _chunk.getNumVertices();
+	for(int j = 0; j <= _nv; ++j)
+		for(int i = 0; i <= _nu; ++i)
+			addVertex(_chunk, _corner + _u * (i / float(_nu)) + _v * (j / float(_nv)));
+	for(int j = 0; j < _nv; ++j)
+		for(int i = 0; i < _nu; ++i)
+		{
+			uint32 a = first + j * (_nu + 1) + i;
+			_chunk.addTriangle(UVec3(a, a + 1, a + _nu + 2), 0);
+			_chunk.addTriangle(UVec3(a, a + _nu + 2, a + _nu + 1), 0);
+		}
+}
+
+// Axis aligned box with tessellated faces.
+static void addBox(bim::Chunk& _chunk, const Vec3& _min, const Vec3& _max, int _tess)
+{
+	Vec3 s = _max - _min;
+	addQuadGrid(_chunk, _min, Vec3(s.x, 0, 0), Vec3(0, s.y, 0), _tess, _tess);
+	addQuadGrid(_chunk, _min, Vec3(0, s.y, 0), Vec3(0, 0, s.z), _tess, _tess);
+	addQuadGrid(_chunk, _min, Vec3(0, 0, s.z), Vec3(s.x, 0, 0), _tess, _tess);
+	addQuadGrid(_chunk, _max, Vec3(0, -s.y, 0), Vec3(-s.x, 0, 0), _tess, _tess);
+	addQuadGrid(_chunk, _max, Vec3(0, 0, -s.z), Vec3(0, -s.y, 0), _tess, _tess);
+	addQuadGrid(_chunk, _max, Vec3(-s.x, 0, 0), Vec3(0, 0, -s.z), _tess, _tess);
+}
+
+// Vertical cylinder without caps.
+static void addCylinder(bim::Chunk& _chunk, const Vec3& _base, float _radius, float _height, int _segments, int _rings)
+{
+	uint32 first = _chunk.getNumVertices();
+	for(int j = 0; j <= _rings; ++j)
+		for(int i = 0; i < _segments; ++i)
+		{
+			float phi = i * 2.0f * PI / _segments;
+			addVertex(_chunk, _base + Vec3(_radius * cos(phi), _height * j / _rings, _radius * sin(phi)));
+		}
+	for(int j = 0; j < _rings; ++j)
+		for(int i = 0; i < _segments; ++i)
+		{
+			uint32 a = first + j * _segments + i;
+			uint32 b = first + j * _segments + (i + 1) % _segments;
+			_chunk.addTriangle(UVec3(a, b, b + _segments), 0);
+			_chunk.addTriangle(UVec3(a, b + _segments, a + _segments), 0);
+		}
+}
+
+static void addSphere(bim::Chunk& _chunk, const Vec3& _center, float _radius, int _segments, int _rings)
+{
+	uint32 first = _chunk.getNumVertices();
+	for(int j = 0; j <= _rings; ++j)
+	{
+		float theta = j * PI / _rings;
+		for(int i = 0; i < _segments; ++i)
+		{
+			float phi = i * 2.0f * PI / _segments;
+			addVertex(_chunk, _center + _radius * Vec3(sin(theta) * cos(phi), cos(theta), sin(theta) * sin(phi)));
+		}
+	}
+	for(int j = 0; j < _rings; ++j)
+		for(int i = 0; i < _segments; ++i)
+		{
+			uint32 a = first + j * _segments + i;
+			uint32 b = first + j * _segments + (i + 1) % _segments;
+			// Skip the degenerated triangles at the poles
+			if(j > 0) _chunk.addTriangle(UVec3(a, b, b + _segments), 0);
+			if(j < _rings - 1) _chunk.addTriangle(UVec3(a, b + _segments, a + _segments), 0);
+		}
+}
+
+// A regular grid of tessellated spheres.
+static Scene createSphereField(bim::Chunk& _chunk, float _scale)
+{
+	int n = max(1, int(8 * pow(_scale, 1.0f / 3.0f)));
+	for(int z = 0; z < n; ++z)
+		for(int y = 0; y < n; ++y)
+			for(int x = 0; x < n; ++x)
+				addSphere(_chunk, Vec3(x * 3.0f, y * 3.0f, z * 3.0f), 1.0f, 32, 16);
+	float c = (n - 1) * 1.5f;
+	return {"sphereField", Vec3(c + 0.3f, c + 0.2f, -4.0f), Vec3(c, c, c), Vec3(c, n * 3.0f + 2.0f, -2.0f)};
+}
+
+// Random uniformly distributed triangles of similar size.
+static Scene createTriangleSoup(bim::Chunk& _chunk, float _scale)
+{
+	std::mt19937 rng(4711);
+	std::uniform_real_distribution<float> pos(0.0f, 10.0f);
+	std::uniform_real_distribution<float> offset(-0.15f, 0.15f);
+	int n = int(200000 * _scale);
+	for(int i = 0; i < n; ++i)
+	{
+		Vec3 c(pos(rng), pos(rng), pos(rng));
+		uint32 first = _chunk.getNumVertices();
+		for(int k = 0; k < 3; ++k)
+			addVertex(_chunk, c + Vec3(offset(rng), offset(rng), offset(rng)));
+		_chunk.addTriangle(UVec3(first, first + 1, first + 2), 0);
+	}
+	return {"triangleSoup", Vec3(5.0f, 5.0f, -5.0f), Vec3(5.0f), Vec3(5.0f, 12.0f, 5.0f)};
+}
+
+// A closed hall with two floors of column rows, a gallery and boxes on the
+// ground. The camera is inside, which is the typical architectural case.
+static Scene createBoxRoom(bim::Chunk& _chunk, float _scale)
+{
+	int tess = max(2, int(24 * sqrt(_scale)));
+	// Hall
+	addBox(_chunk, Vec3(-15.0f, 0.0f, -6.0f), Vec3(15.0f, 12.0f, 6.0f), tess);
+	// Gallery floor on both sides
+	addBox(_chunk, Vec3(-14.0f, 5.8f, -6.0f), Vec3(14.0f, 6.2f, -3.5f), tess / 2);
+	addBox(_chunk, Vec3(-14.0f, 5.8f, 3.5f), Vec3(14.0f, 6.2f, 6.0f), tess / 2);
+	// Column rows on both floors
+	for(int i = 0; i < 12; ++i)
+	{
+		float x = -13.0f + i * 26.0f / 11.0f;
+		for(float z : {-3.5f, 3.5f})
+		{
+			addCylinder(_chunk, Vec3(x, 0.0f, z), 0.4f, 5.8f, 24, tess);
+			addCylinder(_chunk, Vec3(x, 6.2f, z), 0.3f, 5.8f, 24, tess);
+			// Capital
+			addBox(_chunk, Vec3(x - 0.6f, 5.4f, z - 0.6f), Vec3(x + 0.6f, 5.8f, z + 0.6f), 4);
+		}
+	}
+	// Clutter
+	std::mt19937 rng(1234);
+	std::uniform_real_distribution<float> px(-12.0f, 12.0f), pz(-2.5f, 2.5f), ps(0.2f, 0.8f);
+	for(int i = 0; i < 40; ++i)
+	{
+		Vec3 c(px(rng), 0.0f, pz(rng));
+		float s = ps(rng);
+		addBox(_chunk, c - Vec3(s, 0.0f, s), c + Vec3(s, 2.0f * s, s), 4);
+	}
+	return {"boxRoom", Vec3(-13.0f, 2.0f, 0.5f), Vec3(10.0f, 4.0f, -0.5f), Vec3(0.0f, 10.0f, 0.0f)};
+}
+
+// Long, thin triangles crossing the scene in random directions. This is the
+// worst case for object partitioning since all boxes overlap a lot.
+static Scene createThinTriangles(bim::Chunk& _chunk, float _scale)
+{
+	std::mt19937 rng(42);
+	std::uniform_real_distribution<float> pos(0.0f, 10.0f);
+	std::uniform_real_distribution<float> width(0.001f, 0.02f);
+	int n = int(50000 * _scale);
+	for(int i = 0; i < n; ++i)
+	{
+		Vec3 a(pos(rng), pos(rng), pos(rng));
+		Vec3 b(pos(rng), pos(rng), pos(rng));
+		Vec3 side(width(rng), width(rng), width(rng));
+		uint32 first = _chunk.getNumVertices();
+		addVertex(_chunk, a);
+		addVertex(_chunk, b);
+		addVertex(_chunk, a + side);
+		_chunk.addTriangle(UVec3(first, first + 1, first + 2), 0);
+	}
+	return {"thinTriangles", Vec3(5.0f, 5.0f, -6.0f), Vec3(5.0f), Vec3(5.0f, 15.0f, -2.0f)};
+}
+
+// ************************************************************************* //
+// Measurements
+
+static const char* buildMethodName(bim::Chunk::BuildMethod _method)
+{
+	switch(_method)
+	{
+	case bim::Chunk::BuildMethod::KD_TREE: return "KD_TREE";
+	case bim::Chunk::BuildMethod::SAH: return "SAH";
+	case bim::Chunk::BuildMethod::SBVH: return "SBVH";
+	}
+	return "UNKNOWN";
+}
+
+static const char* nodeLayoutName(bim::Chunk::NodeLayout _layout)
+{
+	switch(_layout)
+	{
+	case bim::Chunk::NodeLayout::DEPTH_FIRST: return "DEPTH_FIRST";
+	case bim::Chunk::NodeLayout::VAN_EMDE_BOAS: return "VAN_EMDE_BOAS";
+	case bim::Chunk::NodeLayout::CLUSTERED: return "CLUSTERED";
+	}
+	return "UNKNOWN";
+}
+
+// Camera rays in 4x4 tiles, so each tile is one packet.
+static std::vector<Ray> createPrimaryRays(const Scene& _scene, int _width, int _height)
+{
+	Vec3 dir = normalize(_scene.cameraLookAt - _scene.cameraPosition);
+	Vec3 right = normalize(cross(Vec3(0.0f, 1.0f, 0.0f), dir));
+	Vec3 up = cross(dir, right);
+	float tanFov = tan(0.5f * 1.0f);
+	float aspect = _width / float(_height);
+	std::vector<Ray> rays;
+	rays.reserve(_width * _height);
+	for(int ty = 0; ty < _height; ty += 4)
+		for(int tx = 0; tx < _width; tx += 4)
+			for(int y = ty; y < min(ty + 4, _height); ++y)
+				for(int x = tx; x < min(tx + 4, _width); ++x)
+				{
+					float u = ((x + 0.5f) / _width * 2.0f - 1.0f) * tanFov * aspect;
+					float v = (1.0f - (y + 0.5f) / _height * 2.0f) * tanFov;
+					rays.push_back(Ray(_scene.cameraPosition, normalize(dir + u * right + v * up)));
+				}
+	return rays;
+}
+
+static Vec3 triangleNormal(const bim::Chunk& _chunk, uint32 _leafTriangle)
+{
+	const UVec4& tri = _chunk.getLeafNodes()[_leafTriangle];
+	const Vec3* pos = _chunk.getPositions();
+	return normalize(cross(pos[tri.y] - pos[tri.x], pos[tri.z] - pos[tri.x]));
+}
+
+// Run a query multiple times and return the best throughput in Mrays/s.
+template<typename F>
+static double measure(uint _numRays, int _passes, F _query)
+{
+	double best = 0.0;
+	for(int p = 0; p < _passes; ++p)
+	{
+		auto t0 = high_resolution_clock::now();
+		_query();
+		auto t1 = high_resolution_clock::now();
+		double seconds = duration_cast<duration<double>>(t1 - t0).count();
+		best = std::max(best, _numRays / std::max(seconds, 1e-9) * 1e-6);
+	}
+	return best;
+}
+
+static nlohmann::json benchmarkRays(const bim::Chunk& _chunk, const Scene& _scene, int _width, int _height, int _passes)
+{
+	nlohmann::json result;
+	std::vector<Ray> primary = createPrimaryRays(_scene, _width, _height);
+	uint num = (uint)primary.size();
+	std::vector<bim::Hit> hits(num);
+
+	result["primary"]["single"] = measure(num, _passes, [&]() {
+		_chunk.intersect(primary.data(), hits.data(), num);
+	});
+	result["primary"]["packet"] = measure(num, _passes, [&]() {
+		int numPackets = int(num + bim::Chunk::RAY_PACKET_SIZE - 1) / bim::Chunk::RAY_PACKET_SIZE;
+#pragma omp parallel for schedule(dynamic, 16)
+		for(int i = 0; i < numPackets; ++i)
+		{
+			uint first = i * bim::Chunk::RAY_PACKET_SIZE;
+			_chunk.intersectPacket(primary.data() + first, hits.data() + first, min(bim::Chunk::RAY_PACKET_SIZE, num - first));
+		}
+	});
+	result["primary"]["stream"] = measure(num, _passes, [&]() {
+		_chunk.intersectStream(primary.data(), hits.data(), num);
+	});
+
+	// Secondary rays start at the primary hit points
+	std::vector<Ray> diffuse;
+	std::vector<Ray> shadow;
+	std::vector<float> shadowDistance;
+	std::mt19937 rng(7);
+	std::uniform_real_distribution<float> rnd(0.0f, 1.0f);
+	for(uint i = 0; i < num; ++i)
+	{
+		if(hits[i].leafTriangle == 0xffffffff) continue;
+		Vec3 normal = triangleNormal(_chunk, hits[i].leafTriangle);
+		if(dot(normal, primary[i].direction) > 0.0f) normal = -normal;
+		Vec3 position = primary[i].origin + primary[i].direction * hits[i].distance + normal * 1e-4f;
+		// Cosine distributed direction around the normal
+		float phi = 2.0f * PI * rnd(rng);
+		float r2 = rnd(rng);
+		Vec3 t = normalize(cross(std::abs(normal.x) > 0.5f ? Vec3(0.0f, 1.0f, 0.0f) : Vec3(1.0f, 0.0f, 0.0f), normal));
+		Vec3 b = cross(normal, t);
+		Vec3 d = sqrt(r2) * (cos(phi) * t + sin(phi) * b) + sqrt(1.0f - r2) * normal;
+		diffuse.push_back(Ray(position, normalize(d)));
+		Vec3 toLight = _scene.lightPosition - position;
+		float dist = len(toLight);
+		shadow.push_back(Ray(position, toLight / dist));
+		shadowDistance.push_back(dist);
+	}
+
+	uint numDiffuse = (uint)diffuse.size();
+	std::vector<bim::Hit> diffuseHits(numDiffuse);
+	result["diffuse"]["single"] = measure(numDiffuse, _passes, [&]() {
+		_chunk.intersect(diffuse.data(), diffuseHits.data(), numDiffuse);
+	});
+	result["diffuse"]["stream"] = measure(numDiffuse, _passes, [&]() {
+		_chunk.intersectStream(diffuse.data(), diffuseHits.data(), numDiffuse);
+	});
+
+	uint numShadow = (uint)shadow.size();
+	std::unique_ptr<bool[]> occluded(new bool[max(1u, numShadow)]);
+	result["shadow"]["single"] = measure(numShadow, _passes, [&]() {
+#pragma omp parallel for schedule(dynamic, 64)
+		for(int i = 0; i < int(numShadow); ++i)
+			occluded[i] = _chunk.occluded(shadow[i], shadowDistance[i]);
+	});
+	result["shadow"]["packet"] = measure(numShadow, _passes, [&]() {
+		int numPackets = int(numShadow + bim::Chunk::RAY_PACKET_SIZE - 1) / bim::Chunk::RAY_PACKET_SIZE;
+#pragma omp parallel for schedule(dynamic, 16)
+		for(int i = 0; i < numPackets; ++i)
+		{
+			uint first = i * bim::Chunk::RAY_PACKET_SIZE;
+			_chunk.occludedPacket(shadow.data() + first, shadowDistance.data() + first, occluded.get() + first, min(bim::Chunk::RAY_PACKET_SIZE, numShadow - first));
+		}
+	});
+	result["numPrimaryRays"] = num;
+	result["numSecondaryRays"] = numDiffuse;
+	return result;
+}
+
+// ************************************************************************* //
+
+int main(int _numArgs, const char** _args)
+{
+	std::string outputFileName;
+	std::string sceneFilter;
+	std::string methodFilter;
+	int width = 512, height = 512;
+	int passes = 3;
+	float scale = 1.0f;
+	uint maxNumTrianglesPerLeaf = 2;
+	bool compareLayouts = false;
+	for(int i = 1; i < _numArgs; ++i)
+	{
+		if(_args[i][0] != '-') { bim::sendMessage(bim::MessageType::WARNING, "Ignoring input ", _args[i]); continue; }
+		switch(_args[i][1])
+		{
+		case 'o': outputFileName = _args[i] + 2;
+			break;
+		case 's': sceneFilter = _args[i] + 2;
+			break;
+		case 'm': methodFilter = _args[i] + 2;
+			break;
+		case 'r': if(sscanf(_args[i] + 2, "%d,%d", &width, &height) != 2) bim::sendMessage(bim::MessageType::WARNING, "Invalid resolution ", _args[i]);
+			break;
+		case 'p': passes = max(1, atoi(_args[i] + 2));
+			break;
+		case 'x': scale = max(0.01f, float(atof(_args[i] + 2)));
+			break;
+		case 't': maxNumTrianglesPerLeaf = atoi(_args[i] + 2);
+			break;
+		case 'l': compareLayouts = true;
+			break;
+		default:
+			bim::sendMessage(bim::MessageType::WARNING, "Unknown option in argument ", _args[i]);
+		}
+	}
+
+	typedef Scene (*SceneGenerator)(bim::Chunk&, float);
+	const SceneGenerator generators[] = {createSphereField, createTriangleSoup, createBoxRoom, createThinTriangles};
+	const bim::Chunk::BuildMethod methods[] = {bim::Chunk::BuildMethod::KD_TREE, bim::Chunk::BuildMethod::SAH, bim::Chunk::BuildMethod::SBVH};
+	const bim::Chunk::NodeLayout layouts[] = {bim::Chunk::NodeLayout::DEPTH_FIRST, bim::Chunk::NodeLayout::VAN_EMDE_BOAS, bim::Chunk::NodeLayout::CLUSTERED};
+
+	nlohmann::json report;
+	report["config"]["resolution"] = {width, height};
+	report["config"]["passes"] = passes;
+	report["config"]["scale"] = scale;
+	report["config"]["maxTrianglesPerLeaf"] = maxNumTrianglesPerLeaf;
+	report["scenes"] = nlohmann::json::array();
+	for(auto generator : generators)
+	{
+		bim::BinaryModel model(bim::Property::Val(bim::Property::POSITION | bim::Property::TRIANGLE_IDX | bim::Property::TRIANGLE_MAT));
+		model.makeChunkResident(IVec3(0));
+		bim::Chunk& chunk = *model.getChunk(IVec3(0));
+		Scene scene = generator(chunk, scale);
+		if(!sceneFilter.empty() && sceneFilter != scene.name)
+			continue;
+		bim::sendMessage(bim::MessageType::INFO, "Scene ", scene.name, ": ", chunk.getNumTriangles(), " triangles");
+
+		nlohmann::json sceneReport;
+		sceneReport["name"] = scene.name;
+		sceneReport["triangles"] = chunk.getNumTriangles();
+		sceneReport["builds"] = nlohmann::json::array();
+		for(auto method : methods)
+		{
+			if(!methodFilter.empty() && methodFilter != buildMethodName(method))
+				continue;
+			auto t0 = high_resolution_clock::now();
+			chunk.buildHierarchy(method, maxNumTrianglesPerLeaf);
+			auto t1 = high_resolution_clock::now();
+			// SBVH creates its boxes during the build
+			if(method != bim::Chunk::BuildMethod::SBVH)
+				chunk.computeBVHAABoxes();
+			auto t2 = high_resolution_clock::now();
+
+			nlohmann::json build;
+			build["method"] = buildMethodName(method);
+			build["buildTime"] = duration_cast<duration<double>>(t1 - t0).count();
+			build["boxTime"] = duration_cast<duration<double>>(t2 - t1).count();
+			bim::HierarchyStatistics stats = chunk.analyzeHierarchy();
+			build["nodes"] = chunk.getNumNodes();
+			build["leaves"] = stats.numLeafNodes;
+			build["leafTriangles"] = stats.numTriangleReferences;
+			build["treeLevels"] = chunk.getNumTreeLevels();
+			build["sahCost"] = stats.sahCost;
+			build["epo"] = stats.epo;
+			build["mrays"] = benchmarkRays(chunk, scene, width, height, passes);
+			bim::sendMessage(bim::MessageType::INFO, "    ", buildMethodName(method), ": ", build["buildTime"].get<double>(), " s, SAH ", build["sahCost"].get<float>(),
+				", primary ", build["mrays"]["primary"]["single"].get<double>(), " Mrays/s");
+			// The same hierarchy in other node orders (the builder's order is in "mrays")
+			if(compareLayouts)
+			{
+				for(auto layout : layouts)
+				{
+					auto t3 = high_resolution_clock::now();
+					chunk.reorderHierarchy(layout);
+					auto t4 = high_resolution_clock::now();
+					nlohmann::json& layoutReport = build["layouts"][nodeLayoutName(layout)];
+					layoutReport["reorderTime"] = duration_cast<duration<double>>(t4 - t3).count();
+					layoutReport["mrays"] = benchmarkRays(chunk, scene, width, height, passes);
+					bim::sendMessage(bim::MessageType::INFO, "        ", nodeLayoutName(layout), ": primary ",
+						layoutReport["mrays"]["primary"]["single"].get<double>(), " Mrays/s");
+				}
+			}
+			sceneReport["builds"].push_back(build);
+		}
+		report["scenes"].push_back(sceneReport);
+	}
+
+	if(outputFileName.empty())
+		std::cout << report.dump(4) << std::endl;
+	else {
+		std::ofstream file(outputFileName);
+		if(!file) { bim::sendMessage(bim::MessageType::ERROR, "Cannot open output file ", outputFileName.c_str()); return 1; }
+		file << report.dump(4) << std::endl;
+	}
+	return 0;
+}
@@ -240,9 +240,17 @@ int main(int _numArgs, const char** _args)
 	ei::IVec3 chunkGridRes(1);
 	bool computeAAB = false;
 	bool computeOB = false;
+	bool computeQAB = false;
+	bool computeSPH = false;
 	bool computeSGGX = false;
+	bool computeTRI = false;
+	bool computeLights = false;
 	bool flipUV = false;
 	uint maxNumTrianglesPerLeaf = 2;
+	uint optimizeIterations = 0;
+	bool reorder = false;
+	bim::Property::Val qormalFormat = bim::Property::DONT_CARE;
+	bim::Chunk::NodeLayout layout = bim::Chunk::NodeLayout::DEPTH_FIRST;
 	// Parse arguments now
 	for(int i = 1; i < _numArgs; ++i)
 	{
@@ -256,13 +264,28 @@ int main(int _numArgs, const char** _args)
 		case 'b':
 			if(strcmp("AAB", _args[i] + 2) == 0) computeAAB = true;
 			if(strcmp("OB", _args[i] + 2) == 0) computeOB = true;
+			if(strcmp("QAB", _args[i] + 2) == 0) computeQAB = true;
+			if(strcmp("SPH", _args[i] + 2) == 0) computeSPH = true;
 			break;
 		case 'c': if(strcmp("SGGX", _args[i] + 2) == 0) computeSGGX = true;
+			if(strcmp("TRI", _args[i] + 2) == 0) computeTRI = true;
+			if(strcmp("LIGHTS", _args[i] + 2) == 0) computeLights = true;
 			break;
 		case 'f': if(strcmp("lipUV", _args[i] + 2) == 0) flipUV = true;
 			break;
 		case 't': maxNumTrianglesPerLeaf = atoi(_args[i] + 2);
 			break;
+		case 'q': qormalFormat = strcmp("16", _args[i] + 2) == 0 ? bim::Property::QORMAL16 : bim::Property::QORMAL;
+			break;
+		case 'r': optimizeIterations = atoi(_args[i] + 2);
+			break;
+		case 'l':
+			reorder = true;
+			if(strcmp("DEPTH_FIRST", _args[i] + 2) == 0) layout = bim::Chunk::NodeLayout::DEPTH_FIRST;
+			else if(strcmp("VAN_EMDE_BOAS", _args[i] + 2) == 0) layout = bim::Chunk::NodeLayout::VAN_EMDE_BOAS;
+			else if(strcmp("CLUSTERED", _args[i] + 2) == 0) layout = bim::Chunk::NodeLayout::CLUSTERED;
+			else { bim::sendMessage(bim::MessageType::WARNING, "Unknown node layout ", _args[i] + 2); reorder = false; }
+			break;
 		default:
 			bim::sendMessage(bim::MessageType::WARNING, "Unknown option in argument ", _args[i]);
 		}
@@ -270,7 +293,7 @@ int main(int _numArgs, const char** _args)
 
 	// Consistency check of input arguments
 	if(inputModelFile.empty()) { bim::sendMessage(bim::MessageType::ERROR, "Input file must be given!"); return 1; }
-	if(!(computeAAB || computeOB)) { bim::sendMessage(bim::MessageType::ERROR, "No BVH type is given!"); return 1; }
+	if(!(computeAAB || computeOB || computeQAB || computeSPH)) { bim::sendMessage(bim::MessageType::ERROR, "No BVH type is given!"); return 1; }
 	if(chunkGridRes < 1) { bim::sendMessage(bim::MessageType::ERROR, "Invalid grid resolution!"); return 1; }
 
 	// Derive output file name
@@ -306,7 +329,7 @@ int main(int _numArgs, const char** _args)
 		if( mesh->GetNumColorChannels() > 0 ) properties = bim::Property::Val(properties | bim::Property::COLOR);
 		if( mesh->HasNormals() ) properties = bim::Property::Val(properties | bim::Property::NORMAL);
 		if( mesh->HasTangentsAndBitangents() ) properties = bim::Property::Val(properties | bim::Property::TANGENT | bim::Property::BITANGENT );
-		// TODO: Qormals
+		// Qormals are converted from the tangent space after the import (-q).
 
 		numVertices += mesh->mNumVertices;
 		numTriangles += mesh->mNumFaces;
@@ -337,7 +360,13 @@ int main(int _numArgs, const char** _args)
 		bim::sendMessage(bim::MessageType::INFO, "removing redundant vertices...");
 		model.getChunk(ei::IVec3(0))->removeRedundantVertices();
 		bim::sendMessage(bim::MessageType::INFO, "computing tangent space...");
-		model.getChunk(ei::IVec3(0))->computeTangentSpace(bim::Property::Val(bim::Property::NORMAL | bim::Property::TANGENT | bim::Property::BITANGENT), true);
+		if(qormalFormat == bim::Property::DONT_CARE)
+			model.getChunk(ei::IVec3(0))->computeTangentSpace(bim::Property::Val(bim::Property::NORMAL | bim::Property::TANGENT | bim::Property::BITANGENT), true);
+		else {
+			// Compute the full space to keep the imported vectors, then keep the qormals only.
+			model.getChunk(ei::IVec3(0))->computeTangentSpace(bim::Property::Val(bim::Property::NORMAL | bim::Property::TANGENT | bim::Property::BITANGENT | qormalFormat), true);
+			model.getChunk(ei::IVec3(0))->removeVertexProperties(bim::Property::Val(bim::Property::NORMAL | bim::Property::TANGENT | bim::Property::BITANGENT));
+		}
 		bim::sendMessage(bim::MessageType::INFO, "building BVH...");
 		t0 = high_resolution_clock::now();
 		model.getChunk(ei::IVec3(0))->buildHierarchy(method, maxNumTrianglesPerLeaf);
@@ -345,7 +374,11 @@ int main(int _numArgs, const char** _args)
 		bim::sendMessage(bim::MessageType::INFO, "Finished BVH structure in ", duration_cast<duration<float>>(t1-t0).count(), " s\n",
 				"    Max. tree depth: ", model.getChunk(ei::IVec3(0))->getNumTreeLevels());
 
-		if(computeAAB && method != bim::Chunk::BuildMethod::SBVH) {
+		// The optimization computes the AABoxes of the new hierarchy.
+		if(optimizeIterations > 0) {
+			bim::sendMessage(bim::MessageType::INFO, "optimizing BVH...");
+			model.getChunk(ei::IVec3(0))->optimizeHierarchy(optimizeIterations);
+		} else if(computeAAB && method != bim::Chunk::BuildMethod::SBVH) {
 			bim::sendMessage(bim::MessageType::INFO, "computing AABoxes...");
 			model.getChunk(ei::IVec3(0))->computeBVHAABoxes();
 		}
@@ -353,15 +386,32 @@ int main(int _numArgs, const char** _args)
 			bim::sendMessage(bim::MessageType::INFO, "computing OBoxes...");
 			model.getChunk(ei::IVec3(0))->computeBVHOBoxes();
 		}
+		if(computeSPH) {
+			bim::sendMessage(bim::MessageType::INFO, "computing spheres...");
+			model.getChunk(ei::IVec3(0))->computeBVHSpheres();
+		}
 		if(computeSGGX) {
 			bim::sendMessage(bim::MessageType::INFO, "computing SGGX NDFs...");
 			model.getChunk(ei::IVec3(0))->computeBVHSGGXApproximations();
 		}
+		if(computeTRI) {
+			bim::sendMessage(bim::MessageType::INFO, "computing leaf triangles...");
+			model.getChunk(ei::IVec3(0))->computeLeafTriangles();
+		}
+		if(computeQAB) {
+			bim::sendMessage(bim::MessageType::INFO, "computing compressed hierarchy...");
+			model.getChunk(ei::IVec3(0))->computeBVHCompressed();
+		}
+		if(reorder) {
+			bim::sendMessage(bim::MessageType::INFO, "reordering nodes...");
+			model.getChunk(ei::IVec3(0))->reorderHierarchy(layout);
+		}
 
 		t2 = high_resolution_clock::now();
 		bim::sendMessage(bim::MessageType::INFO, "Finished BVH nodes in ", duration_cast<duration<float>>(t2-t1).count(), " s");
 	}
 	// Set an accelerator if possible. Prefer AABOX (last line will win if multiple BVH are given)
+	if(computeSPH) model.setAccelerator(bim::Property::SPHERE_BVH);
 	if(computeOB) model.setAccelerator(bim::Property::OBOX_BVH);
 	if(computeAAB) model.setAccelerator(bim::Property::AABOX_BVH);
 
@@ -376,11 +426,31 @@ int main(int _numArgs, const char** _args)
 		scenario->addLight(light);
 		scenario->setCamera(cam);
 	}
+	if(computeLights) {
+		bim::sendMessage(bim::MessageType::INFO, "building light trees...");
+		model.buildLightTrees();
+	}
 
 	bim::sendMessage(bim::MessageType::INFO, "storing model...");
 	model.storeEnvironmentFile(outputJsonFile.c_str(), outputBimFile.c_str());
 	model.storeBinaryHeader(outputBimFile.c_str());
 	//foreach chunk
 	model.storeChunk(outputBimFile.c_str(), ei::IVec3(0));
+
+	if(computeLights) {
+		// The lights pass through the JSON file. Make sure that the stored trees
+		// are still accepted on load.
+		bim::BinaryModel reloaded;
+		if(reloaded.load(outputJsonFile.c_str(), bim::Property::DONT_CARE))
+		{
+			for(uint i = 0; i < model.getNumScenarios(); ++i)
+			{
+				const bim::Scenario* scenario = model.getScenario(i);
+				const bim::Scenario* loaded = reloaded.getScenario(scenario->getName());
+				if(!scenario->getLightTree().isEmpty() && (!loaded || loaded->getLightTree().isEmpty()))
+					bim::sendMessage(bim::MessageType::WARNING, "The light tree of scenario ", scenario->getName(), " is not restored on load.");
+			}
+		}
+	}
 	return 0;
 }
\ No newline at end of file